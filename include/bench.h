@@ -0,0 +1,10 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "include/types.h"
+
+// Compares hit_bounding_boxes_scalar() against hit_bounding_boxes_simd().
+// Returns false if the two paths disagree.
+bool bench_box_tests();
+
+#endif
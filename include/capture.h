@@ -0,0 +1,62 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/renderer.h"
+
+#define CAPTURE_MAGIC 0x5041434E
+#define CAPTURE_VERSION 1
+#define CAPTURE_BATCH_CAP 4
+
+// File layout: header, entries, vertices, cubes, bone palettes of the rigged models in entry order,
+// then every static batch the entries draw as its id, vertex count and vertices.
+struct CaptureHeader
+{
+    u32 magic;
+    u32 version;
+
+    RenderSettings settings;
+    TextureHandle white;
+    V3 camera_pos;
+    V3 camera_up;
+    V3 camera_right;
+    Mat4 proj;
+
+    u32 entry_size;
+    u32 vert_count;
+    u32 cube_count;
+    u32 bone_count;
+    u32 batch_count;
+};
+
+struct CaptureBatch
+{
+    StaticBatchHandle handle;
+    u32 vertex_count;
+    Vertex* vertices;
+};
+
+// A loaded capture, the pointers inside the entries already point into bone_trans
+struct CaptureFrame
+{
+    CaptureHeader header;
+    u8* entries;
+    Vertex* verts;
+    CubeInstance* cubes;
+    Mat4* bone_trans;
+    CaptureBatch batches[CAPTURE_BATCH_CAP];
+};
+
+// Wraps the backend, so static batches loaded through it can be written to captures later.
+// Textures and models are not captured, replays load the same assets in the same order instead.
+RenderBackend capture_backend(RenderBackend backend);
+
+bool capture_frame(CommandBuffer* buffer, const char* path);
+bool load_capture(CaptureFrame* frame, const char* path, Arena* arena);
+
+// Feeds the frames to render_backend round robin until frame_count frames are rendered,
+// then prints the time spent in every pass
+void replay_captures(CaptureFrame* frames, u32 count, u32 frame_count);
+
+#endif
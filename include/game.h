@@ -5,11 +5,20 @@
 #include "include/arena.h"
 #include "include/renderer.h"
 #include "include/camera.h"
+#include "include/util.h"
+#include "include/visibility.h"
 #include <string>
 
 #define ENTITY_CAP 1000
 #define ACCESS_ENITTY_CAP 100
 
+#define GRID_CELL_CAP BOX_BATCH_WIDTH
+#define GRID_QUERY_CAP 64
+
+#define RAYCAST_BOUNCE_CAP 16
+#define RAYCAST_HIT_CAP 8
+#define ENEMY_RAY_COUNT 40
+
 #define ENEMY_VISION    (1 << EntityType_Player) | (1 << EntityType_Wall) |     \
                         (1 << EntityType_Crate) | (1 << EntityType_Objective) |  \
                         (1 << EntityType_Enemy) | (1 << EntityType_MirrorWall) | \
@@ -46,6 +55,30 @@ struct RaycastResult
     V3 hit_pos;
     Entity* directly_hit_entity;
     Entity* final_hit_entity;
+
+    // Where the ray started, got reflected and ended
+    u32 point_count;
+    V3 points[RAYCAST_BOUNCE_CAP + 2];
+};
+
+struct RaycastHit
+{
+    float t;
+    V3 pos;
+    Entity* entity;
+};
+
+// Entities a raycast treats differently from their collider. Lets a ray look past
+// things without writing to the entities, so rays can be cast from multiple threads.
+struct RaycastExclusion
+{
+    // Mirrors already on the bounce path, they stop the ray instead of reflecting it
+    u32 opaque_count;
+    Entity* opaque[RAYCAST_BOUNCE_CAP];
+
+    // Camouflaged entities the ray already looked past
+    u32 transparent_count;
+    Entity* transparent[RAYCAST_BOUNCE_CAP];
 };
 
 enum EntityType
@@ -105,31 +138,67 @@ struct Entity
     TextureHandle texture;
     bool transparent;
 
-    // If a ray hits a mirror, the mirror stores the ray that bounces away from the mirror.
-    RaycastResult last_raycast;
-
     union {
         Objective objective;
     };
 };
 
+// Every entity is registered in each tile its collider overlaps.
+// boxes mirrors pos and float_radius of the entities for batched ray tests.
+struct GridCell
+{
+    u32 entity_count;
+    u16 entities[GRID_CELL_CAP];
+    BoxBatch boxes;
+};
+
 struct EntityList
 {
     u32 entity_count;
     EntityRef entity_refs[ACCESS_ENITTY_CAP];
 };
 
+// Filled in on worker threads, see game_update()
+struct EnemyVision
+{
+    Entity* enemy;
+    V3 facing;
+    V3 side;
+    float fov;
+
+    bool sees_player;
+    RaycastResult rays[ENEMY_RAY_COUNT - 1];
+    VisibilityPolygon polygon;
+    // Enemies never leave their tile, so the edges around them only change when something moves
+    VisibilityCache cache;
+};
+
 struct Game
 {
     u32 width;
     u32 height;
 
+    // width * height tiles, see grid_query()
+    GridCell* grid;
+
+    // Static colliders never move after game_init(), everything else is listed in dynamic.
+    u32 dynamic_count;
+    u16* dynamic;
+
     Entity* entities;
     u32 entity_count;
 
     EntityRef player;
     EntityList enemies;
     EntityList objectives;
+    // One per enemy
+    EnemyVision* vision;
+    // Outlines of everything enemies can not see through, statics first
+    u32 static_edge_count;
+    u32 edge_count;
+    VisibilityEdge* edges;
+    // Bumped whenever a moveable edge changes, vision caches get rebuilt then
+    u32 edge_generation;
 
     Camera camera;
     u32 camera_state;
@@ -144,7 +213,14 @@ void game_init(Game* game, Arena* arena, const char* stage, TextureHandle white)
 void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderGroup* dbg);
 void game_render(Game* game, RenderGroup* group, RenderGroup* transparent, RenderGroup* dbg);
 
+// All hits up to and including the first one that blocks the ray (anything not camouflaged), 
+// sorted by distance. At most limit, returns the number of hits.
+u32 raycast_all(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RaycastExclusion* exclusion,
+                RaycastHit* hits, u32 limit);
+RaycastResult raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, 
+                      RaycastExclusion* exclusion);
 RaycastResult game_raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RenderGroup* dbg);
+void push_raycast(RenderGroup* dbg, RaycastResult* res);
 
 void game_reset_camera(Game* game);
 void game_toggle_camera_state(Game* game);
@@ -155,4 +231,14 @@ void push_entity_to_list(EntityList* list, EntityRef ref);
 
 void move_and_collide(Entity* entity, V2int dir, Game* game);
 
+void grid_insert(Entity* entity, Game* game);
+void grid_remove(Entity* entity, Game* game);
+void grid_move(Entity* entity, V2int new_pos, Game* game);
+u32 grid_query(V2int pos, V2int radius, u16* result, Game* game);
+
+void init_vision_edges(Game* game, Arena* arena);
+void update_vision_edges(Game* game);
+
+void load_level_batch(Game* game, Arena* arena);
+
 #endif
@@ -34,6 +34,15 @@ inline u32 int_max(int a, int b)
     return a > b? a : b;
 }
 
+inline i32 int_clamp(i32 value, i32 min, i32 max)
+{
+    if (value >= max)
+        return max;
+    else if (value <= min)
+        return min;
+    return value;
+}
+
 inline V3 cross(V3 a, V3 b)
 {
     V3 result;
@@ -48,6 +57,17 @@ inline float dot(V3 a, V3 b)
     return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
+inline float dot(V2 a, V2 b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
+// z of the 3d cross product
+inline float cross(V2 a, V2 b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
 V3 norm(V3 a);
 V2 norm(V2 a);
 float radians(float degrees);
@@ -0,0 +1,33 @@
+#ifndef NULL_RENDERER_H
+#define NULL_RENDERER_H
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/renderer.h"
+
+// Summed over every frame since null_init()
+struct NullRenderStats
+{
+    u32 frames;
+    // Entries that would have broken the opengl backend
+    u32 errors;
+
+    u64 entries;
+    u64 draws;
+    u64 quads;
+    u64 cubes;
+    u64 vertices;
+    // Program, render flag or model switches between draws, in the order opengl would submit them
+    u64 state_changes;
+    u64 lights;
+    u64 light_passes;
+    // Uniform calls the lit draws made before the light block, see LIT_UNIFORM_CALLS
+    u64 uniform_calls_saved;
+};
+
+// Walks and validates command buffers without touching the gpu. Loads only hand out handles.
+void null_init();
+RenderBackend null_backend();
+NullRenderStats null_stats();
+
+#endif
@@ -7,10 +7,36 @@
 
 #define MESH_CAP 16
 #define MODEL_CAP 8
+#define STATIC_BATCH_CAP 4
 
-#define SHADOW_MAP_COUNT 6
-#define MAX_SPOTLIGHTS 6
+// Streamed vertices and cubes live in persistently mapped buffers, split into one region per frame
+// in flight. The vertex regions start at STREAM_VERT_CAP and double whenever a frame outgrows them.
+#define STREAM_FRAME_COUNT 3
+#define STREAM_VERT_CAP 100000
+#define STREAM_CUBE_CAP 10000
+
+// Every spotlight on screen lights the scene, only the nearest SHADOW_MAP_COUNT of them get a
+// shadow map layer.
+#define SHADOW_MAP_COUNT 16
 #define SHADOW_MAP_SIZE 1024
+#define SHADOW_CACHE_SIZE 512
+// Cache cubes, more than there are shadow maps so lights that leave the screen for a while keep theirs.
+// 16 bit depth keeps them at the memory of 32 bit SHADOW_MAP_COUNT cubes.
+#define SHADOW_CACHE_COUNT (2 * SHADOW_MAP_COUNT)
+#define SHADOW_NEAR_PLANE 0.25
+#define NO_SHADOW_MAP 0xFFFFFFFF
+#define LIGHT_BINDING 0
+#define CLUSTER_BINDING 1
+
+// Screen tiles times exponential view depth slices between CLUSTER_NEAR and CLUSTER_FAR
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_NEAR 0.1
+#define CLUSTER_FAR 1000.0
+// Texture unit of the shadow map array in the lit shaders
+#define SHADOW_MAP_UNIT 1
 
 #define FRAMEBUFFER_INITIALIZED (1 << 0)
 #define FRAMEBUFFER_MULTISAMPLED (1 << 1)
@@ -32,15 +58,77 @@ struct Model
     u32 mesh_count;
 };
 
+// Static casters around a light, as distance / far_plane in its cube of the cache array. The light 
+// can turn freely, the cache only gets redrawn once it stopped somewhere else or the level changed.
+struct ShadowCache
+{
+    // Push index of the light that owns the cube, -1 while nobody does
+    i32 light;
+    // Last frame the light had a shadow map, the longest unused cube goes to the next new light
+    u32 used_frame;
+
+    bool valid;
+    V3 pos;
+    float far_plane;
+    u32 static_generation;
+
+    // Where the light was last frame
+    V3 last_pos;
+};
+
+struct StaticBatch
+{
+    u32 vao;
+    u32 vertex_buffer;
+    u32 index_count;
+
+    V3 bounds_min;
+    V3 bounds_max;
+};
+
+// std430 layout of the Lights buffer in the shaders
+struct GpuSpotLight
+{
+    Mat4 light_space;
+    // xyz position, w fov
+    float pos[4];
+    // xyz direction, w far plane
+    float dir[4];
+    // Layer in the shadow map array, NO_SHADOW_MAP for unshadowed lights
+    u32 shadow_map;
+    u32 pad[3];
+};
+
+// Followed by count GpuSpotLights
+struct LightBuffer
+{
+    u32 count;
+    u32 pad[3];
+};
+
+// std430 layout of the Clusters buffer in the shaders
+struct ClusterBuffer
+{
+    // Tiles per pixel in xy, slice = log(view depth) * z + w
+    float scale[4];
+    // Offset and count in the light indices that follow the buffer
+    u32 clusters[CLUSTER_COUNT][2];
+};
+
 struct SpotLight
 {
     V3 pos;
     V3 dir;
     float fov;
+    float far_plane;
 
     Mat4 light_space;
 
+    // Layer in the shadow map array, NO_SHADOW_MAP if the light did not get one
     u32 shadow_map;
+    // Order the light was pushed in. Stays the same from frame to frame as long as the game pushes
+    // its lights in the same order, unlike shadow_map which depends on what is on screen.
+    u32 id;
 };
 
 
@@ -52,13 +140,16 @@ struct Program
     u32 trans;
     u32 camera_pos;
 
+    // Only the shadow shaders, everything else reads the light block
     u32 light_space;
-    u32 shadow_map;
-
-    u32 spotlight_count;
-    u32 spotlight_pos;
-    u32 spotlight_dir;
-    u32 spotlight_fov;
+    u32 inv_light_space;
+    u32 light_pos;
+    u32 far_plane;
+    // Shadow map layer per instance
+    u32 layers;
+    u32 layer_count;
+    // Cache cube per shadow map layer
+    u32 cache_cubes;
 
     u32 bone_trans;
 };
@@ -77,35 +168,70 @@ struct OpenGLContext
 {
     RenderSettings prev_settings;
     u32 vertex_buffer;
+    u32 quad_indices;
+    u32 cube_buffer;
+    Vertex* mapped_verts;
+    u32 stream_vert_cap;
+    CubeInstance* mapped_cubes;
+    u32 stream_frame;
+    // GLsync of the last frame that used each region
+    void* stream_fences[STREAM_FRAME_COUNT];
+    u32 cube_mesh;
+    u32 cube_indices;
+    u32 light_buffer;
+    u32 cluster_buffer;
+    // Sizes of their storage in bytes, both grow with the lights on screen
+    u32 light_buffer_size;
+    u32 cluster_buffer_size;
 
     Arena render_arena;
     Program model_shader;
     Program rigged_model_shader;
     Program quad_shader;
+    Program cube_shader;
     Program post_shader;
     Program shadow_shader;
+    Program shadow_cubes_shader;
+    Program shadow_cube_shader;
+    Program shadow_composite_shader;
 
     Framebuffer main_framebuffer;
     Framebuffer post_framebuffer;
 
     u32 quad_vao;
+    u32 cube_vao;
     u32 post_vao;
-
-    Framebuffer shadow_maps[SHADOW_MAP_COUNT];
-    u64 shadow_map_handles[SHADOW_MAP_COUNT];
+    // Cube instances repeated once per shadow map layer
+    u32 shadow_cube_vao;
+    u32 shadow_cube_divisor;
+
+    // One depth layer per spotlight, all of them drawn in a single layered pass
+    u32 shadow_framebuffer;
+    u32 shadow_maps;
+    u32 shadow_cache_framebuffer;
+    u32 shadow_cache_maps;
+    ShadowCache shadow_caches[SHADOW_CACHE_COUNT];
+    u32 shadow_frame;
+    // Bumped whenever a static batch changes, which invalidates all shadow caches
+    u32 static_generation;
 
     u32 mesh_count;
     Mesh meshes[MESH_CAP];
     u32 model_count;
     Model models[MODEL_CAP];
+    u32 static_batch_count;
+    StaticBatch static_batches[STATIC_BATCH_CAP];
 
     i32 max_samples;
 };
 
 void opengl_init();
+RenderBackend opengl_backend();
+StreamRegion opengl_begin_frame(u32 vert_hint);
 void opengl_render_commands(CommandBuffer* buffer);
 
 void opengl_load_texture(TextureLoadOp* load_op);
 void opengl_load_model(ModelLoadOp* load_op);
+void opengl_load_static_batch(StaticBatchLoadOp* load_op);
 
 #endif
@@ -8,6 +8,14 @@ enum LogTarget
     LogTarget_GameRaycast,
     LogTarget_Backend,
     LogTarget_InterpolatePose,
+    // Parts of LogTarget_Backend, cpu side only
+    LogTarget_ShadowPass,
+    LogTarget_MainPass,
+    LogTarget_PostPass,
+    // Every job the scheduler ran, on any thread
+    LogTarget_Job,
+    // Counter only, see log_count()
+    LogTarget_UniformCallsSaved,
 
     LogTarget_Count
 };
@@ -29,10 +37,20 @@ struct FrameLog
     LogEntry entries[LogTarget_Count];
 };
 
+// Returns current wall time in seconds
+double wall_time();
+
 void start_frame();
 void end_frame();
 
 LogEntryInfo start_log(LogTarget target);
 void end_log(LogEntryInfo info);
+// Adds to the count of a target without timing anything
+void log_count(LogTarget target, u32 count);
+
+// Every thread logs into its own entries. Workers hand theirs over with collect_log(),
+// which also clears them, the main thread adds them to the frame with merge_log().
+void collect_log(FrameLog* log);
+void merge_log(FrameLog* log);
 
 #endif 
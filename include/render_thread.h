@@ -0,0 +1,24 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/renderer.h"
+
+struct GLFWwindow;
+
+// Frames the main thread can be ahead of the render thread: one gets recorded while the other renders
+#define RENDER_SLOT_COUNT 2
+
+// Moves backend onto its own thread, which takes over the gl context of window. The returned backend
+// hands the main thread cpu side streams, render_commands() only queues the frame. Loads wait until done.
+// begin_frame() of frame n + 2 waits until frame n is rendered, so the main thread has to keep one
+// frame arena per slot and only dispose it after begin_frame() returned, see render_slot().
+// Profiler logs of the render thread come back with their slot, so backend timings show up two frames late.
+RenderBackend start_render_thread(GLFWwindow* window, RenderBackend backend);
+void stop_render_thread();
+
+// Slot the last begin_frame() handed out
+u32 render_slot();
+
+#endif
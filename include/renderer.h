@@ -3,6 +3,7 @@
 
 #include "include/types.h"
 #include "include/arena.h"
+#include "include/util.h"
 
 #define MAX_BONE_INFLUENCE 3
 
@@ -13,6 +14,35 @@
 #define RENDER_LIT (1 << 1)
 #define RENDER_CULLING (1 << 2)
 #define RENDER_SHADOW_CASTER (1 << 3)
+// Drawn after everything opaque, back to front. Every push gets its own entry.
+#define RENDER_TRANSPARENT (1 << 4)
+
+// Sort key layout, from the most significant bit down:
+// pass (2), shader (4), render flags (6), material (16), depth (24), unused (12)
+// The transparent pass puts the inverted depth right after the pass:
+// pass (2), inverted depth (24), shader (4), render flags (6), material (16), unused (12)
+#define SORT_DEPTH_BITS 24
+#define SORT_DEPTH_RANGE 1000.0f
+
+// Smallest chunk the command buffer grows by once its first one is full
+#define COMMAND_CHUNK_SIZE 16384
+#define VERTEX_CHUNK_SIZE 16384
+
+enum RenderPass
+{
+    RenderPass_Opaque,
+    RenderPass_Transparent,
+    // Everything without depth test
+    RenderPass_Overlay,
+};
+
+enum RenderShader
+{
+    RenderShader_Quad,
+    RenderShader_Cube,
+    RenderShader_Model,
+    RenderShader_RiggedModel,
+};
 
 struct RenderGroup;
 
@@ -26,6 +56,16 @@ struct Vertex
     u64 texture;
 };
 
+// One cube, expanded from a unit cube on the gpu
+struct CubeInstance
+{
+    V3 pos;
+    V3 radius;
+    V3 color;
+
+    u64 texture;
+};
+
 struct MeshVertex
 {
     V3 pos;
@@ -60,6 +100,12 @@ struct ModelHandle
     u32 id;
 };
 
+// 0 means not loaded yet
+struct StaticBatchHandle
+{
+    u32 id;
+};
+
 struct RiggedModelHandle
 {
     ModelHandle model;
@@ -94,6 +140,16 @@ struct ModelLoadOp
     MeshInfo* meshes;
 };
 
+// Quads (4 vertices in strip order each) that stay put for a whole level.
+// Loading into a handle that is already loaded replaces its quads.
+struct StaticBatchLoadOp
+{
+    StaticBatchHandle* handle;
+
+    u32 vertex_count;
+    Vertex* vertices;
+};
+
 struct RenderSetup
 {
     u32 flags;
@@ -103,6 +159,8 @@ enum CommandEntryType
 {
     EntryType_Clear,
     EntryType_DrawQuads,
+    EntryType_DrawCubes,
+    EntryType_DrawStaticBatch,
     EntryType_DrawModel,
     EntryType_DrawRiggedModel,
     EntryType_PushLight,
@@ -111,6 +169,8 @@ enum CommandEntryType
 struct CommandEntryHeader
 {
     u32 type;
+    // Only used by draws
+    u64 sort_key;
 };
 
 struct RenderSettings
@@ -119,16 +179,42 @@ struct RenderSettings
     u32 height;
 };
 
+// Entries never straddle two chunks
+struct CommandChunk
+{
+    CommandChunk* next;
+    u8* data;
+    u32 size;
+    u32 cap;
+};
+
+// Vertices of a chunk follow the ones of the previous chunk, vert_offset counts across all of them
+struct VertexChunk
+{
+    VertexChunk* next;
+    Vertex* verts;
+    u32 count;
+    u32 cap;
+};
+
 struct CommandBuffer
 {
     RenderSettings settings;
-    
-    Vertex* vert_buffer;
+    // Chunks past the first ones come from here
+    Arena* arena;
+
+    VertexChunk* first_verts;
+    VertexChunk* verts;
     u32 vert_count;
-    u32 vert_cap;
 
-    u8* entry_buffer;
-    u32 entry_cap;
+    CubeInstance* cube_buffer;
+    // Bounds of every cube, so the backend can cull shadow casters without reading mapped memory
+    BoxBatch* cube_bounds;
+    u32 cube_count;
+    u32 cube_cap;
+
+    CommandChunk* first_chunk;
+    CommandChunk* chunk;
     u32 entry_size;
 
     TextureHandle white;
@@ -138,7 +224,9 @@ struct CommandBuffer
     V3 camera_right;
     Mat4 proj;
 
+    // Group and type of the last entry, draws get appended to it while they match
     RenderGroup* active_group;
+    u32 active_type;
 };
 
 struct CommandEntryClear
@@ -153,6 +241,24 @@ struct CommandEntryDrawQuads
     u32 vert_offset;
     u32 quad_count;
     RenderSetup setup;
+
+    V3 bounds_min;
+    V3 bounds_max;
+};
+
+struct CommandEntryDrawCubes
+{
+    CommandEntryHeader header;
+    u32 cube_offset;
+    u32 cube_count;
+    RenderSetup setup;
+};
+
+struct CommandEntryDrawStaticBatch
+{
+    CommandEntryHeader header;
+    StaticBatchHandle batch;
+    RenderSetup setup;
 };
 
 struct CommandEntryDrawModel
@@ -183,25 +289,74 @@ struct CommandEntryPushLight
     Mat4 light_space;
 
     float fov;
+    float far_plane;
+};
+
+// High-water marks over all frames so far, the next command buffer gets sized to fit them
+struct CommandBufferPeak
+{
+    u32 entry_size;
+    u32 vert_count;
+};
+
+// Where the command buffer of the current frame writes its vertices and cubes to
+// Gets read back when the frame spills or is captured, so a gpu mapping has to be readable
+struct StreamRegion
+{
+    Vertex* verts;
+    u32 vert_cap;
+    CubeInstance* cubes;
+    u32 cube_cap;
+};
+
+// Everything the game needs from a backend, see opengl_backend() and null_backend()
+struct RenderBackend
+{
+    StreamRegion (*begin_frame)(u32 vert_hint);
+    void (*render_commands)(CommandBuffer* buffer);
+
+    void (*load_texture)(TextureLoadOp* load_op);
+    void (*load_model)(ModelLoadOp* load_op);
+    void (*load_static_batch)(StaticBatchLoadOp* load_op);
 };
 
 struct RenderGroup
 {
     CommandBuffer* commands;
     CommandEntryDrawQuads* current_draw;
+    CommandEntryDrawCubes* current_cubes;
     RenderSetup setup;
 };
 
-CommandBuffer command_buffer(u32 entry_cap, u8* entry_buffer, u32 vert_cap, Vertex* vert_buffer, 
+CommandBuffer command_buffer(Arena* arena, u32 entry_cap, u32 vert_cap, Vertex* vert_buffer, 
+                             u32 cube_cap, CubeInstance* cube_buffer, BoxBatch* cube_bounds,
                              u32 width, u32 height, TextureHandle white,
                              Mat4 proj, V3 camera_pos, V3 camera_right, V3 camera_up);
 
 RenderGroup render_group(CommandBuffer* commands, u32 flags);
+void update_peak(CommandBufferPeak* peak, CommandBuffer* commands);
+// Raw space in the streams, the push_* functions below fill it in
+u8* push_entry(CommandBuffer* commands, u32 size);
+Vertex* push_verts(CommandBuffer* commands, u32 count);
+
+u64 sort_key(RenderSetup setup, u32 shader, u32 material, float depth);
+// Pass, shader, render flags and material of a key, what a backend switches state for
+u64 sort_key_state(u64 key);
+
+// Uniform calls a lit draw made before lights moved into a uniform block: the light count, then one
+// array upload each for light space, shadow map, position, direction and fov
+#define LIT_UNIFORM_CALLS 6
 
 void push_clear(CommandBuffer* buffer, V3 color);
 
 void push_cube(RenderGroup* group, V3 pos, V3 radius, TextureHandle texture, V3 color);
+// Room for count cubes in a row, returns the index of the first. Fill them with set_cube(), that can
+// happen from any thread as long as no two write the same index.
+u32 reserve_cubes(RenderGroup* group, u32 count, V3 sort_pos);
+void set_cube(CommandBuffer* commands, u32 index, V3 pos, V3 radius, TextureHandle texture, V3 color);
+void push_static_batch(RenderGroup* group, StaticBatchHandle handle);
 void push_model(RenderGroup* group, ModelHandle handle, V3 pos, V3 scale);
+// pose gets read when the frame is rendered, it has to come from the command buffer arena
 void push_rigged_model(RenderGroup* group, RiggedModelHandle* handle, Mat4* pose, V3 pos, V3 scale);
 void push_debug_pose(RenderGroup* group, Skeleton* sk, Mat4* pose, V3 pos, V3 scale);
 void push_line(RenderGroup* group, V3 start, V3 end, V3 color);
@@ -213,6 +368,8 @@ void free_texture_load_op(TextureLoadOp* load_op);
 ModelLoadOp model_load_op(ModelHandle* handle, const char* path, Arena* tmp);
 ModelLoadOp sk_model_load_op(RiggedModelHandle* handle, const char* path, Arena* tmp, Arena* assets); 
 
+extern RenderBackend render_backend;
+
 inline bool equal_settings(RenderSettings* a, RenderSettings* b) 
 {
     return (a->width == b->width) && (a->height == b->height);
@@ -246,6 +403,8 @@ struct AnimationNode
     u32 child_count;
     // NOTE: -1 means there is no bone belonging to this node
     i32 bone;
+    // Bone of the skeleton the animation was loaded for, -1 if none
+    i32 skeleton_bone;
 };
 
 struct Bone
@@ -270,7 +429,7 @@ struct Animation
     float tps;
 };
 
-Animation load_animation(const char* path, Arena* assets);
+Animation load_animation(const char* path, Skeleton* skeleton, Arena* assets);
 
 Mat4* default_pose(Skeleton* skeleton, Arena* arena);
 Mat4* interpolate_pose(Animation* animation, Skeleton* skeleton, Arena* arena, float t);
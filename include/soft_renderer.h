@@ -0,0 +1,138 @@
+#ifndef SOFT_RENDERER_H
+#define SOFT_RENDERER_H
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/renderer.h"
+
+// Tiles get rasterized in parallel, every triangle is binned into the tiles its bounds touch
+#define SOFT_TILE_SIZE 64
+#define SOFT_SHADOW_SIZE 512
+#define SOFT_TEXTURE_CAP 32
+#define SOFT_MESH_CAP 16
+#define SOFT_MODEL_CAP 8
+#define SOFT_STATIC_BATCH_CAP 4
+
+// Pixels tested per edge function evaluation, 8 when the build enables AVX2 (USE_AVX2 in CMakeLists.txt)
+#if defined(__AVX2__)
+#define SOFT_LANES 8
+#else
+#define SOFT_LANES 4
+#endif
+
+struct SoftTexture
+{
+    u32 width;
+    u32 height;
+    // RGBA, bottom row first
+    u32* pixels;
+};
+
+struct SoftMesh
+{
+    u32 vertex_count;
+    MeshVertex* vertices;
+    u32 index_count;
+    u32* indices;
+};
+
+struct SoftModel
+{
+    u32 mesh_offset;
+    u32 mesh_count;
+};
+
+struct SoftStaticBatch
+{
+    u32 vertex_count;
+    Vertex* vertices;
+};
+
+struct SoftLight
+{
+    V3 pos;
+    V3 dir;
+    float fov;
+    Mat4 light_space;
+
+    // Window depth, SOFT_SHADOW_SIZE squared. NULL past the nearest SHADOW_MAP_COUNT lights.
+    float* shadow_map;
+};
+
+// Everything the fragments interpolate
+struct SoftVertex
+{
+    glm::vec4 clip;
+    V3 world_pos;
+    V2 uv;
+    V3 norm;
+    V3 color;
+};
+
+struct SoftTriangle
+{
+    // Window coordinates, y up like gl_FragCoord
+    float x[3];
+    float y[3];
+    float z[3];
+    float inv_w[3];
+
+    // Edge i lies opposite of vertex i, a * x + b * y + c is >= 0 inside. Pixels exactly on an edge
+    // belong to only one of the two triangles sharing it, see own_edge.
+    float a[3];
+    float b[3];
+    float c[3];
+    u32 own_edge;
+    float inv_area;
+
+    i32 min_x;
+    i32 min_y;
+    i32 max_x;
+    i32 max_y;
+
+    SoftVertex v[3];
+    u64 texture;
+    u32 flags;
+    u32 shader;
+};
+
+struct SoftContext
+{
+    Arena arena;
+    // Reset after every frame
+    Arena frame_arena;
+
+    Vertex* verts;
+    u32 vert_cap;
+    CubeInstance* cubes;
+
+    u32 width;
+    u32 height;
+    V3* color;
+    float* depth;
+    // What soft_framebuffer() hands out, gamma corrected like the post shader does
+    u32* pixels;
+
+    u32 texture_count;
+    SoftTexture textures[SOFT_TEXTURE_CAP];
+    u32 mesh_count;
+    SoftMesh meshes[SOFT_MESH_CAP];
+    u32 model_count;
+    SoftModel models[SOFT_MODEL_CAP];
+    // Slot 0 stays unused like in the opengl backend
+    u32 static_batch_count;
+    SoftStaticBatch static_batches[SOFT_STATIC_BATCH_CAP];
+};
+
+// Rasterizes command buffers on the cpu, close to what the opengl backend draws
+void soft_init();
+RenderBackend soft_backend();
+
+// Last rendered frame, RGBA with the bottom row first
+u32* soft_framebuffer(u32* width, u32* height);
+bool soft_write_ppm(const char* path);
+
+// Renders buffer repeat times for 1, 2, 4... threads and prints the frame times
+void soft_report_scaling(CommandBuffer* buffer, u32 repeat);
+
+#endif
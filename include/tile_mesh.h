@@ -0,0 +1,38 @@
+#ifndef TILE_MESH_H
+#define TILE_MESH_H
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/renderer.h"
+
+struct MeshTile
+{
+    bool solid;
+    TextureHandle texture;
+    V3 color;
+};
+
+// Unit cubes, tile (x, y, z) is centered at (min_x + x, min_y + y, min_z + z)
+struct TileMap
+{
+    i32 min_x;
+    i32 min_y;
+    i32 min_z;
+    u32 width;
+    u32 height;
+    u32 depth;
+
+    // Indexed by (z * height + y) * width + x
+    MeshTile* tiles;
+};
+
+// Upper bound for the vertices mesh_tile_map() writes for map
+u32 tile_mesh_vertex_cap(TileMap* map);
+
+// Writes a quad (4 vertices in strip order) for every visible face of the map, neighbouring faces 
+// with the same texture and color get merged into one quad with repeating uvs. Faces between two
+// solid tiles and faces pointing down are dropped. Returns the number of vertices.
+// Scratch memory comes from arena.
+u32 mesh_tile_map(TileMap* map, Vertex* vertices, u32 vertex_cap, Arena* arena);
+
+#endif
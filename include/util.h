@@ -23,4 +23,57 @@ i32 read_int(const char** ptr);
 bool hit_bounding_box(V3 pos, V3 dir, V3 box_pos, V3 box_r, V3* hit, float* t);
 
 
+#define BOX_BATCH_WIDTH 8
+
+// Boxes packed for hit_bounding_boxes(). Lanes >= count are ignored.
+struct BoxBatch
+{
+    float pos_x[BOX_BATCH_WIDTH];
+    float pos_y[BOX_BATCH_WIDTH];
+    float pos_z[BOX_BATCH_WIDTH];
+    float radius_x[BOX_BATCH_WIDTH];
+    float radius_y[BOX_BATCH_WIDTH];
+    float radius_z[BOX_BATCH_WIDTH];
+};
+
+struct BoxBatchHits
+{
+    float t[BOX_BATCH_WIDTH];
+    float hit_x[BOX_BATCH_WIDTH];
+    float hit_y[BOX_BATCH_WIDTH];
+    float hit_z[BOX_BATCH_WIDTH];
+};
+
+void set_box(BoxBatch* batch, u32 lane, V3 box_pos, V3 box_r);
+
+// Same test as hit_bounding_box() for up to BOX_BATCH_WIDTH boxes at once.
+// Returns a bitmask of the lanes that got hit, hits holds t and hit position per lane.
+// The simd version uses AVX2 or SSE2 when available and gives identical results to the scalar one.
+// AVX2 is only there when the build enables it, see USE_AVX2 in CMakeLists.txt.
+u32 hit_bounding_boxes(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits);
+u32 hit_bounding_boxes_simd(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits);
+u32 hit_bounding_boxes_scalar(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits);
+
+
+// Planes as a * x + b * y + c * z + d >= 0 for points inside, packed for boxes_in_frustum()
+struct Frustum
+{
+    float a[6];
+    float b[6];
+    float c[6];
+    float d[6];
+};
+
+// Planes of the clip volume of a projection * view matrix, far plane included
+Frustum frustum(Mat4 clip);
+
+bool box_in_frustum(Frustum* frustum, V3 box_pos, V3 box_r);
+
+// Returns a bitmask of the lanes whose box is at least partially inside the frustum.
+// Boxes that only straddle two planes outside a corner are kept, like with box_in_frustum().
+u32 boxes_in_frustum(Frustum* frustum, BoxBatch* boxes, u32 count);
+u32 boxes_in_frustum_simd(Frustum* frustum, BoxBatch* boxes, u32 count);
+u32 boxes_in_frustum_scalar(Frustum* frustum, BoxBatch* boxes, u32 count);
+
+
 #endif
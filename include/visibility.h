@@ -0,0 +1,80 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include "include/types.h"
+
+#define VISIBILITY_EDGE_CAP 4096
+#define VISIBILITY_BUCKET_COUNT 256
+
+// Rays that hit nothing end this far away
+#define VISIBILITY_FAR 1000
+
+// One side of an occluder. Wound counter clockwise, so the occluder lies to the left of a -> b.
+struct VisibilityEdge
+{
+    V2 a;
+    V2 b;
+    u16 id;
+};
+
+struct VisibilityPoint
+{
+    // Relative to the center of the cone, counter clockwise
+    float angle;
+    V2 pos;
+    // Edge the ray stopped at, -1 if it hit nothing
+    i32 edge;
+};
+
+// Hits before the line through point with the given normal do not count.
+// Used for the view through a mirror, where rays start at the mirror surface.
+struct VisibilityClip
+{
+    V2 point;
+    V2 normal;
+};
+
+// Fan around origin, sorted by angle. Every pair of neighbouring points spans a wedge
+// that is visible up to the line between them.
+struct VisibilityPolygon
+{
+    V2 origin;
+    VisibilityClip* clip;
+
+    // Needs room for visibility_point_cap() of the edges it gets computed from
+    u32 point_count;
+    VisibilityPoint* points;
+};
+
+// Edges seen from a fixed origin in any direction. Everything further away than far[bucket] is
+// hidden in the whole angle bucket, so edges completely behind that can be skipped.
+struct VisibilityCache
+{
+    V2 origin;
+    u32 generation;
+    float far[VISIBILITY_BUCKET_COUNT];
+
+    u32 edge_count;
+    u16* edges;
+};
+
+// Both cone borders plus three rays around each end point of every edge
+u32 visibility_point_cap(u32 edge_count);
+
+// Casts one ray per edge end point (and just next to it) inside the cone of half_angle around dir,
+// so the result is exact no matter how thin the gaps between occluders are.
+// Only looks at the edges listed in subset if it is set, otherwise at the first edge_count edges.
+// Runs in a job, the edges it works on go to the scratch arena.
+void compute_visibility(VisibilityEdge* edges, u16* subset, u32 edge_count, V2 origin, V2 dir, 
+                        float half_angle, VisibilityClip* clip, VisibilityPolygon* polygon);
+
+// Fills cache with the edges that can be seen from origin. cache->edges needs room for edge_count ids.
+void build_visibility_cache(VisibilityCache* cache, VisibilityEdge* edges, u32 edge_count, V2 origin);
+
+// Writes the outline of wedge i (between point i and i + 1) to outline, returns the number of points
+u32 get_wedge(VisibilityPolygon* polygon, u32 i, V2* outline);
+
+// Separating axis test of a convex polygon against a box
+bool convex_overlaps_box(V2* points, u32 count, V2 min, V2 max);
+
+#endif
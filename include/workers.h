@@ -0,0 +1,48 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <atomic>
+#include <mutex>
+
+#include "include/types.h"
+#include "include/arena.h"
+#include "include/profiler.h"
+
+#define WORKER_CAP 8
+// Jobs a thread can have queued, run_job() runs them right away past that
+#define JOB_DEQUE_CAP 256
+
+typedef void (*ParallelFunc)(void* data, u32 index);
+
+// Jobs started with it still running, wait_for() returns once it is back to zero
+struct JobCounter
+{
+    std::atomic<u32> pending;
+
+    // Profiler logs of its jobs, from whichever thread ran them
+    std::mutex log_mutex;
+    FrameLog log;
+};
+
+// Starts one worker per spare hardware thread, at most WORKER_CAP. Every thread owns a deque of jobs,
+// it takes the newest job from its own and steals the oldest one from the others when that runs dry.
+void init_workers();
+
+// Queues func(data, index) on the calling thread, other threads may steal it. Threads that were
+// not started by init_workers() and are not the one that called it run the job right away.
+void run_job(ParallelFunc func, void* data, u32 index, JobCounter* counter);
+// Runs queued jobs until counter is done. Profiler logs of its jobs get merged into the caller's.
+void wait_for(JobCounter* counter);
+
+// Calls func(data, i) for every i in [0, count) spread over the workers and the calling thread.
+// Returns once all calls are done.
+void run_parallel(u32 count, ParallelFunc func, void* data);
+
+// Threads run_parallel() spreads over, the calling one included. Clamped to the started workers + 1.
+void set_thread_limit(u32 threads);
+u32 thread_count();
+
+// Temporary memory of the calling thread. Whatever a job pushes to it is gone once the job returns.
+Arena* scratch_arena();
+
+#endif
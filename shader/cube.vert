@@ -0,0 +1,32 @@
+#extension GL_ARB_bindless_texture: require
+
+// Unit cube
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aUv;
+layout(location = 2) in vec3 aNorm;
+
+// Per instance
+layout(location = 3) in vec3 aColor;
+layout(location = 4) in uvec2 aBaseColor;
+layout(location = 5) in vec3 aCubePos;
+layout(location = 6) in vec3 aRadius;
+
+uniform mat4 proj;
+
+out vec3 world_pos;
+out vec2 uv;
+out vec3 norm;
+out vec3 color;
+flat out uvec2 base_color;
+
+void main() {
+    vec3 pos = aCubePos + aPos * aRadius;
+
+    color = aColor;
+    uv = aUv;
+    norm = aNorm;
+    world_pos = pos;
+
+    base_color = aBaseColor;
+    gl_Position = proj * vec4(pos, 1);
+}
@@ -1,7 +1,6 @@
 #extension GL_ARB_bindless_texture: require
 
 #define SHADOW_BIAS 0.002
-#define MAX_SPOTLIGHTS 6
 
 in vec3 world_pos;
 in vec2 uv;
@@ -9,15 +8,37 @@ in vec3 norm;
 in vec3 color;
 flat in uvec2 base_color;
 
-in vec4 light_space_pos[MAX_SPOTLIGHTS];
-
 uniform vec3 camera_pos;
 
-uniform uint sl_count;
-uniform uvec2 shadowmap[MAX_SPOTLIGHTS];
-uniform vec3 sl_pos[MAX_SPOTLIGHTS];
-uniform vec3 sl_dir[MAX_SPOTLIGHTS];
-uniform float sl_fov[MAX_SPOTLIGHTS];
+struct SpotLight
+{
+    mat4 light_space;
+    // w is the fov
+    vec4 pos;
+    // w is the far plane
+    vec4 dir;
+    uint shadow_map;
+};
+
+// Written once per frame, see LightBuffer. Lights with a shadow map come first, light i draws into layer i.
+layout(std430, binding = 0) readonly buffer Lights
+{
+    uint sl_count;
+    SpotLight sl[];
+};
+
+// Lights of every view space cluster, see build_light_clusters()
+layout(std430, binding = 1) readonly buffer Clusters
+{
+    // Tiles per pixel in xy, slice = log(view depth) * z + w
+    vec4 cluster_scale;
+    // Offset and count in cluster_lights
+    uvec2 clusters[CLUSTER_X * CLUSTER_Y * CLUSTER_Z];
+    uint cluster_lights[];
+};
+
+// Layer sl[i].shadow_map belongs to light i
+layout(binding = 1) uniform sampler2DArrayShadow shadow_maps;
 
 out vec4 out_Color;
 
@@ -46,14 +67,11 @@ vec3 l = normalize(vec3(1, 2, 3));
 // End PBR
 
 
-float shadow_calc(vec4 light_space_pos, sampler2D shadowmap) {
+float shadow_calc(vec4 light_space_pos, uint layer) {
     vec3 proj_coords = light_space_pos.xyz / light_space_pos.w;
     proj_coords = proj_coords * 0.5 + 0.5;
-    float closest = texture(shadowmap, proj_coords.xy).r;
-    float curr = proj_coords.z;
-    float shadow = curr - SHADOW_BIAS < closest ? 1.0 : 0.0;
-
-    return shadow;
+    // Compares with GL_LESS, lit where curr - SHADOW_BIAS < closest
+    return texture(shadow_maps, vec4(proj_coords.xy, layer, proj_coords.z - SHADOW_BIAS));
 }
 
 void main() {
@@ -73,18 +91,27 @@ void main() {
     vec3 specular = vec3(1) * specular_int;
     vec3 light = ambient + 0.6 * diffuse + 0.5 * specular;
 
-    for (uint i = 0; i < sl_count; ++i) {
-        sampler2D shadowmap = sampler2D(shadowmap[i]);
-        vec3 pos = sl_pos[i];
-        vec3 dir = sl_dir[i];
-        float fov = sl_fov[i];
+    float depth = 1 / gl_FragCoord.w;
+    uint x = min(uint(gl_FragCoord.x * cluster_scale.x), CLUSTER_X - 1);
+    uint y = min(uint(gl_FragCoord.y * cluster_scale.y), CLUSTER_Y - 1);
+    uint z = uint(clamp(log(depth) * cluster_scale.z + cluster_scale.w, 0.0, float(CLUSTER_Z - 1)));
+    uvec2 cluster = clusters[x + CLUSTER_X * (y + CLUSTER_Y * z)];
+
+    for (uint c = 0; c < cluster.y; ++c) {
+        uint i = cluster_lights[cluster.x + c];
+        vec3 pos = sl[i].pos.xyz;
+        vec3 dir = sl[i].dir.xyz;
+        float fov = sl[i].pos.w;
 
         vec3 side = vec3(-dir.y, dir.x, dir.z);
         vec3 left = normalize(fov * side + (1 - fov) * dir);
 
         if (dot(dir, normalize(world_pos - pos)) > dot(dir, left)) {
             vec3 light_color = vec3(10.0, 1.4, 1.4) * clamp(dot(normalize(pos - world_pos), n), 0, 1);
-            light.rgb += light_color * shadow_calc(light_space_pos[i], shadowmap);
+            if (sl[i].shadow_map != NO_SHADOW_MAP) {
+                light_color *= shadow_calc(sl[i].light_space * vec4(world_pos, 1), sl[i].shadow_map);
+            }
+            light.rgb += light_color;
         }
     }
 
@@ -1,7 +1,30 @@
+#extension GL_ARB_shader_viewport_layer_array: require
+
 layout(location = 0) in vec3 aPos;
 
-uniform mat4 light_space;
+struct SpotLight
+{
+    mat4 light_space;
+    // w is the fov
+    vec4 pos;
+    // w is the far plane
+    vec4 dir;
+    uint shadow_map;
+};
+
+// Written once per frame, see LightBuffer. Lights with a shadow map come first, light i draws into layer i.
+layout(std430, binding = 0) readonly buffer Lights
+{
+    uint sl_count;
+    SpotLight sl[];
+};
+
+// Instance i draws into layers[i % layer_count]
+uniform uint layers[SHADOW_MAP_COUNT];
+uniform uint layer_count;
 
 void main() {
-    gl_Position = light_space * vec4(aPos, 1);
+    uint layer = layers[gl_InstanceID % layer_count];
+    gl_Layer = int(layer);
+    gl_Position = sl[layer].light_space * vec4(aPos, 1);
 }
@@ -0,0 +1,43 @@
+in vec2 uv;
+flat in uint layer;
+
+struct SpotLight
+{
+    mat4 light_space;
+    // w is the fov
+    vec4 pos;
+    // w is the far plane
+    vec4 dir;
+    uint shadow_map;
+};
+
+// Written once per frame, see LightBuffer. Lights with a shadow map come first, light i draws into layer i.
+layout(std430, binding = 0) readonly buffer Lights
+{
+    uint sl_count;
+    SpotLight sl[];
+};
+
+uniform mat4 inv_light_space[SHADOW_MAP_COUNT];
+
+// One cube per light, cache_cubes has the one of every shadow map layer
+uniform samplerCubeArray static_depth;
+uniform uint cache_cubes[SHADOW_MAP_COUNT];
+
+void main() {
+    vec3 light_pos = sl[layer].pos.xyz;
+    float far_plane = sl[layer].dir.w;
+
+    vec4 far_point = inv_light_space[layer] * vec4(uv * 2 - 1, 1, 1);
+    vec3 dir = normalize(far_point.xyz / far_point.w - light_pos);
+
+    float dist = texture(static_depth, vec4(dir, cache_cubes[layer])).r * far_plane;
+    if (dist >= far_plane) {
+        gl_FragDepth = 1;
+        return;
+    }
+
+    // Back into the depth the spotlight map would have had there
+    vec4 clip = sl[layer].light_space * vec4(light_pos + dir * dist, 1);
+    gl_FragDepth = clamp(clip.z / clip.w * 0.5 + 0.5, 0, 1);
+}
@@ -0,0 +1,16 @@
+#extension GL_ARB_shader_viewport_layer_array: require
+
+layout(location = 0) in vec2 aPos;
+
+uniform uint layers[SHADOW_MAP_COUNT];
+uniform uint layer_count;
+
+out vec2 uv;
+flat out uint layer;
+
+void main() {
+    layer = layers[gl_InstanceID % layer_count];
+    gl_Layer = int(layer);
+    uv = (aPos + 1) * 0.5;
+    gl_Position = vec4(aPos, 0, 1);
+}
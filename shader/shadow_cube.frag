@@ -0,0 +1,9 @@
+in vec3 world_pos;
+
+uniform vec3 light_pos;
+uniform float far_plane;
+
+void main() {
+    // Distance instead of depth, so every face of the cube map can be read the same way
+    gl_FragDepth = length(world_pos - light_pos) / far_plane;
+}
@@ -0,0 +1,10 @@
+layout(location = 0) in vec3 aPos;
+
+uniform mat4 light_space;
+
+out vec3 world_pos;
+
+void main() {
+    world_pos = aPos;
+    gl_Position = light_space * vec4(aPos, 1);
+}
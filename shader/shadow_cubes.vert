@@ -0,0 +1,34 @@
+#extension GL_ARB_shader_viewport_layer_array: require
+
+// Unit cube
+layout(location = 0) in vec3 aPos;
+
+// Per instance, every cube repeats layer_count times
+layout(location = 1) in vec3 aCubePos;
+layout(location = 2) in vec3 aRadius;
+
+struct SpotLight
+{
+    mat4 light_space;
+    // w is the fov
+    vec4 pos;
+    // w is the far plane
+    vec4 dir;
+    uint shadow_map;
+};
+
+// Written once per frame, see LightBuffer. Lights with a shadow map come first, light i draws into layer i.
+layout(std430, binding = 0) readonly buffer Lights
+{
+    uint sl_count;
+    SpotLight sl[];
+};
+
+uniform uint layers[SHADOW_MAP_COUNT];
+uniform uint layer_count;
+
+void main() {
+    uint layer = layers[gl_InstanceID % layer_count];
+    gl_Layer = int(layer);
+    gl_Position = sl[layer].light_space * vec4(aCubePos + aPos * aRadius, 1);
+}
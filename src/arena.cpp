@@ -4,8 +4,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <mutex>
+
 #include <include/game_math.h>
 
+// Arenas stay on their thread, but the render thread takes pages from the same pool
+std::mutex pool_mutex;
+
 // NOTE: I regret all of this :(
 void init_pool(MemoryPool* pool)
 {
@@ -24,7 +29,6 @@ void init_arena(Arena* arena, MemoryPool* pool)
     arena->size = 0;
     arena->tmp_size = 0;
     arena->tmp_current = 0;
-    pool->pages[arena->page].current = 0;
     arena->pool = pool;
 }
 
@@ -69,11 +73,13 @@ void end_tmp(Arena* arena)
 
     i32 page_ptr = arena->pool->pages[arena->tmp_page].next;
     while (page_ptr >= 0) {
+        // A freed page can be handed out again right away
+        i32 next = arena->pool->pages[page_ptr].next;
         free_page(arena->pool, page_ptr);
         if (page_ptr == arena->page) {
             break;
         }
-        page_ptr = arena->pool->pages[page_ptr].next;
+        page_ptr = next;
     }
 
 
@@ -100,6 +106,8 @@ void copy(Arena* arena, void* dst)
 
 i32 get_page(MemoryPool* pool, u32 min_size)
 {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
     // TODO: Handle this somehow
     assert(pool->free_count > 0);
 
@@ -143,6 +151,7 @@ i32 get_page(MemoryPool* pool, u32 min_size)
 
 void free_page(MemoryPool* pool, i32 page_id)
 {
+    std::lock_guard<std::mutex> lock(pool_mutex);
     pool->free_pages[pool->free_count] = page_id;
     pool->free_count++;
 }
@@ -151,8 +160,9 @@ void dispose(Arena* arena)
 {
     i32 page = arena->first;
     while (page >= 0) {
+        i32 next = arena->pool->pages[page].next;
         free_page(arena->pool, page);
-        page = arena->pool->pages[page].next;
+        page = next;
     }
     arena->first = -1;
     arena->page = -1;
@@ -0,0 +1,111 @@
+#include "include/bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "include/util.h"
+#include "include/profiler.h"
+
+#define BENCH_BATCH_COUNT 256
+#define BENCH_RAY_COUNT 256
+
+float random_float(float min, float max)
+{
+    return min + (max - min) * ((float) rand() / RAND_MAX);
+}
+
+double time_box_tests(u32 (*test)(V3, V3, BoxBatch*, u32, BoxBatchHits*), 
+                      V3* origins, V3* dirs, BoxBatch* batches, u32 count, u32 repeat, u32* checksum)
+{
+    BoxBatchHits hits;
+    u32 acc = 0;
+
+    double start = wall_time();
+    for (u32 r = 0; r < repeat; ++r) {
+        for (u32 i = 0; i < BENCH_RAY_COUNT; ++i) {
+            for (u32 j = 0; j < BENCH_BATCH_COUNT; ++j) {
+                acc += test(origins[i], dirs[i], batches + j, count, &hits);
+            }
+        }
+    }
+    double duration = wall_time() - start;
+
+    *checksum = acc;
+    return duration;
+}
+
+bool bench_box_tests()
+{
+    srand(1);
+
+    BoxBatch* batches = (BoxBatch*) malloc(sizeof(BoxBatch) * BENCH_BATCH_COUNT);
+    V3 origins[BENCH_RAY_COUNT];
+    V3 dirs[BENCH_RAY_COUNT];
+
+    // Stage like layout: unit tiles on a 64x64 grid, rays in the z = 1 plane
+    for (u32 i = 0; i < BENCH_BATCH_COUNT; ++i) {
+        for (u32 j = 0; j < BOX_BATCH_WIDTH; ++j) {
+            V3 pos = v3(floor(random_float(0, 64)), floor(random_float(0, 64)), 1);
+            V3 r = rand() % 4 ? v3(0.5, 0.5, 0.5) : v3(0.35, 0.35, 0.7);
+            set_box(batches + i, j, pos, r);
+        }
+    }
+
+    for (u32 i = 0; i < BENCH_RAY_COUNT; ++i) {
+        float angle = random_float(0, 2 * 3.1415926);
+        origins[i] = v3(floor(random_float(0, 64)), floor(random_float(0, 64)), 1);
+        dirs[i] = v3(sin(angle), cos(angle), 0);
+        // Axis aligned and diagonal rays hit the edge cases
+        if (i % 8 == 0) {
+            dirs[i] = v3(i % 16 ? 1 : 0.70710678, i % 16 ? 0 : 0.70710678, 0);
+        }
+    }
+
+    // Both paths have to agree bit for bit on every lane that got hit
+    u32 mismatches = 0;
+    for (u32 i = 0; i < BENCH_RAY_COUNT; ++i) {
+        for (u32 j = 0; j < BENCH_BATCH_COUNT; ++j) {
+            for (u32 count = 1; count <= BOX_BATCH_WIDTH; ++count) {
+                BoxBatchHits a;
+                BoxBatchHits b;
+                u32 mask_a = hit_bounding_boxes_scalar(origins[i], dirs[i], batches + j, count, &a);
+                u32 mask_b = hit_bounding_boxes_simd(origins[i], dirs[i], batches + j, count, &b);
+                if (mask_a != mask_b) {
+                    ++mismatches;
+                    continue;
+                }
+                for (u32 k = 0; k < count; ++k) {
+                    if ((mask_a & (1 << k)) && 
+                        (memcmp(&a.t[k], &b.t[k], sizeof(float)) || 
+                         memcmp(&a.hit_x[k], &b.hit_x[k], sizeof(float)) ||
+                         memcmp(&a.hit_y[k], &b.hit_y[k], sizeof(float)) ||
+                         memcmp(&a.hit_z[k], &b.hit_z[k], sizeof(float)))) {
+                        ++mismatches;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("Box tests: %u mismatches between scalar and simd\n", mismatches);
+
+    u32 repeat = 20;
+    for (u32 count = 1; count <= BOX_BATCH_WIDTH; count *= 2) {
+        u32 checksum_scalar;
+        u32 checksum_simd;
+        double scalar = time_box_tests(hit_bounding_boxes_scalar, origins, dirs, batches, count, 
+                                       repeat, &checksum_scalar);
+        double simd = time_box_tests(hit_bounding_boxes_simd, origins, dirs, batches, count, 
+                                     repeat, &checksum_simd);
+
+        double tests = (double) repeat * BENCH_RAY_COUNT * BENCH_BATCH_COUNT * count;
+        printf("%u boxes per batch: scalar %.2f ns/box, simd %.2f ns/box (%.2fx)%s\n", count, 
+               scalar * 1.0e9 / tests, simd * 1.0e9 / tests, scalar / simd,
+               checksum_scalar == checksum_simd ? "" : " checksum mismatch");
+    }
+
+    free(batches);
+    return mismatches == 0;
+}
@@ -0,0 +1,358 @@
+#include "include/capture.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "include/util.h"
+#include "include/game_math.h"
+#include "include/opengl_renderer.h"
+#include "include/profiler.h"
+
+struct CaptureContext
+{
+    RenderBackend backend;
+    Arena arena;
+    // Last load of every static batch, indexed by handle id
+    CaptureBatch batches[CAPTURE_BATCH_CAP];
+};
+
+CaptureContext capture;
+
+u32 command_entry_size(u32 type)
+{
+    switch (type) {
+        case EntryType_Clear: return sizeof(CommandEntryClear);
+        case EntryType_DrawQuads: return sizeof(CommandEntryDrawQuads);
+        case EntryType_DrawCubes: return sizeof(CommandEntryDrawCubes);
+        case EntryType_DrawStaticBatch: return sizeof(CommandEntryDrawStaticBatch);
+        case EntryType_DrawModel: return sizeof(CommandEntryDrawModel);
+        case EntryType_DrawRiggedModel: return sizeof(CommandEntryDrawRiggedModel);
+        case EntryType_PushLight: return sizeof(CommandEntryPushLight);
+    }
+    return 0;
+}
+
+void capture_load_static_batch(StaticBatchLoadOp* load_op)
+{
+    capture.backend.load_static_batch(load_op);
+
+    // Replaced batches stay in the arena, levels do not change often enough to matter
+    u32 id = load_op->handle->id;
+    assert(id < CAPTURE_BATCH_CAP);
+    CaptureBatch* batch = capture.batches + id;
+    batch->handle = *load_op->handle;
+    batch->vertex_count = load_op->vertex_count;
+    batch->vertices = (Vertex*) push_size(&capture.arena, sizeof(Vertex) * load_op->vertex_count);
+    memcpy(batch->vertices, load_op->vertices, sizeof(Vertex) * load_op->vertex_count);
+}
+
+RenderBackend capture_backend(RenderBackend backend)
+{
+    capture = {};
+    capture.backend = backend;
+    init_arena(&capture.arena, &pool);
+
+    RenderBackend result = backend;
+    result.load_static_batch = capture_load_static_batch;
+    return result;
+}
+
+bool capture_frame(CommandBuffer* buffer, const char* path)
+{
+    CaptureHeader header = {};
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.settings = buffer->settings;
+    header.white = buffer->white;
+    header.camera_pos = buffer->camera_pos;
+    header.camera_up = buffer->camera_up;
+    header.camera_right = buffer->camera_right;
+    header.proj = buffer->proj;
+    header.entry_size = buffer->entry_size;
+    header.vert_count = buffer->vert_count;
+    header.cube_count = buffer->cube_count;
+
+    bool drawn[CAPTURE_BATCH_CAP] = {};
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            CommandEntryHeader* entry = (CommandEntryHeader*) (chunk->data + offset);
+            if (entry->type == EntryType_DrawRiggedModel) {
+                header.bone_count += ((CommandEntryDrawRiggedModel*) entry)->bone_count;
+            }
+            if (entry->type == EntryType_DrawStaticBatch) {
+                u32 id = ((CommandEntryDrawStaticBatch*) entry)->batch.id;
+                if (id >= CAPTURE_BATCH_CAP || !capture.batches[id].vertices) {
+                    printf("Capture: static batch %u was not loaded through capture_backend()\n", id);
+                    return false;
+                }
+                header.batch_count += !drawn[id];
+                drawn[id] = true;
+            }
+
+            u32 size = command_entry_size(entry->type);
+            assert(size);
+            offset += size;
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Capture: could not open %s\n", path);
+        return false;
+    }
+
+    fwrite(&header, sizeof(CaptureHeader), 1, file);
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        fwrite(chunk->data, chunk->size, 1, file);
+    }
+    for (VertexChunk* chunk = buffer->first_verts; chunk; chunk = chunk->next) {
+        fwrite(chunk->verts, sizeof(Vertex), chunk->count, file);
+    }
+    fwrite(buffer->cube_buffer, sizeof(CubeInstance), buffer->cube_count, file);
+
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            CommandEntryHeader* entry = (CommandEntryHeader*) (chunk->data + offset);
+            if (entry->type == EntryType_DrawRiggedModel) {
+                CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) entry;
+                fwrite(draw->bone_trans, sizeof(Mat4), draw->bone_count, file);
+            }
+            offset += command_entry_size(entry->type);
+        }
+    }
+
+    for (u32 i = 0; i < CAPTURE_BATCH_CAP; ++i) {
+        if (drawn[i]) {
+            CaptureBatch* batch = capture.batches + i;
+            fwrite(&batch->handle, sizeof(StaticBatchHandle), 1, file);
+            fwrite(&batch->vertex_count, sizeof(u32), 1, file);
+            fwrite(batch->vertices, sizeof(Vertex), batch->vertex_count, file);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool load_capture(CaptureFrame* frame, const char* path, Arena* arena)
+{
+    *frame = {};
+    i32 len = 0;
+    u8* data = (u8*) read_file(path, &len, arena);
+    if (!data) {
+        return false;
+    }
+
+    CaptureHeader* header = (CaptureHeader*) data;
+    if ((u32) len < sizeof(CaptureHeader) || header->magic != CAPTURE_MAGIC ||
+        header->version != CAPTURE_VERSION || header->batch_count > CAPTURE_BATCH_CAP) {
+        printf("Capture: %s is not a capture of this version\n", path);
+        return false;
+    }
+    frame->header = *header;
+
+    u64 size = sizeof(CaptureHeader) + (u64) header->entry_size + sizeof(Vertex) * (u64) header->vert_count +
+               sizeof(CubeInstance) * (u64) header->cube_count + sizeof(Mat4) * (u64) header->bone_count;
+    if (size > (u64) len) {
+        printf("Capture: %s is truncated\n", path);
+        return false;
+    }
+
+    u8* at = data + sizeof(CaptureHeader);
+    frame->entries = at;
+    at += header->entry_size;
+    frame->verts = (Vertex*) at;
+    at += sizeof(Vertex) * header->vert_count;
+    frame->cubes = (CubeInstance*) at;
+    at += sizeof(CubeInstance) * header->cube_count;
+    frame->bone_trans = (Mat4*) at;
+    at += sizeof(Mat4) * header->bone_count;
+
+    for (u32 i = 0; i < header->batch_count; ++i) {
+        CaptureBatch* batch = frame->batches + i;
+        if (at + sizeof(StaticBatchHandle) + sizeof(u32) > data + len) {
+            printf("Capture: %s is truncated\n", path);
+            return false;
+        }
+        memcpy(&batch->handle, at, sizeof(StaticBatchHandle));
+        at += sizeof(StaticBatchHandle);
+        memcpy(&batch->vertex_count, at, sizeof(u32));
+        at += sizeof(u32);
+        batch->vertices = (Vertex*) at;
+        at += sizeof(Vertex) * batch->vertex_count;
+        if (at > data + len) {
+            printf("Capture: %s is truncated\n", path);
+            return false;
+        }
+    }
+
+    // Rigged models get their poses back in entry order
+    u32 offset = 0;
+    u32 bone_offset = 0;
+    while (offset < header->entry_size) {
+        CommandEntryHeader* entry = (CommandEntryHeader*) (frame->entries + offset);
+        u32 entry_size = command_entry_size(entry->type);
+        if (!entry_size || offset + entry_size > header->entry_size) {
+            printf("Capture: %s has a broken entry of type %u\n", path, entry->type);
+            return false;
+        }
+
+        if (entry->type == EntryType_DrawRiggedModel) {
+            CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) entry;
+            if (bone_offset + draw->bone_count > header->bone_count) {
+                printf("Capture: %s is missing bone palettes\n", path);
+                return false;
+            }
+            draw->bone_trans = frame->bone_trans + bone_offset;
+            bone_offset += draw->bone_count;
+        }
+        offset += entry_size;
+    }
+
+    return true;
+}
+
+// Batches of different captures with the same contents share one backend batch
+StaticBatchHandle replay_batch(CaptureBatch* batch, CaptureBatch* loaded, u32* loaded_count)
+{
+    for (u32 i = 0; i < *loaded_count; ++i) {
+        if (loaded[i].vertex_count == batch->vertex_count &&
+            !memcmp(loaded[i].vertices, batch->vertices, sizeof(Vertex) * batch->vertex_count)) {
+            return loaded[i].handle;
+        }
+    }
+
+    CaptureBatch* result = loaded + *loaded_count;
+    ++*loaded_count;
+    *result = *batch;
+    result->handle = {};
+
+    StaticBatchLoadOp load_op;
+    load_op.handle = &result->handle;
+    load_op.vertex_count = batch->vertex_count;
+    load_op.vertices = batch->vertices;
+    render_backend.load_static_batch(&load_op);
+
+    return result->handle;
+}
+
+void replay_frame(CaptureFrame* frame, CommandBuffer* buffer)
+{
+    CaptureHeader* header = &frame->header;
+
+    u32 copied = 0;
+    while (copied < header->vert_count) {
+        u32 left = header->vert_count - copied;
+        u32 room = buffer->verts->cap - buffer->verts->count;
+        u32 count = room && room < left? room : left;
+        memcpy(push_verts(buffer, count), frame->verts + copied, sizeof(Vertex) * count);
+        copied += count;
+    }
+
+    assert(header->cube_count <= buffer->cube_cap);
+    memcpy(buffer->cube_buffer, frame->cubes, sizeof(CubeInstance) * header->cube_count);
+    for (u32 i = 0; i < header->cube_count; ++i) {
+        CubeInstance* cube = frame->cubes + i;
+        set_box(buffer->cube_bounds + i / BOX_BATCH_WIDTH, i % BOX_BATCH_WIDTH, cube->pos, cube->radius);
+    }
+    buffer->cube_count = header->cube_count;
+
+    u32 offset = 0;
+    while (offset < header->entry_size) {
+        CommandEntryHeader* entry = (CommandEntryHeader*) (frame->entries + offset);
+        u32 size = command_entry_size(entry->type);
+        memcpy(push_entry(buffer, size), entry, size);
+        offset += size;
+    }
+}
+
+void print_pass(const char* name, LogEntry* entry, u32 frame_count)
+{
+    printf("  %-12s %8.3f ms per frame\n", name, entry->total_duration * 1000 / frame_count);
+}
+
+void replay_captures(CaptureFrame* frames, u32 count, u32 frame_count)
+{
+    if (!count || !frame_count) {
+        return;
+    }
+
+    Arena arena;
+    init_arena(&arena, &pool);
+    Arena frame_arena;
+    init_arena(&frame_arena, &pool);
+
+    // Point the static batch draws at the batches loaded for the replay
+    u32 loaded_count = 0;
+    CaptureBatch* loaded = (CaptureBatch*) push_size(&arena, sizeof(CaptureBatch) * count * CAPTURE_BATCH_CAP);
+    for (u32 i = 0; i < count; ++i) {
+        CaptureFrame* frame = frames + i;
+        StaticBatchHandle handles[CAPTURE_BATCH_CAP];
+        for (u32 j = 0; j < frame->header.batch_count; ++j) {
+            handles[j] = replay_batch(frame->batches + j, loaded, &loaded_count);
+        }
+
+        u32 offset = 0;
+        while (offset < frame->header.entry_size) {
+            CommandEntryHeader* entry = (CommandEntryHeader*) (frame->entries + offset);
+            if (entry->type == EntryType_DrawStaticBatch) {
+                CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) entry;
+                for (u32 j = 0; j < frame->header.batch_count; ++j) {
+                    if (frame->batches[j].handle.id == draw->batch.id) {
+                        draw->batch = handles[j];
+                        break;
+                    }
+                }
+            }
+            offset += command_entry_size(entry->type);
+        }
+    }
+
+    u32 cube_bounds_size = sizeof(BoxBatch) * (STREAM_CUBE_CAP / BOX_BATCH_WIDTH + 1);
+    BoxBatch* cube_bounds = (BoxBatch*) push_size(&arena, cube_bounds_size);
+
+    CommandBufferPeak peak = {};
+    FrameLog total = {};
+    double start = wall_time();
+
+    for (u32 i = 0; i < frame_count; ++i) {
+        CaptureFrame* frame = frames + i % count;
+        CaptureHeader* header = &frame->header;
+
+        start_frame();
+        dispose(&frame_arena);
+        StreamRegion stream = render_backend.begin_frame(max(peak.vert_count, header->vert_count));
+        CommandBuffer buffer = command_buffer(&frame_arena, max(peak.entry_size, header->entry_size),
+                                              stream.vert_cap, stream.verts, stream.cube_cap, stream.cubes,
+                                              cube_bounds, header->settings.width, header->settings.height,
+                                              header->white, header->proj, header->camera_pos,
+                                              header->camera_up, header->camera_right);
+        replay_frame(frame, &buffer);
+        render_backend.render_commands(&buffer);
+        update_peak(&peak, &buffer);
+        end_frame();
+
+        FrameLog log;
+        collect_log(&log);
+        for (u32 j = 0; j < LogTarget_Count; ++j) {
+            total.entries[j].count += log.entries[j].count;
+            total.entries[j].total_duration += log.entries[j].total_duration;
+        }
+    }
+
+    double duration = wall_time() - start;
+    printf("Replay: %u frames from %u captures, %.3f ms per frame\n", frame_count, count,
+           duration * 1000 / frame_count);
+    print_pass("backend", total.entries + LogTarget_Backend, frame_count);
+    print_pass("shadow pass", total.entries + LogTarget_ShadowPass, frame_count);
+    print_pass("main pass", total.entries + LogTarget_MainPass, frame_count);
+    print_pass("post pass", total.entries + LogTarget_PostPass, frame_count);
+    print_pass("jobs", total.entries + LogTarget_Job, frame_count);
+    printf("  %.1f uniform calls saved per frame\n", 
+           (float) total.entries[LogTarget_UniformCallsSaved].count / frame_count);
+
+    dispose(&frame_arena);
+    dispose(&arena);
+}
@@ -1,19 +1,27 @@
 #include "include/game.h"
 
-#include "include/opengl_renderer.h"
+#include "include/renderer.h"
 #include "include/game_math.h"
 #include "include/arena.h"
 #include "include/util.h"
 #include "include/profiler.h"
+#include "include/workers.h"
+#include "include/visibility.h"
+#include "include/tile_mesh.h"
 
 #include "include/stb_image.h"
 
+#include <string.h>
+
 TextureHandle ground_texture;
 TextureHandle wall_texture;
 TextureHandle glass_wall_texture;
 TextureHandle crate_texture;
 TextureHandle exterior_texture;
 
+// Ground, exterior and static walls of the current level
+StaticBatchHandle level_batch;
+
 RiggedModelHandle player_model;
 ModelHandle camera_model;
 
@@ -23,7 +31,7 @@ float anim_timer = 0;
 Arena assets;
 
 
-// TODO: move asset loading to asset queue. Then game has no opengl dependency
+// TODO: move asset loading to asset queue
 void game_load_assets()
 {
     init_arena(&assets, &pool);
@@ -31,42 +39,45 @@ void game_load_assets()
     init_arena(&tmp, &pool);
 
     TextureLoadOp load_ground = texture_load_op(&ground_texture, "assets/ground.png");
-    opengl_load_texture(&load_ground);
+    render_backend.load_texture(&load_ground);
     free_texture_load_op(&load_ground);
 
     TextureLoadOp load_crate = texture_load_op(&crate_texture, "assets/crate.png");
-    opengl_load_texture(&load_crate);
+    render_backend.load_texture(&load_crate);
     free_texture_load_op(&load_crate);
 
     TextureLoadOp load_wall = texture_load_op(&wall_texture, "assets/wall.png");
-    opengl_load_texture(&load_wall);
+    render_backend.load_texture(&load_wall);
     free_texture_load_op(&load_wall);
 
     TextureLoadOp load_exterior = texture_load_op(&exterior_texture, "assets/exterior.png");
-    opengl_load_texture(&load_exterior);
+    render_backend.load_texture(&load_exterior);
     free_texture_load_op(&load_exterior);
 
     TextureLoadOp load_glass_wall = texture_load_op(&glass_wall_texture, "assets/glasswall.png");
-    opengl_load_texture(&load_glass_wall);
+    render_backend.load_texture(&load_glass_wall);
     free_texture_load_op(&load_glass_wall);
 
     ModelLoadOp load_camera = model_load_op(&camera_model, "assets/cam.obj", &tmp);
-    opengl_load_model(&load_camera);
+    render_backend.load_model(&load_camera);
 
     ModelLoadOp load_player = sk_model_load_op(&player_model, "assets/maincharacter/ninja.gltf", &tmp, &assets);
     // ModelLoadOp load_player = sk_model_load_op(&player_model, "assets/test/RiggedSimple.gltf", &tmp, &assets);
     // ModelLoadOp load_player = sk_model_load_op(&player_model, "assets/test/alien.fbx", &tmp);
-    opengl_load_model(&load_player);
+    render_backend.load_model(&load_player);
 
-    capoeira = load_animation("assets/maincharacter/ninja.gltf", &assets);
-    // capoeira = load_animation("assets/test/RiggedSimple.gltf", &assets);
-    // capoeira = load_animation("assets/animations/alien.gltf", &assets);
+    capoeira = load_animation("assets/maincharacter/ninja.gltf", &player_model.skeleton, &assets);
+    // capoeira = load_animation("assets/test/RiggedSimple.gltf", &player_model.skeleton, &assets);
+    // capoeira = load_animation("assets/animations/alien.gltf", &player_model.skeleton, &assets);
 
     dispose(&tmp);
 };
 
 float enemy_spotlight_length = 25;
 
+// Exact vision cones, the ray fan is kept around for comparison
+bool enemy_use_visibility_polygon = true;
+
 
 void game_init(Game* game, Arena* arena, const char* stage, TextureHandle white)
 {
@@ -79,6 +90,10 @@ void game_init(Game* game, Arena* arena, const char* stage, TextureHandle white)
     }
 
     game->entities = (Entity*) push_size(arena, sizeof(Entity) * ENTITY_CAP);
+    game->grid = (GridCell*) push_size(arena, sizeof(GridCell) * game->width * game->height);
+    memset(game->grid, 0, sizeof(GridCell) * game->width * game->height);
+    game->dynamic = (u16*) push_size(arena, sizeof(u16) * ENTITY_CAP);
+    game->dynamic_count = 0;
 
     // TODO: Clean this up some more
     u8* curr = tmp;
@@ -175,6 +190,11 @@ void game_init(Game* game, Arena* arena, const char* stage, TextureHandle white)
 
     stbi_image_free(tmp);
 
+    game->vision = (EnemyVision*) push_size(arena, sizeof(EnemyVision) * game->enemies.entity_count);
+    init_vision_edges(game, arena);
+
+    load_level_batch(game, arena);
+
     game_reset_camera(game);
 }
 
@@ -193,6 +213,11 @@ EntityRef push_entity(Entity entity, Game* game)
     ref.id = game->entity_count;
     ++game->entity_count;
 
+    if (entity.collider.type != ColliderType_Static) {
+        game->dynamic[game->dynamic_count++] = ref.id;
+    }
+    grid_insert(game->entities + ref.id, game);
+
     if (entity.type == EntityType_Enemy) {
         push_entity_to_list(&game->enemies, ref);
     }
@@ -208,6 +233,259 @@ Entity* get_entity(EntityRef ref, Game* game)
     return game->entities + ref.id;
 }
 
+bool blocks_vision(Entity* entity)
+{
+    return entity->type != EntityType_Player &&
+           entity->collider.transparency_type != TransparencyType_Transparent &&
+           (1 & ((ENEMY_VISION) >> entity->type));
+}
+
+// skip_side: bottom, right, top, left
+void push_box_edges(Game* game, u16 id, bool* skip_side)
+{
+    Entity* entity = game->entities + id;
+    V2 min_b = v2(entity->pos.x - entity->collider.float_radius.x, entity->pos.y - entity->collider.float_radius.y);
+    V2 max_b = v2(entity->pos.x + entity->collider.float_radius.x, entity->pos.y + entity->collider.float_radius.y);
+    V2 corners[4] = { min_b, v2(max_b.x, min_b.y), max_b, v2(min_b.x, max_b.y) };
+
+    for (u32 i = 0; i < 4; ++i) {
+        if (skip_side && skip_side[i]) {
+            continue;
+        }
+        assert(game->edge_count < VISIBILITY_EDGE_CAP);
+        VisibilityEdge* edge = game->edges + game->edge_count;
+        ++game->edge_count;
+        edge->a = corners[i];
+        edge->b = corners[(i + 1) % 4];
+        edge->id = id;
+    }
+}
+
+// Sides shared by two solid tiles can never be seen and get dropped. Enemies keep all their
+// sides, they look out of their own tile.
+void init_vision_edges(Game* game, Arena* arena)
+{
+    u32 dynamic_edges = 0;
+    u32 static_edges = 0;
+    for (u32 i = 0; i < game->entity_count; ++i) {
+        Entity* entity = game->entities + i;
+        if (!blocks_vision(entity)) {
+            continue;
+        }
+        if (entity->collider.type == ColliderType_Static) {
+            static_edges += 4;
+        } else {
+            dynamic_edges += 4;
+        }
+    }
+
+    game->edges = (VisibilityEdge*) push_size(arena, sizeof(VisibilityEdge) * (static_edges + dynamic_edges));
+    game->edge_count = 0;
+
+    begin_tmp(arena);
+    u8* solid = (u8*) push_size(arena, game->width * game->height);
+    memset(solid, 0, game->width * game->height);
+    for (u32 i = 0; i < game->entity_count; ++i) {
+        Entity* entity = game->entities + i;
+        if (entity->collider.type == ColliderType_Static && entity->type != EntityType_Enemy && 
+            blocks_vision(entity)) {
+            solid[entity->int_pos.y / INT_TILE_SIZE * game->width + entity->int_pos.x / INT_TILE_SIZE] = true;
+        }
+    }
+
+    i32 neighbour_x[4] = { 0, 1, 0, -1 };
+    i32 neighbour_y[4] = { -1, 0, 1, 0 };
+    for (u32 i = 0; i < game->entity_count; ++i) {
+        Entity* entity = game->entities + i;
+        if (entity->collider.type != ColliderType_Static || !blocks_vision(entity)) {
+            continue;
+        }
+
+        bool skip_side[4] = {};
+        if (entity->type != EntityType_Enemy) {
+            i32 x = entity->int_pos.x / INT_TILE_SIZE;
+            i32 y = entity->int_pos.y / INT_TILE_SIZE;
+            for (u32 j = 0; j < 4; ++j) {
+                i32 nx = x + neighbour_x[j];
+                i32 ny = y + neighbour_y[j];
+                if (nx >= 0 && ny >= 0 && nx < (i32) game->width && ny < (i32) game->height) {
+                    skip_side[j] = solid[ny * game->width + nx];
+                }
+            }
+        }
+        push_box_edges(game, i, skip_side);
+    }
+    end_tmp(arena);
+
+    game->static_edge_count = game->edge_count;
+    memset(game->edges + game->edge_count, 0, sizeof(VisibilityEdge) * dynamic_edges);
+    game->edge_generation = 0;
+    update_vision_edges(game);
+
+    for (u32 i = 0; i < game->enemies.entity_count; ++i) {
+        VisibilityCache* cache = &game->vision[i].cache;
+        cache->edges = (u16*) push_size(arena, sizeof(u16) * (static_edges + dynamic_edges));
+        cache->generation = game->edge_generation - 1;
+        VisibilityPolygon* polygon = &game->vision[i].polygon;
+        polygon->points = (VisibilityPoint*) 
+            push_size(arena, sizeof(VisibilityPoint) * visibility_point_cap(static_edges + dynamic_edges));
+    }
+}
+
+// Moveable occluders get their edges refreshed every frame, after the statics
+void update_vision_edges(Game* game)
+{
+    u32 prev_count = game->edge_count;
+    bool moved = false;
+    game->edge_count = game->static_edge_count;
+    for (u32 i = 0; i < game->dynamic_count; ++i) {
+        if (blocks_vision(game->entities + game->dynamic[i])) {
+            // Boxes always start with the edge along their min corner
+            VisibilityEdge* first = game->edges + game->edge_count;
+            V2 prev = first->a;
+            push_box_edges(game, game->dynamic[i], NULL);
+            moved |= first->a.x != prev.x || first->a.y != prev.y;
+        }
+    }
+
+    if (moved || game->edge_count != prev_count) {
+        ++game->edge_generation;
+    }
+}
+
+V2 reflect(V2 point, VisibilityEdge* mirror)
+{
+    if (mirror->a.x == mirror->b.x) {
+        return v2(2 * mirror->a.x - point.x, point.y);
+    }
+    return v2(point.x, 2 * mirror->a.y - point.y);
+}
+
+// The player is seen in every wedge its box reaches into, unless the wedge ends at something of 
+// the same camouflage color. Wedges ending on a mirror continue in the mirrored polygon.
+// NOTE: Unlike the ray version a mirror behind the player does not count as the mirrored color.
+bool polygon_sees_player(Game* game, VisibilityPolygon* polygon, u32 depth)
+{
+    Entity* player = get_entity(game->player, game);
+    V2 player_min = v2(player->pos.x - player->collider.float_radius.x, player->pos.y - player->collider.float_radius.y);
+    V2 player_max = v2(player->pos.x + player->collider.float_radius.x, player->pos.y + player->collider.float_radius.y);
+
+    for (u32 i = 0; i + 1 < polygon->point_count; ++i) {
+        V2 outline[4];
+        u32 count = get_wedge(polygon, i, outline);
+        if (!convex_overlaps_box(outline, count, player_min, player_max)) {
+            continue;
+        }
+
+        // Wedges between two different edges are a sliver next to a corner, the far edge is behind it
+        VisibilityPoint* p0 = polygon->points + i;
+        VisibilityPoint* p1 = polygon->points + i + 1;
+        float d0 = dot(v2(p0->pos.x - polygon->origin.x, p0->pos.y - polygon->origin.y), 
+                       v2(p0->pos.x - polygon->origin.x, p0->pos.y - polygon->origin.y));
+        float d1 = dot(v2(p1->pos.x - polygon->origin.x, p1->pos.y - polygon->origin.y), 
+                       v2(p1->pos.x - polygon->origin.x, p1->pos.y - polygon->origin.y));
+        i32 edge = d0 >= d1 ? p0->edge : p1->edge;
+
+        if (edge < 0) {
+            return true;
+        }
+        Entity* behind = game->entities + game->edges[edge].id;
+        if (behind->collider.camouflage_color != player->collider.camouflage_color) {
+            return true;
+        }
+    }
+
+    if (depth == RAYCAST_BOUNCE_CAP) {
+        return false;
+    }
+
+    for (u32 i = 0; i + 1 < polygon->point_count;) {
+        i32 edge = polygon->points[i].edge;
+        u32 end = i + 1;
+        while (end < polygon->point_count && polygon->points[end].edge == edge) {
+            ++end;
+        }
+        u32 first = i;
+        u32 last = end - 1;
+        i = end;
+
+        if (edge < 0 || last == first || 
+            game->entities[game->edges[edge].id].collider.transparency_type != TransparencyType_Mirror) {
+            continue;
+        }
+
+        VisibilityEdge* mirror = game->edges + edge;
+        V2 origin = reflect(polygon->origin, mirror);
+        V2 to_first = norm(v2(polygon->points[first].pos.x - origin.x, polygon->points[first].pos.y - origin.y));
+        V2 to_last = norm(v2(polygon->points[last].pos.x - origin.x, polygon->points[last].pos.y - origin.y));
+        float half_angle = 0.5 * acos(clamp(dot(to_first, to_last), -1, 1));
+        if (half_angle <= 0) {
+            continue;
+        }
+
+        VisibilityClip clip;
+        clip.point = mirror->a;
+        clip.normal = norm(v2(mirror->b.y - mirror->a.y, mirror->a.x - mirror->b.x));
+
+        // Off the worker's stack, every bounce adds one. Freed when the vision job returns.
+        VisibilityPolygon* mirrored = (VisibilityPolygon*) push_size(scratch_arena(), sizeof(VisibilityPolygon));
+        mirrored->points = (VisibilityPoint*) 
+            push_size(scratch_arena(), sizeof(VisibilityPoint) * visibility_point_cap(game->edge_count));
+        V2 dir = norm(v2(to_first.x + to_last.x, to_first.y + to_last.y));
+        compute_visibility(game->edges, NULL, game->edge_count, origin, dir, half_angle, &clip, mirrored);
+        if (polygon_sees_player(game, mirrored, depth + 1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Runs on worker threads, only reads the game
+void see_enemy_polygon(void* data, u32 index)
+{
+    Game* game = (Game*) data;
+    EnemyVision* vision = game->vision + index;
+    Entity* enemy = vision->enemy;
+
+    V2 origin = v2(enemy->pos.x, enemy->pos.y);
+    VisibilityCache* cache = &vision->cache;
+    if (cache->generation != game->edge_generation || cache->origin.x != origin.x || cache->origin.y != origin.y) {
+        build_visibility_cache(cache, game->edges, game->edge_count, origin);
+        cache->generation = game->edge_generation;
+    }
+
+    V2 dir = v2(vision->facing.x, vision->facing.y);
+    float half_angle = atan2(vision->fov, 1 - vision->fov);
+    compute_visibility(game->edges, cache->edges, cache->edge_count, origin, dir, half_angle, 
+                       NULL, &vision->polygon);
+    vision->sees_player = polygon_sees_player(game, &vision->polygon, 0);
+}
+
+// Runs on worker threads, only reads the game
+void cast_enemy_vision(void* data, u32 index)
+{
+    Game* game = (Game*) data;
+    EnemyVision* vision = game->vision + index;
+    Entity* enemy = vision->enemy;
+
+    vision->sees_player = false;
+    float o = 2.0f / ENEMY_RAY_COUNT - 1;
+    for (u32 j = 0; j < ENEMY_RAY_COUNT - 1; ++j) {
+        o += 2.0f / ENEMY_RAY_COUNT;
+
+        V3 r = v3((1 - vision->fov) * vision->facing.x + o * vision->fov * vision->side.x,
+            (1 - vision->fov) * vision->facing.y + o * vision->fov * vision->side.y, 0);
+
+        RaycastExclusion exclusion = {};
+        vision->rays[j] = raycast(game, enemy, enemy->pos, r, ENEMY_VISION, &exclusion);
+        
+        if (vision->rays[j].hit_found && vision->rays[j].final_hit_entity->type == EntityType_Player){
+            vision->sees_player = true;
+        }
+    }
+}
+
 void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderGroup* dbg)
 {
     // Update Player
@@ -240,6 +518,8 @@ void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderG
         move_and_collide(player, v3float_to_v2int({0,movement.y, 0}), game);
     }
 
+    bool enemy_use_many_rays = true;
+
     for (u32 i = 0; i < game->enemies.entity_count; ++i) {
         Entity* enemy = get_entity(game->enemies.entity_refs[i], game);
         V3 facing = v3(sin(enemy->rotation), cos(enemy->rotation), 0);
@@ -251,22 +531,12 @@ void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderG
 
         push_spotlight(group->commands, enemy->pos, facing, fov, enemy_spotlight_length);
 
-        bool enemy_use_many_rays = true;
-
-        if (enemy_use_many_rays){
-            u32 ENEMY_RAY_COUNT = 40;
-            float o = 2.0f / ENEMY_RAY_COUNT - 1;
-            for (u32 j = 0; j < ENEMY_RAY_COUNT - 1; ++j) {
-                o += 2.0f / ENEMY_RAY_COUNT;
-
-                V3 r = v3((1 - fov) * facing.x + o * fov * side.x,
-                    (1 - fov) * facing.y + o * fov * side.y, 0);
-                RaycastResult raycast_result = game_raycast(game, enemy, enemy->pos, r, ENEMY_VISION, dbg);
-                
-                if (raycast_result.hit_found && raycast_result.final_hit_entity->type == EntityType_Player){
-                    game->reset_stage = true;
-                }
-            }
+        if (enemy_use_visibility_polygon || enemy_use_many_rays){
+            EnemyVision* vision = game->vision + i;
+            vision->enemy = enemy;
+            vision->facing = facing;
+            vision->side = side;
+            vision->fov = fov;
         } else{
             //Old deprecated code for enemies seeing players.
             //Deprecated because it doesn't work with mirrors.
@@ -290,7 +560,50 @@ void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderG
                 }
             }
         }
+    }
+
+    if (enemy_use_visibility_polygon) {
+        update_vision_edges(game);
+        run_parallel(game->enemies.entity_count, see_enemy_polygon, game);
 
+        for (u32 i = 0; i < game->enemies.entity_count; ++i) {
+            EnemyVision* vision = game->vision + i;
+            if (vision->sees_player) {
+                game->reset_stage = true;
+            }
+    #ifdef DEBUG
+            VisibilityPolygon* polygon = &vision->polygon;
+            V3 origin = vision->enemy->pos;
+            for (u32 j = 0; j < polygon->point_count; ++j) {
+                V3 p = v3(polygon->points[j].pos.x, polygon->points[j].pos.y, origin.z);
+                if (j == 0 || j + 1 == polygon->point_count) {
+                    push_line(dbg, origin, p, v3(1, 0, 0));
+                }
+                if (j > 0) {
+                    V3 prev = v3(polygon->points[j - 1].pos.x, polygon->points[j - 1].pos.y, origin.z);
+                    push_line(dbg, prev, p, v3(1, 0, 0));
+                }
+            }
+    #endif
+        }
+    } else if (enemy_use_many_rays) {
+        run_parallel(game->enemies.entity_count, cast_enemy_vision, game);
+
+        for (u32 i = 0; i < game->enemies.entity_count; ++i) {
+            EnemyVision* vision = game->vision + i;
+            if (vision->sees_player) {
+                game->reset_stage = true;
+            }
+    #ifdef DEBUG
+            for (u32 j = 0; j < ENEMY_RAY_COUNT - 1; ++j) {
+                push_raycast(dbg, vision->rays + j);
+            }
+    #endif
+        }
+    }
+
+    for (u32 i = 0; i < game->enemies.entity_count; ++i) {
+        Entity* enemy = get_entity(game->enemies.entity_refs[i], game);
         enemy->rotation += enemy->rotation_speed * 1.2 * delta;
     }
 
@@ -313,26 +626,107 @@ void game_update(Game* game, u8 inputs, float delta, RenderGroup* group, RenderG
     }
 }
 
-void game_render(Game* game, RenderGroup* default, RenderGroup* transparent, RenderGroup* dbg){
-    // Render Ground
+// Never changes after game_init. Objectives can break, so they stay out.
+// All of these are one tile in size, one tile above the ground.
+bool in_level_batch(Entity* entity)
+{
+    return entity->collider.type == ColliderType_Static && !entity->transparent &&
+           entity->type != EntityType_Enemy && entity->type != EntityType_Objective;
+}
+
+void set_level_tile(TileMap* map, i32 x, i32 y, i32 z, TextureHandle texture, V3 color)
+{
+    MeshTile* tile = map->tiles + ((z - map->min_z) * map->height + y - map->min_y) * map->width + x - map->min_x;
+    tile->solid = true;
+    tile->texture = texture;
+    tile->color = color;
+}
+
+void load_level_batch(Game* game, Arena* arena)
+{
+    begin_tmp(arena);
+
+    // Exterior walls sit at x = -1 and y = height, everything is 4 tiles high
+    TileMap map;
+    map.min_x = -1;
+    map.min_y = 0;
+    map.min_z = 0;
+    map.width = game->width + 1;
+    map.height = game->height + 1;
+    map.depth = 4;
+    u32 tile_count = map.width * map.height * map.depth;
+    map.tiles = (MeshTile*) push_size(arena, sizeof(MeshTile) * tile_count);
+    memset(map.tiles, 0, sizeof(MeshTile) * tile_count);
+
+    // Ground
     for (u32 y = 0; y < game->height; ++y) {
         for (u32 x = 0; x < game->width; ++x) {
-            push_cube(default, v3(x, y, 0), v3(0.5), ground_texture, v3(1));
+            set_level_tile(&map, x, y, 0, ground_texture, v3(1));
         }
     }
 
-    // Render exterior
+    // Exterior
     for (u32 y = 0; y < game->height + 1; ++y) {
         for (u32 z = 0; z < 4; ++z) {
-            push_cube(default, v3(-1, y, z), v3(0.5), exterior_texture, v3(1));
+            set_level_tile(&map, -1, y, z, exterior_texture, v3(1));
         }
     }
     for (u32 x = 0; x < game->width; ++x) {
         for (u32 z = 0; z < 4; ++z) {
-            push_cube(default, v3(x, game->height, z), v3(0.5), exterior_texture, v3(1));
+            set_level_tile(&map, x, game->height, z, exterior_texture, v3(1));
         }
     }
 
+    for (u32 i = 0; i < game->entity_count; ++i) {
+        Entity* entity = game->entities + i;
+        if (in_level_batch(entity)) {
+            set_level_tile(&map, entity->int_pos.x / INT_TILE_SIZE, entity->int_pos.y / INT_TILE_SIZE, 1,
+                           entity->texture, entity->color);
+        }
+    }
+
+    StaticBatchLoadOp load_op;
+    load_op.handle = &level_batch;
+    u32 vertex_cap = tile_mesh_vertex_cap(&map);
+    load_op.vertices = (Vertex*) push_size(arena, sizeof(Vertex) * vertex_cap);
+    load_op.vertex_count = mesh_tile_map(&map, load_op.vertices, vertex_cap, arena);
+
+    render_backend.load_static_batch(&load_op);
+    end_tmp(arena);
+}
+
+#define CUBE_JOB_SIZE 64
+
+struct CubeJob
+{
+    Game* game;
+    CommandBuffer* commands;
+    u32* entities;
+    u32 count;
+    u32 first_cube;
+};
+
+void record_cubes(void* data, u32 index)
+{
+    CubeJob* job = (CubeJob*) data;
+    u32 start = index * CUBE_JOB_SIZE;
+    u32 end = min(start + CUBE_JOB_SIZE, job->count);
+
+    for (u32 i = start; i < end; ++i) {
+        Entity* entity = job->game->entities + job->entities[i];
+        set_cube(job->commands, job->first_cube + i, entity->pos, entity->collider.float_radius, entity->texture, entity->color);
+    }
+}
+
+void game_render(Game* game, RenderGroup* default, RenderGroup* transparent, RenderGroup* dbg){
+    push_static_batch(default, level_batch);
+
+    // Opaque cubes all go into one draw, so they get recorded in parallel once the count is known
+    CubeJob cubes = {};
+    cubes.game = game;
+    cubes.commands = dbg->commands;
+    cubes.entities = (u32*) push_size(dbg->commands->arena, sizeof(u32) * game->entity_count);
+
     for (u32 i = 0; i < game->entity_count; ++i) {
         Entity* entity = game->entities + i;
 
@@ -344,26 +738,26 @@ void game_render(Game* game, RenderGroup* default, RenderGroup* transparent, Ren
             continue;
         }
 
-        if (entity->type == EntityType_Objective && entity->objective.broken) {
+        if ((entity->type == EntityType_Objective && entity->objective.broken) || in_level_batch(entity)) {
             continue;
         }
 
-        RenderGroup* group = default;
         if (entity->transparent) {
-            group = transparent;
+            push_cube(transparent, entity->pos, entity->collider.float_radius, entity->texture, entity->color);
+        } else {
+            cubes.entities[cubes.count++] = i;
         }
-
-        push_cube(group, entity->pos, entity->collider.float_radius, entity->texture, entity->color);
     }
 
-    begin_tmp(&assets);
+    if (cubes.count) {
+        cubes.first_cube = reserve_cubes(default, cubes.count, game->entities[cubes.entities[0]].pos);
+        run_parallel((cubes.count + CUBE_JOB_SIZE - 1) / CUBE_JOB_SIZE, record_cubes, &cubes);
+    }
 
-    Mat4* player_pose = interpolate_pose(&capoeira, &player_model.skeleton, &assets, anim_timer);
+    Mat4* player_pose = interpolate_pose(&capoeira, &player_model.skeleton, dbg->commands->arena, anim_timer);
     // Mat4* player_pose = default_pose(&player_model.skeleton, &assets);
     push_rigged_model(default, &player_model, player_pose, v3(5, 5, 10), v3(1));
     push_debug_pose(dbg, &player_model.skeleton, player_pose, v3(5, 5, 10), v3(1));
-
-    end_tmp(&assets);
 }
 
 void game_reset_camera(Game* game)
@@ -381,40 +775,266 @@ void game_toggle_camera_state(Game* game)
     }
 }
 
-RaycastResult game_raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RenderGroup* dbg)
+bool contains(Entity** entities, u32 count, Entity* entity)
 {
-    LogEntryInfo info = start_log(LogTarget_GameRaycast);
+    for (u32 i = 0; i < count; ++i) {
+        if (entities[i] == entity) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    RaycastResult res;
-    res.hit_found = false;
-    res.t = INFINITY;
-    res.directly_hit_entity = NULL;
-    res.final_hit_entity = NULL;
-    
-    for (u32 i = 0; i < game->entity_count; ++i) {
-        Entity* entity = game->entities + i;
+// Sorted by t. Ties go to the lower entity id, same as scanning the entity array in order.
+// Only the last hit may block the ray, everything behind it gets dropped.
+struct HitList
+{
+    u32 count;
+    u32 limit;
+    RaycastHit* hits;
+    bool blocked;
+};
+
+bool hit_before(RaycastHit a, RaycastHit b)
+{
+    return a.t < b.t || (a.t == b.t && a.entity < b.entity);
+}
+
+// Anything hit further away than this does not change the result
+float hit_bound(HitList* list)
+{
+    if (list->blocked || list->count == list->limit) {
+        return list->hits[list->count - 1].t;
+    }
+    return INFINITY;
+}
+
+void insert_hit(HitList* list, RaycastHit hit)
+{
+    u32 i = list->count;
+    while (i > 0 && hit_before(hit, list->hits[i - 1])) {
+        --i;
+    }
+
+    if (i == list->limit || (list->blocked && i == list->count)) {
+        return;
+    }
+    if (list->count == list->limit) {
+        --list->count;
+        list->blocked = false;
+    }
+
+    for (u32 j = list->count; j > i; --j) {
+        list->hits[j] = list->hits[j - 1];
+    }
+    list->hits[i] = hit;
+    ++list->count;
+
+    // Camouflaged entities are the only ones the ray might look past
+    if (hit.entity->collider.transparency_type != TransparencyType_Camouflage) {
+        list->count = i + 1;
+        list->blocked = true;
+    }
+}
+
+void raycast_boxes(Game* game, u16* ids, BoxBatch* boxes, u32 count, Entity* origin_entity, 
+                   V3 origin, V3 dir, u32 mask, RaycastExclusion* exclusion, HitList* list)
+{
+    BoxBatchHits hits;
+    u32 hit_mask = hit_bounding_boxes(origin, dir, boxes, count, &hits);
+
+    for (u32 i = 0; hit_mask; ++i) {
+        if (!(hit_mask & (1 << i))) {
+            continue;
+        }
+        hit_mask &= ~(1 << i);
+
+        Entity* entity = game->entities + ids[i];
 
         if (entity->collider.transparency_type == TransparencyType_Transparent ||
             entity == origin_entity ||
-          !(1 & (mask >> entity->type))) {
+          !(1 & (mask >> entity->type)) ||
+            contains(exclusion->transparent, exclusion->transparent_count, entity)) {
             continue;
         }
 
-        V3 chit;
-        float ct;
-        if (hit_bounding_box(origin, dir, entity->pos, entity->collider.float_radius, &chit, &ct)) {
-            if (!res.hit_found || ct < res.t) {
-                res.hit_found = true;
-                res.t = ct;
-                res.hit_pos = chit;
-                res.directly_hit_entity = entity;
-                res.final_hit_entity = entity;
+        RaycastHit hit;
+        hit.t = hits.t[i];
+        hit.pos = v3(hits.hit_x[i], hits.hit_y[i], hits.hit_z[i]);
+        hit.entity = entity;
+        insert_hit(list, hit);
+    }
+}
+
+void raycast_cell(Game* game, i32 x, i32 y, Entity* origin_entity, V3 origin, V3 dir, u32 mask, 
+                  RaycastExclusion* exclusion, HitList* list)
+{
+    if (x < 0 || y < 0 || x >= (i32) game->width || y >= (i32) game->height) {
+        return;
+    }
+
+    GridCell* cell = game->grid + y * game->width + x;
+    if (!cell->entity_count) {
+        return;
+    }
+
+    raycast_boxes(game, cell->entities, &cell->boxes, cell->entity_count, origin_entity, origin, dir, mask, 
+                  exclusion, list);
+}
+
+// Walks the tiles along the ray (Amanatides & Woo) and stops once the closest hit lies
+// before the tile that would be visited next. Entities are registered in every tile they
+// overlap, so the first opaque hit is always found in a tile the ray passes through.
+void raycast_grid(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RaycastExclusion* exclusion,
+                  HitList* list)
+{
+    // Tile x covers [x - 0.5, x + 0.5), shift so it covers [x, x + 1)
+    float x = origin.x + 0.5;
+    float y = origin.y + 0.5;
+
+    if (x < 0 || y < 0 || x >= game->width || y >= game->height) {
+        // NOTE: Rays starting outside of the stage are rare enough to just test everything in the grid
+        for (u32 i = 0; i < game->entity_count; i += BOX_BATCH_WIDTH) {
+            u32 count = game->entity_count - i < BOX_BATCH_WIDTH ? game->entity_count - i : BOX_BATCH_WIDTH;
+            u16 ids[BOX_BATCH_WIDTH];
+            BoxBatch boxes;
+            for (u32 j = 0; j < count; ++j) {
+                ids[j] = i + j;
+                Entity* entity = game->entities + ids[j];
+                set_box(&boxes, j, entity->pos, entity->collider.float_radius);
             }
+            raycast_boxes(game, ids, &boxes, count, origin_entity, origin, dir, mask, exclusion, list);
+        }
+        return;
+    }
+
+    i32 cx = floor(x);
+    i32 cy = floor(y);
+
+    i32 step_x = dir.x > 0 ? 1 : (dir.x < 0 ? -1 : 0);
+    i32 step_y = dir.y > 0 ? 1 : (dir.y < 0 ? -1 : 0);
+
+    float delta_x = step_x ? 1 / fabs(dir.x) : INFINITY;
+    float delta_y = step_y ? 1 / fabs(dir.y) : INFINITY;
+
+    float max_x = INFINITY;
+    if (step_x > 0) {
+        max_x = (cx + 1 - x) / dir.x;
+    } else if (step_x < 0) {
+        max_x = (x - cx) / -dir.x;
+    }
+
+    float max_y = INFINITY;
+    if (step_y > 0) {
+        max_y = (cy + 1 - y) / dir.y;
+    } else if (step_y < 0) {
+        max_y = (y - cy) / -dir.y;
+    }
+
+    // Boxes are closed, so a ray starting on or running along a tile border also touches
+    // the tiles on the other side of that border.
+    bool border_x = (x == cx);
+    bool border_y = (y == cy);
+
+    if (border_x) {
+        raycast_cell(game, cx - 1, cy, origin_entity, origin, dir, mask, exclusion, list);
+    }
+    if (border_y) {
+        raycast_cell(game, cx, cy - 1, origin_entity, origin, dir, mask, exclusion, list);
+    }
+    if (border_x && border_y) {
+        raycast_cell(game, cx - 1, cy - 1, origin_entity, origin, dir, mask, exclusion, list);
+    }
+
+    border_x = border_x && step_x == 0;
+    border_y = border_y && step_y == 0;
+
+    // Float error between the traversal and the box test must not skip a closer hit
+    float epsilon = 0.0001;
+
+    while (true) {
+        raycast_cell(game, cx, cy, origin_entity, origin, dir, mask, exclusion, list);
+        if (border_x) {
+            raycast_cell(game, cx - 1, cy, origin_entity, origin, dir, mask, exclusion, list);
+        }
+        if (border_y) {
+            raycast_cell(game, cx, cy - 1, origin_entity, origin, dir, mask, exclusion, list);
+        }
+
+        float exit = min(max_x, max_y);
+        if (exit == INFINITY || hit_bound(list) + epsilon < exit) {
+            break;
+        }
+
+        if (fabs(max_x - max_y) < epsilon) {
+            // The ray passes (almost) through a corner, touch both neighbours
+            raycast_cell(game, cx + step_x, cy, origin_entity, origin, dir, mask, exclusion, list);
+            raycast_cell(game, cx, cy + step_y, origin_entity, origin, dir, mask, exclusion, list);
+        }
+
+        if (max_x < max_y) {
+            cx += step_x;
+            max_x += delta_x;
+        } else {
+            cy += step_y;
+            max_y += delta_y;
+        }
+
+        if (cx < 0 || cy < 0 || cx >= (i32) game->width || cy >= (i32) game->height) {
+            break;
         }
     }
+}
+
+u32 raycast_all(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RaycastExclusion* exclusion,
+                RaycastHit* hits, u32 limit)
+{
+    assert(limit > 0);
+
+    HitList list;
+    list.count = 0;
+    list.limit = limit;
+    list.hits = hits;
+    list.blocked = false;
 
-    if (res.hit_found && res.directly_hit_entity->collider.transparency_type == TransparencyType_Mirror){
-        Entity* mirror = res.directly_hit_entity;
+    raycast_grid(game, origin_entity, origin, dir, mask, exclusion, &list);
+
+    return list.count;
+}
+
+// Treats hits[first] as the entity the ray hit directly. Hits behind it are only looked at
+// if it is camouflaged, so the ray does not have to be cast again.
+RaycastResult resolve_hits(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, 
+                           RaycastExclusion* exclusion, RaycastHit* hits, u32 count, u32 limit, u32 first)
+{
+    if (first == count && count == limit) {
+        // NOTE: Ran out of hits before the ray got blocked, everything in front is excluded by now
+        return raycast(game, origin_entity, origin, dir, mask, exclusion);
+    }
+
+    RaycastResult res;
+    res.hit_found = false;
+    res.t = INFINITY;
+    res.directly_hit_entity = NULL;
+    res.final_hit_entity = NULL;
+    res.point_count = 1;
+    res.points[0] = origin;
+
+    if (first == count) {
+        return res;
+    }
+
+    Entity* hit = hits[first].entity;
+    res.hit_found = true;
+    res.t = hits[first].t;
+    res.hit_pos = hits[first].pos;
+    res.directly_hit_entity = hit;
+    res.final_hit_entity = hit;
+    res.points[res.point_count++] = res.hit_pos;
+
+    if (hit->collider.transparency_type == TransparencyType_Mirror &&
+        !contains(exclusion->opaque, exclusion->opaque_count, hit)) {
+        Entity* mirror = hit;
         V3 mirrored_dir = dir;
         float precision = 0.0001f;
         bool mirror_x = abs(res.hit_pos.x - mirror->pos.x - mirror->collider.float_radius.x) < precision ||
@@ -427,46 +1047,78 @@ RaycastResult game_raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir,
         } else if ( mirror_y ){
             mirrored_dir.y = -mirrored_dir.y;
         }
-        if (mirror_x || mirror_y) {
-            mirror->collider.transparency_type = TransparencyType_Opaque;
-
-            mirror->last_raycast = 
-                game_raycast(game, res.directly_hit_entity, res.hit_pos, mirrored_dir, mask, dbg); 
+        // NOTE: Once the bounce chain is full, the last mirror just stops the ray
+        if ((mirror_x || mirror_y) && exclusion->opaque_count < RAYCAST_BOUNCE_CAP) {
+            exclusion->opaque[exclusion->opaque_count++] = mirror;
+            RaycastResult bounce = raycast(game, mirror, res.hit_pos, mirrored_dir, mask, exclusion);
+            --exclusion->opaque_count;
 
             // If a ray reaches the same mirror twice we declare that hit_found is false,
             // because it is likely to go in an infinite loop.
-            if (mirror->last_raycast.final_hit_entity == mirror){
+            if (bounce.final_hit_entity == mirror){
                 res.hit_found = false;
                 res.final_hit_entity = NULL;
-            }else if (mirror->last_raycast.hit_found){
-                res.final_hit_entity = mirror->last_raycast.final_hit_entity;
+            }else if (bounce.hit_found){
+                res.final_hit_entity = bounce.final_hit_entity;
             }
 
-            mirror->collider.transparency_type = TransparencyType_Mirror;
-        } else {
+            for (u32 i = 1; i < bounce.point_count; ++i) {
+                res.points[res.point_count++] = bounce.points[i];
+            }
+        } else if (!mirror_x && !mirror_y) {
             res.hit_found = false;
         }
-
     }
-    if (res.hit_found && res.directly_hit_entity->collider.transparency_type == TransparencyType_Camouflage){
-        Entity* entity = res.directly_hit_entity;
-        entity->collider.transparency_type = TransparencyType_Transparent;
-        entity->last_raycast = game_raycast(game, origin_entity, origin, dir, mask, dbg);
-        entity->collider.transparency_type = TransparencyType_Camouflage;
-        if (entity->last_raycast.hit_found && 
-            entity->last_raycast.final_hit_entity->collider.camouflage_color == entity->collider.camouflage_color){
-            res.final_hit_entity = entity->last_raycast.final_hit_entity;
+
+    if (res.hit_found && hit->collider.transparency_type == TransparencyType_Camouflage &&
+        exclusion->transparent_count < RAYCAST_BOUNCE_CAP) {
+        exclusion->transparent[exclusion->transparent_count++] = hit;
+        RaycastResult behind = resolve_hits(game, origin_entity, origin, dir, mask, exclusion, 
+                                            hits, count, limit, first + 1);
+        --exclusion->transparent_count;
+
+        if (behind.hit_found && 
+            behind.final_hit_entity->collider.camouflage_color == hit->collider.camouflage_color){
+            res.final_hit_entity = behind.final_hit_entity;
         }
     }
 
+    return res;
+}
 
-#ifdef DEBUG
-    if (res.hit_found) {
-        push_line(dbg, origin, res.hit_pos, v3(1, 0, 0));
-    }
-#endif
+// Mirrors reflect the ray, camouflaged entities only count as hit if the entity behind them
+// has the same camouflage color. Nothing gets written to the entities, the entities a ray
+// has to look past or stop at are tracked in exclusion instead.
+RaycastResult raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, 
+                      RaycastExclusion* exclusion)
+{
+    LogEntryInfo info = start_log(LogTarget_GameRaycast);
+
+    RaycastHit hits[RAYCAST_HIT_CAP];
+    u32 count = raycast_all(game, origin_entity, origin, dir, mask, exclusion, hits, RAYCAST_HIT_CAP);
+    RaycastResult res = resolve_hits(game, origin_entity, origin, dir, mask, exclusion, 
+                                     hits, count, RAYCAST_HIT_CAP, 0);
 
     end_log(info);
 
     return res;
 }
+
+void push_raycast(RenderGroup* dbg, RaycastResult* res)
+{
+    for (u32 i = 1; i < res->point_count; ++i) {
+        push_line(dbg, res->points[i - 1], res->points[i], v3(1, 0, 0));
+    }
+}
+
+RaycastResult game_raycast(Game* game, Entity* origin_entity, V3 origin, V3 dir, u32 mask, RenderGroup* dbg)
+{
+    RaycastExclusion exclusion = {};
+    RaycastResult res = raycast(game, origin_entity, origin, dir, mask, &exclusion);
+
+#ifdef DEBUG
+    push_raycast(dbg, &res);
+#endif
+
+    return res;
+}
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 
 
@@ -14,11 +16,17 @@
 #include "include/arena.h"
 #include "include/renderer.h"
 #include "include/opengl_renderer.h"
+#include "include/null_renderer.h"
+#include "include/soft_renderer.h"
 #include "include/camera.h"
 #include "include/profiler.h"
 #include "include/game_math.h"
 #include "include/game.h"
 #include "include/asset_loader.h"
+#include "include/bench.h"
+#include "include/workers.h"
+#include "include/capture.h"
+#include "include/render_thread.h"
 
 struct GameWindow {
     GLFWwindow* handle;
@@ -32,6 +40,8 @@ double last_mouse_pos_x;
 double last_mouse_pos_y;
 
 Game game;
+// Set by the P key, the next frame gets written to a capture file
+bool capture_requested;
 
 u32 level_count = 22;
 
@@ -107,12 +117,144 @@ void create_window() {
     glfwMakeContextCurrent(global_window.handle);
 }
 
-i32 main()
+// Returns the pressed movement keys
+u8 read_input(u32* current_level)
 {
-    create_window();
-    init_pool(&pool);
+    if (glfwGetKey(global_window.handle, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
+        glfwSetWindowShouldClose(global_window.handle, true);
+    }
+
+#ifdef DEBUG
+    static bool c_pressed = false;
+    if (glfwGetKey(global_window.handle, GLFW_KEY_C) == GLFW_PRESS) {
+        if (!c_pressed) {
+            game_toggle_camera_state(&game);
+        }
+        c_pressed = true;
+    } else {
+        c_pressed = false;
+    }
+
+    static bool r_pressed = false;
+    if (glfwGetKey(global_window.handle, GLFW_KEY_R) == GLFW_PRESS) {
+        if (!r_pressed) {
+            game.reset_stage = true;
+        }
+        r_pressed = true;
+    } else {
+        r_pressed = false;
+    }
+
+    static bool n_pressed = false;
+    if (glfwGetKey(global_window.handle, GLFW_KEY_N) == GLFW_PRESS) {
+        if (!n_pressed) {
+            *current_level = (*current_level + 1) % level_count;
+            game.reset_stage = true;
+        }
+        n_pressed = true;
+    } else {
+        n_pressed = false;
+    }
+
+    static bool p_pressed = false;
+    if (glfwGetKey(global_window.handle, GLFW_KEY_P) == GLFW_PRESS) {
+        if (!p_pressed) {
+            capture_requested = true;
+        }
+        p_pressed = true;
+    } else {
+        p_pressed = false;
+    }
+#endif
+
+    return (glfwGetKey(global_window.handle, GLFW_KEY_W) == GLFW_PRESS) << 0 |
+           (glfwGetKey(global_window.handle, GLFW_KEY_S) == GLFW_PRESS) << 1 |
+           (glfwGetKey(global_window.handle, GLFW_KEY_A) == GLFW_PRESS) << 2 |
+           (glfwGetKey(global_window.handle, GLFW_KEY_D) == GLFW_PRESS) << 3;
+}
 
-    opengl_init();
+void print_headless_stats(u32 frames, double frame_time)
+{
+    NullRenderStats stats = null_stats();
+    float f = stats.frames? stats.frames : 1;
+    printf("Headless: %u frames, %.3f ms per frame for update and command building\n", 
+           frames, frame_time * 1000 / (frames? frames : 1));
+    printf("Per frame: %.1f entries, %.1f draws, %.1f quads, %.1f cubes, %.1f vertices\n", 
+           stats.entries / f, stats.draws / f, stats.quads / f, stats.cubes / f, stats.vertices / f);
+    printf("Per frame: %.1f state changes, %.1f lights, %.1f light passes, %.1f uniform calls saved\n", 
+           stats.state_changes / f, stats.lights / f, stats.light_passes / f, stats.uniform_calls_saved / f);
+    printf("Invalid entries: %u\n", stats.errors);
+}
+
+i32 main(i32 argc, char** argv)
+{
+    // Runs the game loop without a window against the null backend, for machines without a gpu
+    bool headless = false;
+    // Same, but the frames get rasterized on the cpu
+    bool soft_render = false;
+    u32 headless_frames = 600;
+    // Frame to write to a capture file, captures to replay instead of running the game
+    i32 capture_at = -1;
+    u32 replay_count = 0;
+    char** replay_paths = NULL;
+    // Windowed runs submit to gl on their own thread unless asked not to
+    bool threaded = true;
+
+    for (i32 i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--bench")) {
+            return bench_box_tests()? 0 : 1;
+        }
+        if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        }
+        if (!strcmp(argv[i], "--soft")) {
+            headless = true;
+            soft_render = true;
+        }
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            headless_frames = atoi(argv[++i]);
+        }
+        if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+            capture_at = atoi(argv[++i]);
+        }
+        if (!strcmp(argv[i], "--no-render-thread")) {
+            threaded = false;
+        }
+        if (!strcmp(argv[i], "--replay")) {
+            replay_paths = argv + i + 1;
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2)) {
+                ++replay_count;
+                ++i;
+            }
+        }
+    }
+
+    if (!headless) {
+        create_window();
+    }
+    init_pool(&pool);
+    init_workers();
+
+    if (headless) {
+        global_window.width = 960;
+        global_window.height = 540;
+        if (soft_render) {
+            soft_init();
+            render_backend = soft_backend();
+        } else {
+            null_init();
+            render_backend = null_backend();
+        }
+    } else {
+        opengl_init();
+        render_backend = opengl_backend();
+    }
+    // Replays dispose their frame arena right away, they stay on this thread
+    threaded = threaded && !headless && !replay_paths;
+    if (threaded) {
+        render_backend = start_render_thread(global_window.handle, render_backend);
+    }
+    render_backend = capture_backend(render_backend);
 
     Arena arena;
     init_arena(&arena, &pool);
@@ -120,14 +262,19 @@ i32 main()
     load_model("assets/maincharacter/ninja.gltf", &arena);
 
     CommandBuffer cmd;
-    u32 entry_size = 10000;
-    u8* entry_buffer = (u8*) push_size(&arena, entry_size);
-    u32 vert_cap = 100000;
-    Vertex* vert_buffer = (Vertex*) push_size(&arena, vert_cap * sizeof(Vertex));
+    CommandBufferPeak peak = {};
+    // One per frame the render thread can lag behind, the backend reads both while it renders
+    Arena frame_arenas[RENDER_SLOT_COUNT];
+    BoxBatch* cube_bounds[RENDER_SLOT_COUNT];
+    u32 cube_bounds_size = sizeof(BoxBatch) * (STREAM_CUBE_CAP / BOX_BATCH_WIDTH + 1);
+    for (u32 i = 0; i < RENDER_SLOT_COUNT; ++i) {
+        init_arena(frame_arenas + i, &pool);
+        cube_bounds[i] = (BoxBatch*) push_size(&arena, cube_bounds_size);
+    }
 
     TextureHandle white;
     TextureLoadOp load_white = texture_load_op(&white, "assets/white.png");
-    opengl_load_texture(&load_white);
+    render_backend.load_texture(&load_white);
     free_texture_load_op(&load_white);
 
     Mat4 proj = glm::perspective(45.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
@@ -135,50 +282,30 @@ i32 main()
     Arena game_arena;
     init_arena(&game_arena, &pool);
     game_load_assets();
+
+    if (replay_paths) {
+        CaptureFrame* frames = (CaptureFrame*) push_size(&arena, sizeof(CaptureFrame) * max(replay_count, (u32) 1));
+        for (u32 i = 0; i < replay_count; ++i) {
+            if (!load_capture(frames + i, replay_paths[i], &arena)) {
+                return 1;
+            }
+        }
+        replay_captures(frames, replay_count, headless_frames);
+        return 0;
+    }
+
     game = {};
 
     u32 current_level = 21;
     game_init(&game, &game_arena, levels[current_level], white);
 
-    while (!glfwWindowShouldClose(global_window.handle)) {
-        start_frame();
-
-        if (glfwGetKey(global_window.handle, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-            glfwSetWindowShouldClose(global_window.handle, true);
-        }
+    u32 frame = 0;
+    double frame_time = 0;
 
-#ifdef DEBUG
-        static bool c_pressed = false;
-        if (glfwGetKey(global_window.handle, GLFW_KEY_C) == GLFW_PRESS) {
-            if (!c_pressed) {
-                game_toggle_camera_state(&game);
-            }
-            c_pressed = true;
-        } else {
-            c_pressed = false;
-        }
+    while (headless? frame < headless_frames : !glfwWindowShouldClose(global_window.handle)) {
+        start_frame();
 
-        static bool r_pressed = false;
-        if (glfwGetKey(global_window.handle, GLFW_KEY_R) == GLFW_PRESS) {
-            if (!r_pressed) {
-                game.reset_stage = true;
-            }
-            r_pressed = true;
-        } else {
-            r_pressed = false;
-        }
-
-        static bool n_pressed = false;
-        if (glfwGetKey(global_window.handle, GLFW_KEY_N) == GLFW_PRESS) {
-            if (!n_pressed) {
-                current_level = (current_level + 1) % level_count;
-                game.reset_stage = true;
-            }
-            n_pressed = true;
-        } else {
-            n_pressed = false;
-        }
-#endif
+        u8 pressed = headless? 0 : read_input(&current_level);
 
         if (game.next_stage) {
             current_level = (current_level + 1) % level_count;
@@ -190,20 +317,10 @@ i32 main()
             game_init(&game, &game_arena, levels[current_level], white);
         }
 
-
-        u8 pressed = (glfwGetKey(global_window.handle, GLFW_KEY_W) == GLFW_PRESS) << 0 |
-                     (glfwGetKey(global_window.handle, GLFW_KEY_S) == GLFW_PRESS) << 1 |
-                     (glfwGetKey(global_window.handle, GLFW_KEY_A) == GLFW_PRESS) << 2 |
-                     (glfwGetKey(global_window.handle, GLFW_KEY_D) == GLFW_PRESS) << 3;
-
         // printf("Camera pos: %f, %f, %f, Camera forward: %f %f %f\n", 
         //        game.camera.pos.x, game.camera.pos.y, game.camera.pos.z,
         //        game.camera.front.x, game.camera.front.y, game.camera.front.z);
 
-        if (glfwGetKey(global_window.handle, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-            glfwSetWindowShouldClose(global_window.handle, true);
-        }
-
         float delta = 1.0f / 60.f;
 
         if (game.camera_state == CameraState_Free) {
@@ -218,25 +335,67 @@ i32 main()
 
         V3 right = v3(view[0][0], view[1][0], view[2][0]);
         V3 up = v3(view[0][1], view[1][1], view[2][1]);
-        cmd = command_buffer(entry_size, entry_buffer, vert_cap, vert_buffer, 
+        double build_start = wall_time();
+        StreamRegion stream = render_backend.begin_frame(peak.vert_count);
+        // The render thread is done with the slot once begin_frame() returns
+        u32 slot = threaded? render_slot() : 0;
+        dispose(frame_arenas + slot);
+        cmd = command_buffer(frame_arenas + slot, peak.entry_size, stream.vert_cap, stream.verts, 
+                             stream.cube_cap, stream.cubes, cube_bounds[slot],
                              global_window.width, global_window.height, white, 
                              proj * view, game.camera.pos, up, right);
 
         push_clear(&cmd, v3(0.1, 0.1, 0.2));
 
         RenderGroup main_group = render_group(&cmd,RENDER_DEPTH_TEST | RENDER_LIT | RENDER_CULLING | RENDER_SHADOW_CASTER);
-        RenderGroup transparent_group = render_group(&cmd, RENDER_DEPTH_TEST | RENDER_LIT | RENDER_CULLING);
+        RenderGroup transparent_group = render_group(&cmd, RENDER_DEPTH_TEST | RENDER_LIT | RENDER_CULLING | RENDER_TRANSPARENT);
         RenderGroup debug_group = render_group(&cmd, 0);
 
         game_update(&game, pressed, delta, &main_group, &debug_group);
         game_render(&game, &main_group, &transparent_group, &debug_group);
 
-        opengl_render_commands(&cmd);
+        frame_time += wall_time() - build_start;
+        ++frame;
+
+        if (capture_requested || (i32) frame - 1 == capture_at) {
+            char path[64];
+            snprintf(path, sizeof(path), "capture_%u.ncap", frame - 1);
+            if (capture_frame(&cmd, path)) {
+                printf("Captured frame to %s\n", path);
+            }
+            capture_requested = false;
+        }
+
+        render_backend.render_commands(&cmd);
+        update_peak(&peak, &cmd);
 
         end_frame();
 
-        glfwSwapBuffers(global_window.handle);
-        glfwPollEvents();
+        if (!headless) {
+            if (!threaded) {
+                glfwSwapBuffers(global_window.handle);
+            }
+            glfwPollEvents();
+        }
+    }
+
+    if (threaded) {
+        stop_render_thread();
+    }
+
+    if (soft_render) {
+        printf("Headless: %u frames, %.3f ms per frame for update and command building\n",
+               frame, frame_time * 1000 / (frame? frame : 1));
+        if (!soft_write_ppm("soft_frame.ppm")) {
+            printf("Could not write soft_frame.ppm\n");
+        }
+        // The last command buffer stays valid until the frame arena gets disposed again
+        soft_report_scaling(&cmd, 10);
+        return 0;
+    }
+    if (headless) {
+        print_headless_stats(frame, frame_time);
+        return null_stats().errors? 1 : 0;
     }
 
     return 0;
@@ -244,7 +403,7 @@ i32 main()
 
 #ifdef WINDOWS
 i32 WinMain() {
-    return main();
+    return main(__argc, __argv);
 }
 #endif
 
@@ -0,0 +1,263 @@
+#include "include/null_renderer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/opengl_renderer.h"
+#include "include/game_math.h"
+#include "include/profiler.h"
+
+// Vertices of the unit cube every cube instance gets expanded from
+#define NULL_CUBE_VERTS 24
+
+struct NullContext
+{
+    Arena arena;
+
+    Vertex* verts;
+    u32 vert_cap;
+    CubeInstance* cubes;
+
+    u64 texture_count;
+    u32 model_count;
+    u32 model_verts[MODEL_CAP];
+    // Slot 0 stays unused like in the opengl backend
+    u32 static_batch_count;
+    u32 static_batch_verts[STATIC_BATCH_CAP];
+
+    NullRenderStats stats;
+};
+
+NullContext null;
+
+void null_init()
+{
+    null = {};
+    init_arena(&null.arena, &pool);
+
+    null.vert_cap = STREAM_VERT_CAP;
+    null.verts = (Vertex*) push_size(&null.arena, sizeof(Vertex) * null.vert_cap);
+    null.cubes = (CubeInstance*) push_size(&null.arena, sizeof(CubeInstance) * STREAM_CUBE_CAP);
+    null.static_batch_count = 1;
+}
+
+StreamRegion null_begin_frame(u32 vert_hint)
+{
+    // Nothing reads the old region anymore, so it simply stays in the arena
+    if (vert_hint > null.vert_cap) {
+        while (null.vert_cap < vert_hint) {
+            null.vert_cap *= 2;
+        }
+        null.verts = (Vertex*) push_size(&null.arena, sizeof(Vertex) * null.vert_cap);
+    }
+
+    StreamRegion region;
+    region.verts = null.verts;
+    region.vert_cap = null.vert_cap;
+    region.cubes = null.cubes;
+    region.cube_cap = STREAM_CUBE_CAP;
+    return region;
+}
+
+void null_error(const char* message, u32 type)
+{
+    printf("Null backend: %s (entry type %u)\n", message, type);
+    ++null.stats.errors;
+}
+
+i32 compare_keys(const void* a, const void* b)
+{
+    u64 x = *(u64*) a;
+    u64 y = *(u64*) b;
+    return (x > y) - (x < y);
+}
+
+void null_render_commands(CommandBuffer* buffer)
+{
+    LogEntryInfo info = start_log(LogTarget_Backend);
+    NullRenderStats* stats = &null.stats;
+
+    u32 entry_size = 0;
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        entry_size += chunk->size;
+    }
+    u32 vert_count = 0;
+    for (VertexChunk* chunk = buffer->first_verts; chunk; chunk = chunk->next) {
+        vert_count += chunk->count;
+    }
+    if (entry_size != buffer->entry_size || vert_count != buffer->vert_count) {
+        null_error("chunk sizes do not add up", 0);
+    }
+
+    begin_tmp(&null.arena);
+    u32 key_count = 0;
+    u32 key_cap = buffer->entry_size / sizeof(CommandEntryHeader) + 1;
+    u64* keys = (u64*) push_size(&null.arena, sizeof(u64) * key_cap);
+    u32 light_count = 0;
+    u32 lit_draws = 0;
+
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            u8* entry = chunk->data + offset;
+            CommandEntryHeader* header = (CommandEntryHeader*) entry;
+
+            u32 size = 0;
+            switch (header->type) {
+                case EntryType_Clear: {
+                    size = sizeof(CommandEntryClear);
+                } break;
+
+                case EntryType_DrawQuads: {
+                    CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) entry;
+                    size = sizeof(CommandEntryDrawQuads);
+                    lit_draws += (draw->setup.flags & RENDER_LIT) != 0;
+
+                    if (draw->vert_offset + 4 * draw->quad_count > buffer->vert_count) {
+                        null_error("quads outside of the vertex stream", header->type);
+                    }
+                    stats->quads += draw->quad_count;
+                    stats->vertices += 4 * draw->quad_count;
+                } break;
+
+                case EntryType_DrawCubes: {
+                    CommandEntryDrawCubes* draw = (CommandEntryDrawCubes*) entry;
+                    size = sizeof(CommandEntryDrawCubes);
+                    lit_draws += (draw->setup.flags & RENDER_LIT) != 0;
+
+                    if (draw->cube_offset + draw->cube_count > buffer->cube_count) {
+                        null_error("cubes outside of the cube stream", header->type);
+                    }
+                    stats->cubes += draw->cube_count;
+                    stats->vertices += NULL_CUBE_VERTS * draw->cube_count;
+                } break;
+
+                case EntryType_DrawStaticBatch: {
+                    CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) entry;
+                    size = sizeof(CommandEntryDrawStaticBatch);
+                    lit_draws += (draw->setup.flags & RENDER_LIT) != 0;
+
+                    if (!draw->batch.id || draw->batch.id >= null.static_batch_count) {
+                        null_error("static batch was never loaded", header->type);
+                    } else {
+                        stats->vertices += null.static_batch_verts[draw->batch.id];
+                    }
+                } break;
+
+                case EntryType_DrawModel: {
+                    CommandEntryDrawModel* draw = (CommandEntryDrawModel*) entry;
+                    size = sizeof(CommandEntryDrawModel);
+                    lit_draws += (draw->setup.flags & RENDER_LIT) != 0;
+
+                    if (draw->model.id >= null.model_count) {
+                        null_error("model was never loaded", header->type);
+                    } else {
+                        stats->vertices += null.model_verts[draw->model.id];
+                    }
+                } break;
+
+                case EntryType_DrawRiggedModel: {
+                    CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) entry;
+                    size = sizeof(CommandEntryDrawRiggedModel);
+                    lit_draws += (draw->setup.flags & RENDER_LIT) != 0;
+
+                    if (draw->model.id >= null.model_count) {
+                        null_error("model was never loaded", header->type);
+                    } else {
+                        stats->vertices += null.model_verts[draw->model.id];
+                    }
+                    if (draw->bone_count && !draw->bone_trans) {
+                        null_error("rigged model without a pose", header->type);
+                    }
+                } break;
+
+                case EntryType_PushLight: {
+                    size = sizeof(CommandEntryPushLight);
+                    ++light_count;
+                } break;
+
+                default: {
+                    null_error("unknown entry", header->type);
+                } break;
+            }
+
+            if (!size || offset + size > chunk->size) {
+                if (size) {
+                    null_error("entry runs past the end of its chunk", header->type);
+                }
+                break;
+            }
+            offset += size;
+            ++stats->entries;
+
+            if (header->type != EntryType_Clear && header->type != EntryType_PushLight) {
+                keys[key_count] = header->sort_key;
+                ++key_count;
+            }
+        }
+    }
+
+    stats->lights += light_count;
+    stats->uniform_calls_saved += lit_draws * LIT_UNIFORM_CALLS;
+    // All shadow maps of a frame get drawn in one layered pass
+    stats->light_passes += light_count > 0;
+
+    // Pass, shader, render flags and material, everything the opengl backend switches state for
+    qsort(keys, key_count, sizeof(u64), compare_keys);
+    for (u32 i = 0; i < key_count; ++i) {
+        if (!i || sort_key_state(keys[i]) != sort_key_state(keys[i - 1])) {
+            ++stats->state_changes;
+        }
+    }
+    stats->draws += key_count;
+    ++stats->frames;
+
+    end_tmp(&null.arena);
+    end_log(info);
+}
+
+void null_load_texture(TextureLoadOp* load_op)
+{
+    ++null.texture_count;
+    load_op->handle->id = null.texture_count;
+}
+
+void null_load_model(ModelLoadOp* load_op)
+{
+    assert(null.model_count < MODEL_CAP);
+    u32 verts = 0;
+    for (u32 i = 0; i < load_op->mesh_count; ++i) {
+        verts += load_op->meshes[i].vertex_count;
+    }
+
+    load_op->handle->id = null.model_count;
+    null.model_verts[null.model_count] = verts;
+    ++null.model_count;
+}
+
+void null_load_static_batch(StaticBatchLoadOp* load_op)
+{
+    StaticBatchHandle* handle = load_op->handle;
+    if (!handle->id) {
+        assert(null.static_batch_count < STATIC_BATCH_CAP);
+        handle->id = null.static_batch_count;
+        ++null.static_batch_count;
+    }
+    null.static_batch_verts[handle->id] = load_op->vertex_count;
+}
+
+RenderBackend null_backend()
+{
+    RenderBackend backend;
+    backend.begin_frame = null_begin_frame;
+    backend.render_commands = null_render_commands;
+    backend.load_texture = null_load_texture;
+    backend.load_model = null_load_model;
+    backend.load_static_batch = null_load_static_batch;
+    return backend;
+}
+
+NullRenderStats null_stats()
+{
+    return null.stats;
+}
@@ -1,12 +1,15 @@
 #include "include/opengl_renderer.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "include/types.h"
 #include "include/util.h"
+#include "include/game_math.h"
 #include "include/profiler.h"
 
 #define SHADER_SKELETON (1 << 0)
@@ -73,6 +76,18 @@ Program load_program(const char* vertex_file, const char* frag_file, u32 flags)
     const char* code[2] = {header.ptr};
 
     append_line(&header, "#version 440");
+    // Sizes the shaders share with LightBuffer and ClusterBuffer
+    char line[64];
+    snprintf(line, sizeof(line), "#define SHADOW_MAP_COUNT %uu", SHADOW_MAP_COUNT);
+    append_line(&header, line);
+    snprintf(line, sizeof(line), "#define CLUSTER_X %uu", CLUSTER_X);
+    append_line(&header, line);
+    snprintf(line, sizeof(line), "#define CLUSTER_Y %uu", CLUSTER_Y);
+    append_line(&header, line);
+    snprintf(line, sizeof(line), "#define CLUSTER_Z %uu", CLUSTER_Z);
+    append_line(&header, line);
+    snprintf(line, sizeof(line), "#define NO_SHADOW_MAP %uu", NO_SHADOW_MAP);
+    append_line(&header, line);
     if (flags & SHADER_SKELETON) {
         append_line(&header, "#define SKELETON");
     }
@@ -126,12 +141,12 @@ Program load_program(const char* vertex_file, const char* frag_file, u32 flags)
     shader.camera_pos = glGetUniformLocation(shader.id, "camera_pos");
 
     shader.light_space = glGetUniformLocation(shader.id, "light_space");
-    shader.shadow_map = glGetUniformLocation(shader.id, "shadowmap");
-
-    shader.spotlight_count = glGetUniformLocation(shader.id, "sl_count");
-    shader.spotlight_pos = glGetUniformLocation(shader.id, "sl_pos");
-    shader.spotlight_dir = glGetUniformLocation(shader.id, "sl_dir");
-    shader.spotlight_fov = glGetUniformLocation(shader.id, "sl_fov");
+    shader.inv_light_space = glGetUniformLocation(shader.id, "inv_light_space");
+    shader.light_pos = glGetUniformLocation(shader.id, "light_pos");
+    shader.far_plane = glGetUniformLocation(shader.id, "far_plane");
+    shader.layers = glGetUniformLocation(shader.id, "layers");
+    shader.layer_count = glGetUniformLocation(shader.id, "layer_count");
+    shader.cache_cubes = glGetUniformLocation(shader.id, "cache_cubes");
 
     shader.bone_trans = glGetUniformLocation(shader.id, "bone_trans");
     
@@ -229,11 +244,210 @@ Framebuffer create_framebuffer(u32 width, u32 height, u32 flags)
     return res;
 }
 
+// Depth array the lit shaders compare against, plus the cube array of the static caster caches
+void create_shadow_maps()
+{
+    glGenTextures(1, &opengl.shadow_maps);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, opengl.shadow_maps);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 
+                 SHADOW_MAP_COUNT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+
+    glGenFramebuffers(1, &opengl.shadow_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, opengl.shadow_framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, opengl.shadow_maps, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    u32 status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assert(status == GL_FRAMEBUFFER_COMPLETE);
+
+    glGenTextures(1, &opengl.shadow_cache_maps);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, opengl.shadow_cache_maps);
+    glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT16, SHADOW_CACHE_SIZE, SHADOW_CACHE_SIZE, 
+                 6 * SHADOW_CACHE_COUNT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    for (u32 i = 0; i < SHADOW_CACHE_COUNT; ++i) {
+        opengl.shadow_caches[i].light = -1;
+    }
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &opengl.shadow_cache_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, opengl.shadow_cache_framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, opengl.shadow_cache_maps, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assert(status == GL_FRAMEBUFFER_COMPLETE);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 void set_uniform_mat4(u32 id, Mat4* mat, u32 count)
 {
     glUniformMatrix4fv(id, count, GL_FALSE, (GLfloat*) mat);
 }
 
+// Quads of 4 vertices in strip order, indexed by the shared quad index buffer
+void init_quad_vao(u32 vao, u32 vertex_buffer)
+{
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl.quad_indices);
+
+    // 0: pos
+    // 1: uv
+    // 2: norm
+    // 3: color
+    // 4: texture
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, pos));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, uv));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, norm));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, color));
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(4, 2, GL_UNSIGNED_INT, sizeof(Vertex), (void*) offsetof(Vertex, texture));
+}
+
+// Unit cube from the shared mesh, everything else per instance from instance_buffer
+void init_cube_vao(u32 vao, u32 instance_buffer)
+{
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, opengl.cube_mesh);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl.cube_indices);
+
+    // 0: pos
+    // 1: uv
+    // 2: norm
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (void*) (sizeof(float) * 3));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (void*) (sizeof(float) * 5));
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+
+    // 3: color
+    // 4: texture
+    // 5: cube pos
+    // 6: cube radius
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, color));
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(4, 2, GL_UNSIGNED_INT, sizeof(CubeInstance), (void*) offsetof(CubeInstance, texture));
+    glVertexAttribDivisor(4, 1);
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, pos));
+    glVertexAttribDivisor(5, 1);
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(6, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, radius));
+    glVertexAttribDivisor(6, 1);
+}
+
+// Only positions, every instance is repeated once per shadow map layer, see set_shadow_layer_count()
+void init_shadow_cube_vao(u32 vao, u32 instance_buffer)
+{
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, opengl.cube_mesh);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl.cube_indices);
+
+    // 0: pos
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+
+    // 1: cube pos
+    // 2: cube radius
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, pos));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, radius));
+    glVertexAttribDivisor(2, 1);
+    opengl.shadow_cube_divisor = 1;
+}
+
+// Two triangles per quad, same winding as the strips they replace. Static batches share these too.
+void fill_quad_indices(u32 quad_cap)
+{
+    begin_tmp(&opengl.render_arena);
+    u32* quad_indices = (u32*) push_size(&opengl.render_arena, sizeof(u32) * 6 * quad_cap);
+    for (u32 i = 0; i < quad_cap; ++i) {
+        u32 face[6] = { 0, 1, 2, 2, 1, 3 };
+        for (u32 j = 0; j < 6; ++j) {
+            quad_indices[6 * i + j] = 4 * i + face[j];
+        }
+    }
+    // Not the element array target, that would rebind it on whatever vao is bound
+    glBindBuffer(GL_COPY_WRITE_BUFFER, opengl.quad_indices);
+    glBufferData(GL_COPY_WRITE_BUFFER, sizeof(u32) * 6 * quad_cap, quad_indices, GL_STATIC_DRAW);
+    end_tmp(&opengl.render_arena);
+}
+
+// Maps vert_cap vertices per region into opengl.vertex_buffer, which has to be a fresh buffer name
+void create_vertex_stream(u32 vert_cap)
+{
+    // Readable, grow_vertex_stream() and capture_frame() read back what the frame wrote
+    u32 map_flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glBindBuffer(GL_ARRAY_BUFFER, opengl.vertex_buffer);
+    u32 vert_size = sizeof(Vertex) * vert_cap * STREAM_FRAME_COUNT;
+    glBufferStorage(GL_ARRAY_BUFFER, vert_size, NULL, map_flags);
+    opengl.mapped_verts = (Vertex*) glMapBufferRange(GL_ARRAY_BUFFER, 0, vert_size, map_flags);
+    opengl.stream_vert_cap = vert_cap;
+
+    fill_quad_indices(vert_cap / 4);
+    init_quad_vao(opengl.quad_vao, opengl.vertex_buffer);
+}
+
+// Doubles the vertex regions until they hold vert_cap vertices. The chunks in keep get copied into
+// the current region. Waits for the gpu to be done with every region, so this should only happen on
+// the frame that outgrew them.
+void grow_vertex_stream(u32 vert_cap, VertexChunk* keep)
+{
+    glFinish();
+    for (u32 i = 0; i < STREAM_FRAME_COUNT; ++i) {
+        if (opengl.stream_fences[i]) {
+            glDeleteSync((GLsync) opengl.stream_fences[i]);
+            opengl.stream_fences[i] = NULL;
+        }
+    }
+
+    u32 cap = opengl.stream_vert_cap;
+    while (cap < vert_cap) {
+        cap *= 2;
+    }
+
+    // The first chunk still points into the old mapping, which stays mapped for reading until it is deleted
+    u32 old_buffer = opengl.vertex_buffer;
+    glGenBuffers(1, &opengl.vertex_buffer);
+    create_vertex_stream(cap);
+
+    Vertex* dst = opengl.mapped_verts + opengl.stream_frame * cap;
+    for (VertexChunk* chunk = keep; chunk; chunk = chunk->next) {
+        for (u32 i = 0; i < chunk->count; ++i) {
+            *dst++ = chunk->verts[i];
+        }
+    }
+
+    glDeleteBuffers(1, &old_buffer);
+}
+
 void opengl_init()
 {
 
@@ -261,33 +475,18 @@ void opengl_init()
     opengl.main_framebuffer.flags = 0;
     opengl.post_framebuffer.flags = 0;
 
-    u32 vaos[2];
-    glGenVertexArrays(2, vaos);
+    u32 vaos[4];
+    glGenVertexArrays(4, vaos);
 
     opengl.quad_vao = vaos[0];
     glBindVertexArray(opengl.quad_vao);
 
-    u32 buffers[2];
-    glGenBuffers(2, buffers);
+    u32 buffers[8];
+    glGenBuffers(8, buffers);
 
+    opengl.quad_indices = buffers[5];
     opengl.vertex_buffer = buffers[0];
-    glBindBuffer(GL_ARRAY_BUFFER, opengl.vertex_buffer);
-
-    // 0: pos
-    // 1: uv
-    // 2: norm
-    // 3: color
-    // 4: texture
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, pos));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, uv));
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, norm));
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, color));
-    glEnableVertexAttribArray(4);
-    glVertexAttribIPointer(4, 2, GL_UNSIGNED_INT, sizeof(Vertex), (void*) offsetof(Vertex, texture));
+    create_vertex_stream(STREAM_VERT_CAP);
 
     float quad_verts[] = {
         -1, -1,
@@ -303,20 +502,123 @@ void opengl_init()
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, 0);
 
+    // Same faces, uvs and winding as push_rect used to produce per cube
+    float cube_verts[] = {
+        // pos         uv      norm
+        -1, -1,  1,    0, 0,   0,  0,  1,
+        -1,  1,  1,    0, 1,   0,  0,  1,
+         1, -1,  1,    1, 0,   0,  0,  1,
+         1,  1,  1,    1, 1,   0,  0,  1,
+
+         1, -1, -1,    0, 0,   0,  0, -1,
+         1,  1, -1,    0, 1,   0,  0, -1,
+        -1, -1, -1,    1, 0,   0,  0, -1,
+        -1,  1, -1,    1, 1,   0,  0, -1,
+
+         1, -1, -1,    0, 0,   1,  0,  0,
+         1, -1,  1,    0, 1,   1,  0,  0,
+         1,  1, -1,    1, 0,   1,  0,  0,
+         1,  1,  1,    1, 1,   1,  0,  0,
+
+        -1,  1, -1,    0, 0,  -1,  0,  0,
+        -1,  1,  1,    0, 1,  -1,  0,  0,
+        -1, -1, -1,    1, 0,  -1,  0,  0,
+        -1, -1,  1,    1, 1,  -1,  0,  0,
+
+         1,  1, -1,    0, 0,   0,  1,  0,
+         1,  1,  1,    0, 1,   0,  1,  0,
+        -1,  1, -1,    1, 0,   0,  1,  0,
+        -1,  1,  1,    1, 1,   0,  1,  0,
+
+        -1, -1, -1,    0, 0,   0, -1,  0,
+        -1, -1,  1,    0, 1,   0, -1,  0,
+         1, -1, -1,    1, 0,   0, -1,  0,
+         1, -1,  1,    1, 1,   0, -1,  0,
+    };
+    // Every face is a strip of 4 vertices
+    u16 cube_indices[36];
+    for (u32 i = 0; i < 6; ++i) {
+        u16 first = 4 * i;
+        u16 face[6] = { 0, 1, 2, 2, 1, 3 };
+        for (u32 j = 0; j < 6; ++j) {
+            cube_indices[6 * i + j] = first + face[j];
+        }
+    }
+
+    opengl.cube_mesh = buffers[2];
+    glBindBuffer(GL_ARRAY_BUFFER, opengl.cube_mesh);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_verts), cube_verts, GL_STATIC_DRAW);
+    opengl.cube_indices = buffers[3];
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl.cube_indices);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_indices), cube_indices, GL_STATIC_DRAW);
+
+    // Readable for capture_frame()
+    u32 map_flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    opengl.cube_buffer = buffers[4];
+    glBindBuffer(GL_ARRAY_BUFFER, opengl.cube_buffer);
+    u32 cube_size = sizeof(CubeInstance) * STREAM_CUBE_CAP * STREAM_FRAME_COUNT;
+    glBufferStorage(GL_ARRAY_BUFFER, cube_size, NULL, map_flags);
+    opengl.mapped_cubes = (CubeInstance*) glMapBufferRange(GL_ARRAY_BUFFER, 0, cube_size, map_flags);
+    opengl.cube_vao = vaos[2];
+    init_cube_vao(opengl.cube_vao, opengl.cube_buffer);
+    opengl.shadow_cube_vao = vaos[3];
+    init_shadow_cube_vao(opengl.shadow_cube_vao, opengl.cube_buffer);
+    // Slot 0 stays unused, it is the handle of batches that were never loaded
+    opengl.static_batch_count = 1;
+
+    // Room for SHADOW_MAP_COUNT lights to start with, see reserve_ssbo()
+    opengl.light_buffer = buffers[6];
+    opengl.light_buffer_size = sizeof(LightBuffer) + sizeof(GpuSpotLight) * SHADOW_MAP_COUNT;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, opengl.light_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, opengl.light_buffer_size, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BINDING, opengl.light_buffer);
+    opengl.cluster_buffer = buffers[7];
+    opengl.cluster_buffer_size = sizeof(ClusterBuffer) + sizeof(u32) * CLUSTER_COUNT * SHADOW_MAP_COUNT;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, opengl.cluster_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, opengl.cluster_buffer_size, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BINDING, opengl.cluster_buffer);
+
     opengl.post_shader = load_program("shader/post.vert", "shader/post.frag", 0);
     opengl.quad_shader = load_program("shader/draw.vert", "shader/draw.frag", 0);
+    opengl.cube_shader = load_program("shader/cube.vert", "shader/draw.frag", 0);
     opengl.model_shader = load_program("shader/model.vert", "shader/model.frag", 0);
     opengl.rigged_model_shader = load_program("shader/model.vert", "shader/model.frag", 
                                               SHADER_SKELETON);
     opengl.shadow_shader = load_program("shader/shadow.vert", "shader/shadow.frag", 0);
+    opengl.shadow_cubes_shader = load_program("shader/shadow_cubes.vert", "shader/shadow.frag", 0);
+    opengl.shadow_cube_shader = load_program("shader/shadow_cube.vert", "shader/shadow_cube.frag", 0);
+    opengl.shadow_composite_shader = load_program("shader/shadow_composite.vert", 
+                                                  "shader/shadow_composite.frag", 0);
 
-    for (u32 i = 0; i < SHADOW_MAP_COUNT; ++i) {
-        opengl.shadow_maps[i] = create_framebuffer(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 
-                                                   FRAMEBUFFER_DEPTH_TEX);
+    create_shadow_maps();
+}
 
-        opengl.shadow_map_handles[i] = glGetTextureHandleARB(opengl.shadow_maps[i].depth_tex);
-        glMakeTextureHandleResidentARB(opengl.shadow_map_handles[i]);
+// Moves on to the next region, waits until the gpu is done with what it held
+StreamRegion opengl_begin_frame(u32 vert_hint)
+{
+    opengl.stream_frame = (opengl.stream_frame + 1) % STREAM_FRAME_COUNT;
+    if (vert_hint > opengl.stream_vert_cap) {
+        grow_vertex_stream(vert_hint, NULL);
+    }
+
+    GLsync fence = (GLsync) opengl.stream_fences[opengl.stream_frame];
+    if (fence) {
+        while (true) {
+            u32 status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED || status == GL_WAIT_FAILED) {
+                break;
+            }
+        }
+        glDeleteSync(fence);
+        opengl.stream_fences[opengl.stream_frame] = NULL;
     }
+
+    StreamRegion region;
+    region.verts = opengl.mapped_verts + opengl.stream_frame * opengl.stream_vert_cap;
+    region.vert_cap = opengl.stream_vert_cap;
+    region.cubes = opengl.mapped_cubes + opengl.stream_frame * STREAM_CUBE_CAP;
+    region.cube_cap = STREAM_CUBE_CAP;
+    return region;
 }
 
 void apply_settings(RenderSettings* settings) 
@@ -331,111 +633,680 @@ void apply_settings(RenderSettings* settings)
     opengl.prev_settings = *settings;
 }
 
-void prepare_render_setup(RenderSetup* setup, Program* shader, SpotLight* lights, u32 light_count,
-                          Mat4 proj, V3 camera_pos)
+#define RENDER_STATE_PROGRAMS 4
+
+// Render state of the main pass, so sorted draws only touch what actually changes
+struct RenderState
 {
-    if (setup->flags & RENDER_DEPTH_TEST) {
-        glDepthFunc(GL_LESS);
-    } else {
-        glDepthFunc(GL_ALWAYS);
+    u32 program;
+    u32 vao;
+    i32 depth_test;
+    i32 culling;
+
+    // Programs that already got this frames camera
+    u32 ready_count;
+    Program* ready[RENDER_STATE_PROGRAMS];
+
+    // Uniform calls the lit draws would have made without the light block
+    u32 uniform_calls_saved;
+};
+
+RenderState render_state()
+{
+    RenderState state = {};
+    state.depth_test = -1;
+    state.culling = -1;
+    return state;
+}
+
+void bind_vao(RenderState* state, u32 vao)
+{
+    if (state->vao != vao) {
+        glBindVertexArray(vao);
+        state->vao = vao;
+    }
+}
+
+void prepare_render_setup(RenderState* state, RenderSetup* setup, Program* shader, Mat4 proj, V3 camera_pos)
+{
+    i32 depth_test = (setup->flags & RENDER_DEPTH_TEST) != 0;
+    if (state->depth_test != depth_test) {
+        glDepthFunc(depth_test? GL_LESS : GL_ALWAYS);
+        state->depth_test = depth_test;
     }
 
     // TODO: Apply draw->setup.lit here
-    if (setup->flags & RENDER_CULLING) {
-        glEnable(GL_CULL_FACE);
-    } else {
-        glDisable(GL_CULL_FACE);
+    i32 culling = (setup->flags & RENDER_CULLING) != 0;
+    if (state->culling != culling) {
+        if (culling) {
+            glEnable(GL_CULL_FACE);
+        } else {
+            glDisable(GL_CULL_FACE);
+        }
+        state->culling = culling;
+    }
+
+    if (state->program != shader->id) {
+        glUseProgram(shader->id);
+        state->program = shader->id;
+    }
+
+    u32 slot = 0;
+    while (slot < state->ready_count && state->ready[slot] != shader) {
+        ++slot;
+    }
+    if (slot == state->ready_count) {
+        assert(slot < RENDER_STATE_PROGRAMS);
+        set_uniform_mat4(shader->proj, &proj, 1);
+        glUniform3fv(shader->camera_pos, 1, (float*) &camera_pos);
+        state->ready[slot] = shader;
+        ++state->ready_count;
     }
-    glUseProgram(shader->id);
-    set_uniform_mat4(shader->proj, &proj, 1);
-    glUniform3fv(shader->camera_pos, 1, (float*) &camera_pos);
 
     if (setup->flags & RENDER_LIT) {
-        V3 pos_acc[MAX_SPOTLIGHTS];
-        V3 dir_acc[MAX_SPOTLIGHTS];
-        float fov_acc[MAX_SPOTLIGHTS];
-        Mat4 light_space_acc[MAX_SPOTLIGHTS];
-        u64 shadow_map_acc[MAX_SPOTLIGHTS];
+        state->uniform_calls_saved += LIT_UNIFORM_CALLS;
+    }
+}
 
-        glUniform1ui(shader->spotlight_count, light_count);
+// Binds buffer and doubles its storage until size bytes fit. The old contents are lost.
+void reserve_ssbo(u32 buffer, u32* buffer_size, u32 size)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    if (size <= *buffer_size) {
+        return;
+    }
+    while (*buffer_size < size) {
+        *buffer_size *= 2;
+    }
+    glBufferData(GL_SHADER_STORAGE_BUFFER, *buffer_size, NULL, GL_DYNAMIC_DRAW);
+}
 
-        for (u32 i = 0; i < light_count; ++i) {
-            light_space_acc[i] = lights[i].light_space;
-            shadow_map_acc[i] = opengl.shadow_map_handles[lights[i].shadow_map];
-            pos_acc[i] = lights[i].pos;
-            dir_acc[i] = lights[i].dir;
-            fov_acc[i] = lights[i].fov;
+void upload_lights(SpotLight* lights, u32 light_count)
+{
+    u32 size = sizeof(LightBuffer) + sizeof(GpuSpotLight) * light_count;
+    LightBuffer* block = (LightBuffer*) push_size(&opengl.render_arena, size);
+    memset(block, 0, size);
+    block->count = light_count;
+    GpuSpotLight* gpu_lights = (GpuSpotLight*) (block + 1);
+    for (u32 i = 0; i < light_count; ++i) {
+        GpuSpotLight* light = gpu_lights + i;
+        light->light_space = lights[i].light_space;
+        light->pos[0] = lights[i].pos.x;
+        light->pos[1] = lights[i].pos.y;
+        light->pos[2] = lights[i].pos.z;
+        light->pos[3] = lights[i].fov;
+        light->dir[0] = lights[i].dir.x;
+        light->dir[1] = lights[i].dir.y;
+        light->dir[2] = lights[i].dir.z;
+        light->dir[3] = lights[i].far_plane;
+        light->shadow_map = lights[i].shadow_map;
+    }
 
+    reserve_ssbo(opengl.light_buffer, &opengl.light_buffer_size, size);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, block);
+}
+
+// Clusters a light can reach, inclusive
+struct ClusterRange
+{
+    u32 min[3];
+    u32 max[3];
+};
+
+u32 cluster_slice(float depth)
+{
+    float slice = log(depth / CLUSTER_NEAR) / log(CLUSTER_FAR / CLUSTER_NEAR) * CLUSTER_Z;
+    return (u32) clamp(slice, 0, CLUSTER_Z - 1);
+}
+
+u32 cluster_tile(float ndc, u32 tiles)
+{
+    return (u32) clamp((ndc + 1) * 0.5 * tiles, 0, tiles - 1);
+}
+
+// Projects the corners of the light frustum into the camera. Returns false when none of it is on screen.
+bool light_cluster_range(Mat4 view_proj, SpotLight* light, ClusterRange* range)
+{
+    Mat4 inv_light_space = glm::inverse(light->light_space);
+
+    float min_w = CLUSTER_FAR;
+    float max_w = 0;
+    float min_xy[2] = { 1, 1 };
+    float max_xy[2] = { -1, -1 };
+    bool crosses_camera = false;
+
+    for (u32 corner = 0; corner < 8; ++corner) {
+        glm::vec4 ndc((corner & 1)? 1 : -1, (corner & 2)? 1 : -1, (corner & 4)? 1 : -1, 1);
+        glm::vec4 world = inv_light_space * ndc;
+        glm::vec4 clip = view_proj * (world / world.w);
+
+        min_w = min(min_w, clip.w);
+        max_w = max(max_w, clip.w);
+        if (clip.w < CLUSTER_NEAR) {
+            crosses_camera = true;
+            continue;
         }
+        for (u32 i = 0; i < 2; ++i) {
+            min_xy[i] = min(min_xy[i], clip[i] / clip.w);
+            max_xy[i] = max(max_xy[i], clip[i] / clip.w);
+        }
+    }
+
+    if (max_w < CLUSTER_NEAR || min_w > CLUSTER_FAR) {
+        return false;
+    }
+
+    // Corners behind the camera project anywhere, so the light can cover the whole screen
+    if (crosses_camera) {
+        min_xy[0] = -1;
+        min_xy[1] = -1;
+        max_xy[0] = 1;
+        max_xy[1] = 1;
+    }
+    if (max_xy[0] < -1 || min_xy[0] > 1 || max_xy[1] < -1 || min_xy[1] > 1) {
+        return false;
+    }
 
-        set_uniform_mat4(shader->light_space, light_space_acc, light_count);
-        glUniform2uiv(shader->shadow_map, light_count, (u32*) shadow_map_acc);
-        glUniform3fv(shader->spotlight_pos, light_count, (float*) pos_acc);
-        glUniform3fv(shader->spotlight_dir, light_count, (float*) dir_acc);
-        glUniform1fv(shader->spotlight_fov, light_count, (float*) fov_acc);
+    u32 tiles[2] = { CLUSTER_X, CLUSTER_Y };
+    for (u32 i = 0; i < 2; ++i) {
+        range->min[i] = cluster_tile(min_xy[i], tiles[i]);
+        range->max[i] = cluster_tile(max_xy[i], tiles[i]);
     }
+    range->min[2] = crosses_camera? 0 : cluster_slice(min_w);
+    range->max[2] = cluster_slice(max_w);
+    return true;
 }
 
-void draw_quads(CommandEntryDrawQuads* draw)
+// Keeps the lights that reach the screen. The SHADOW_MAP_COUNT closest to the camera come first and
+// get the shadow map layer of their index, the rest follow without one. Both keep the order they were pushed in.
+u32 select_lights(CommandBuffer* buffer, SpotLight* pushed, u32 pushed_count, 
+                  SpotLight* lights, ClusterRange* ranges, u32* shadow_count)
 {
-    begin_tmp(&opengl.render_arena);
-    i32* first = (i32*) push_size(&opengl.render_arena, sizeof(i32) * draw->quad_count);
-    i32* count = (i32*) push_size(&opengl.render_arena, sizeof(i32) * draw->quad_count);
+    ClusterRange* pushed_ranges = (ClusterRange*) push_size(&opengl.render_arena, sizeof(ClusterRange) * pushed_count);
+    float* distance = (float*) push_size(&opengl.render_arena, sizeof(float) * pushed_count);
+    bool* visible = (bool*) push_size(&opengl.render_arena, sizeof(bool) * pushed_count);
+    bool* shadowed = (bool*) push_size(&opengl.render_arena, sizeof(bool) * pushed_count);
+    u32 shadowed_count = 0;
+
+    for (u32 i = 0; i < pushed_count; ++i) {
+        visible[i] = light_cluster_range(buffer->proj, pushed + i, pushed_ranges + i);
+        shadowed[i] = visible[i];
+        shadowed_count += visible[i];
+
+        V3 d = v3(pushed[i].pos.x - buffer->camera_pos.x, pushed[i].pos.y - buffer->camera_pos.y, 
+                  pushed[i].pos.z - buffer->camera_pos.z);
+        distance[i] = d.x * d.x + d.y * d.y + d.z * d.z;
+    }
 
-    for (u32 i = 0; i < draw->quad_count; ++i) {
-        first[i] = draw->vert_offset + 4 * i;
-        count[i] = 4;
+    // Takes the shadow map away from the farthest until the rest fits
+    while (shadowed_count > SHADOW_MAP_COUNT) {
+        u32 farthest = 0;
+        for (u32 i = 0; i < pushed_count; ++i) {
+            if (shadowed[i] && (!shadowed[farthest] || distance[i] > distance[farthest])) {
+                farthest = i;
+            }
+        }
+        shadowed[farthest] = false;
+        --shadowed_count;
     }
 
-    glMultiDrawArrays(GL_TRIANGLE_STRIP, first, count, draw->quad_count);
-    end_tmp(&opengl.render_arena);
+    u32 light_count = 0;
+    for (u32 pass = 0; pass < 2; ++pass) {
+        for (u32 i = 0; i < pushed_count; ++i) {
+            if (visible[i] && shadowed[i] == !pass) {
+                lights[light_count] = pushed[i];
+                lights[light_count].shadow_map = pass? NO_SHADOW_MAP : light_count;
+                ranges[light_count] = pushed_ranges[i];
+                ++light_count;
+            }
+        }
+    }
+
+    *shadow_count = shadowed_count;
+    return light_count;
 }
 
-void do_shadowpass(CommandBuffer* buffer, SpotLight* light)
+// Bins the lights into the clusters, fragments then only loop over the lights of their own
+void build_light_clusters(u32 width, u32 height, ClusterRange* ranges, u32 light_count)
 {
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
+    u32 index_count = 0;
+    for (u32 light = 0; light < light_count; ++light) {
+        ClusterRange* range = ranges + light;
+        index_count += (range->max[0] - range->min[0] + 1) * (range->max[1] - range->min[1] + 1) *
+                       (range->max[2] - range->min[2] + 1);
+    }
 
-    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
-    glBindFramebuffer(GL_FRAMEBUFFER, opengl.shadow_maps[light->shadow_map].id);
-    glUseProgram(opengl.shadow_shader.id);
-    set_uniform_mat4(opengl.shadow_shader.light_space, &light->light_space, 1);
+    u32 size = sizeof(ClusterBuffer) + sizeof(u32) * index_count;
+    ClusterBuffer* block = (ClusterBuffer*) push_size(&opengl.render_arena, size);
+    u32* cluster_lights = (u32*) (block + 1);
+    block->scale[0] = (float) CLUSTER_X / width;
+    block->scale[1] = (float) CLUSTER_Y / height;
+    block->scale[2] = CLUSTER_Z / log(CLUSTER_FAR / CLUSTER_NEAR);
+    block->scale[3] = -log(CLUSTER_NEAR) * block->scale[2];
+
+    for (u32 i = 0; i < CLUSTER_COUNT; ++i) {
+        block->clusters[i][0] = 0;
+        block->clusters[i][1] = 0;
+    }
 
-    glClear(GL_DEPTH_BUFFER_BIT);
+    for (u32 light = 0; light < light_count; ++light) {
+        ClusterRange* range = ranges + light;
+        for (u32 z = range->min[2]; z <= range->max[2]; ++z) {
+            for (u32 y = range->min[1]; y <= range->max[1]; ++y) {
+                for (u32 x = range->min[0]; x <= range->max[0]; ++x) {
+                    ++block->clusters[x + CLUSTER_X * (y + CLUSTER_Y * z)][1];
+                }
+            }
+        }
+    }
 
-    glBindVertexArray(opengl.quad_vao);
+    u32 light_offset = 0;
+    for (u32 i = 0; i < CLUSTER_COUNT; ++i) {
+        block->clusters[i][0] = light_offset;
+        light_offset += block->clusters[i][1];
+        block->clusters[i][1] = 0;
+    }
+    assert(light_offset == index_count);
+
+    for (u32 light = 0; light < light_count; ++light) {
+        ClusterRange* range = ranges + light;
+        for (u32 z = range->min[2]; z <= range->max[2]; ++z) {
+            for (u32 y = range->min[1]; y <= range->max[1]; ++y) {
+                for (u32 x = range->min[0]; x <= range->max[0]; ++x) {
+                    u32* cluster = block->clusters[x + CLUSTER_X * (y + CLUSTER_Y * z)];
+                    cluster_lights[cluster[0] + cluster[1]] = light;
+                    ++cluster[1];
+                }
+            }
+        }
+    }
 
-    u32 offset = 0;
+    reserve_ssbo(opengl.cluster_buffer, &opengl.cluster_buffer_size, size);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, block);
+}
 
-    while (offset < buffer->entry_size) {
-        CommandEntryHeader* header = (CommandEntryHeader*) (buffer->entry_buffer + offset);
+void draw_quads(CommandEntryDrawQuads* draw)
+{
+    u32 base_vertex = opengl.stream_frame * opengl.stream_vert_cap + draw->vert_offset;
+    glDrawElementsBaseVertex(GL_TRIANGLES, 6 * draw->quad_count, GL_UNSIGNED_INT, (void*) 0, base_vertex);
+}
 
-        switch(header->type) {
-            case EntryType_Clear: {
-                offset += sizeof(CommandEntryClear);
-            } break;
+void draw_static_batch(StaticBatchHandle handle)
+{
+    StaticBatch* batch = opengl.static_batches + handle.id;
+    glDrawElements(GL_TRIANGLES, batch->index_count, GL_UNSIGNED_INT, (void*) 0);
+}
 
-            case EntryType_PushLight: {
-                offset += sizeof(CommandEntryPushLight);
-            } break;
+void draw_cubes(u32 offset, u32 count)
+{
+    glDrawElementsInstancedBaseInstance(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, (void*) 0, count, offset);
+}
 
-            case EntryType_DrawQuads: {
-                CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryDrawQuads);
+struct SortEntry
+{
+    u64 key;
+    u8* entry;
+};
+
+// Stable lsd radix sort on the key, one byte per pass. Bytes that are the same for every
+// entry are skipped, which is most of them in a usual frame.
+void sort_entries(SortEntry* entries, SortEntry* tmp, u32 count)
+{
+    SortEntry* src = entries;
+    SortEntry* dst = tmp;
 
-                if (draw->setup.flags & RENDER_SHADOW_CASTER) {
-                    draw_quads(draw);
+    for (u32 shift = 0; shift < 64; shift += 8) {
+        u32 counts[256] = {};
+        for (u32 i = 0; i < count; ++i) {
+            ++counts[(src[i].key >> shift) & 0xFF];
+        }
+        if (count == 0 || counts[(src[0].key >> shift) & 0xFF] == count) {
+            continue;
+        }
+
+        u32 sum = 0;
+        for (u32 i = 0; i < 256; ++i) {
+            u32 c = counts[i];
+            counts[i] = sum;
+            sum += c;
+        }
+        for (u32 i = 0; i < count; ++i) {
+            dst[counts[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+
+        SortEntry* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != entries) {
+        for (u32 i = 0; i < count; ++i) {
+            entries[i] = src[i];
+        }
+    }
+}
+
+// Inside of at least one of the frustums
+bool bounds_in_frustums(Frustum* frustums, u32 count, V3 bounds_min, V3 bounds_max)
+{
+    V3 center = v3((bounds_min.x + bounds_max.x) * 0.5, (bounds_min.y + bounds_max.y) * 0.5, 
+                   (bounds_min.z + bounds_max.z) * 0.5);
+    V3 radius = v3(bounds_max.x - center.x, bounds_max.y - center.y, bounds_max.z - center.z);
+    for (u32 i = 0; i < count; ++i) {
+        if (box_in_frustum(frustums + i, center, radius)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Draws the instances of offset..offset + count inside any of the frustums into every layer, 
+// one draw per run of visible ones. The rasterizer clips them per layer.
+void draw_visible_cubes(Frustum* frustums, u32 frustum_count, BoxBatch* bounds, u32 offset, u32 count)
+{
+    u32 end = offset + count;
+    u32 run_start = 0;
+    u32 run_count = 0;
+    u32 region = opengl.stream_frame * STREAM_CUBE_CAP;
+
+    for (u32 batch = offset / BOX_BATCH_WIDTH; batch * BOX_BATCH_WIDTH < end; ++batch) {
+        // Lanes outside of the entry may hold anything, they get skipped below
+        u32 inside = 0;
+        for (u32 i = 0; i < frustum_count; ++i) {
+            inside |= boxes_in_frustum(frustums + i, bounds + batch, BOX_BATCH_WIDTH);
+        }
+
+        for (u32 lane = 0; lane < BOX_BATCH_WIDTH; ++lane) {
+            u32 index = batch * BOX_BATCH_WIDTH + lane;
+            if (index < offset || index >= end || !(inside & (1 << lane))) {
+                continue;
+            }
+
+            if (run_count && run_start + run_count == index) {
+                ++run_count;
+            } else {
+                if (run_count) {
+                    draw_cubes(region + run_start, run_count * frustum_count);
                 }
-            } break;
+                run_start = index;
+                run_count = 1;
+            }
+        }
+    }
 
-            case EntryType_DrawModel: {
-                offset += sizeof(CommandEntryDrawModel);
-            } break;
+    if (run_count) {
+        draw_cubes(region + run_start, run_count * frustum_count);
+    }
+}
 
-            case EntryType_DrawRiggedModel: {
-                offset += sizeof(CommandEntryDrawRiggedModel);
-            } break;
+bool same_pos(V3 a, V3 b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// Draws the static shadow casters of the frame into the six faces of the light's cache cube
+void render_shadow_cache(CommandBuffer* buffer, ShadowCache* cache, u32 cube, SpotLight* light)
+{
+    V3 axes[6] = { v3(1, 0, 0), v3(-1, 0, 0), v3(0, 1, 0), v3(0, -1, 0), v3(0, 0, 1), v3(0, 0, -1) };
+    V3 ups[6] = { v3(0, -1, 0), v3(0, -1, 0), v3(0, 0, 1), v3(0, 0, -1), v3(0, -1, 0), v3(0, -1, 0) };
+
+    V3 pos = light->pos;
+    Mat4 proj = glm::perspective(glm::radians(90.0f), 1.0f, (float) SHADOW_NEAR_PLANE, light->far_plane);
+
+    glViewport(0, 0, SHADOW_CACHE_SIZE, SHADOW_CACHE_SIZE);
+    glBindFramebuffer(GL_FRAMEBUFFER, opengl.shadow_cache_framebuffer);
+    glUseProgram(opengl.shadow_cube_shader.id);
+    glUniform3fv(opengl.shadow_cube_shader.light_pos, 1, (float*) &pos);
+    glUniform1f(opengl.shadow_cube_shader.far_plane, light->far_plane);
+
+    for (u32 face = 0; face < 6; ++face) {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, opengl.shadow_cache_maps, 0, 
+                                  6 * cube + face);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        Mat4 view = glm::lookAt(glm::vec3(pos.x, pos.y, pos.z), 
+                                glm::vec3(pos.x + axes[face].x, pos.y + axes[face].y, pos.z + axes[face].z),
+                                glm::vec3(ups[face].x, ups[face].y, ups[face].z));
+        Mat4 face_space = proj * view;
+        Frustum face_frustum = frustum(face_space);
+        set_uniform_mat4(opengl.shadow_cube_shader.light_space, &face_space, 1);
+
+        for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+            u32 offset = 0;
+            while (offset < chunk->size) {
+                CommandEntryHeader* header = (CommandEntryHeader*) (chunk->data + offset);
+
+                switch(header->type) {
+                    case EntryType_Clear: {
+                        offset += sizeof(CommandEntryClear);
+                    } break;
+
+                    case EntryType_PushLight: {
+                        offset += sizeof(CommandEntryPushLight);
+                    } break;
+
+                    case EntryType_DrawQuads: {
+                        offset += sizeof(CommandEntryDrawQuads);
+                    } break;
+
+                    case EntryType_DrawCubes: {
+                        offset += sizeof(CommandEntryDrawCubes);
+                    } break;
+
+                    case EntryType_DrawStaticBatch: {
+                        CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) 
+                            (chunk->data + offset);
+                        offset += sizeof(CommandEntryDrawStaticBatch);
+
+                        StaticBatch* batch = opengl.static_batches + draw->batch.id;
+                        if ((draw->setup.flags & RENDER_SHADOW_CASTER) && 
+                            bounds_in_frustums(&face_frustum, 1, batch->bounds_min, batch->bounds_max)) {
+                            glBindVertexArray(batch->vao);
+                            draw_static_batch(draw->batch);
+                        }
+                    } break;
+
+                    case EntryType_DrawModel: {
+                        offset += sizeof(CommandEntryDrawModel);
+                    } break;
+
+                    case EntryType_DrawRiggedModel: {
+                        offset += sizeof(CommandEntryDrawRiggedModel);
+                    } break;
+                }
+            }
+        }
+    }
+
+    cache->valid = true;
+    cache->pos = pos;
+    cache->far_plane = light->far_plane;
+    cache->static_generation = opengl.static_generation;
+}
+
+// Cube of the light in the cache array. Lights keep theirs until SHADOW_CACHE_COUNT other lights
+// got a shadow map since they last had one.
+u32 find_shadow_cache(SpotLight* light)
+{
+    u32 result = 0;
+    for (u32 i = 0; i < SHADOW_CACHE_COUNT; ++i) {
+        ShadowCache* cache = opengl.shadow_caches + i;
+        if (cache->light == (i32) light->id) {
+            result = i;
+            break;
+        }
+        if (cache->used_frame < opengl.shadow_caches[result].used_frame) {
+            result = i;
+        }
+    }
+
+    ShadowCache* cache = opengl.shadow_caches + result;
+    if (cache->light != (i32) light->id) {
+        *cache = {};
+        cache->light = light->id;
+        // Gets its cube drawn right away, it only counts as moving once its position changes
+        cache->last_pos = light->pos;
+    }
+    cache->used_frame = opengl.shadow_frame;
+    return result;
+}
+
+void set_layers(Program* shader, u32* layers, u32 layer_count)
+{
+    glUniform1uiv(shader->layers, layer_count, layers);
+    glUniform1ui(shader->layer_count, layer_count);
+}
+
+// Every cube instance has to repeat once per layer
+void set_shadow_layer_count(u32 layer_count)
+{
+    if (opengl.shadow_cube_divisor != layer_count) {
+        glBindVertexArray(opengl.shadow_cube_vao);
+        glVertexAttribDivisor(1, layer_count);
+        glVertexAttribDivisor(2, layer_count);
+        opengl.shadow_cube_divisor = layer_count;
+    }
+}
+
+// Fills all shadow map layers in one layered pass. Layers with a valid cache get their static 
+// casters from it, the others draw them directly. Dynamic casters go into every layer on top.
+void do_shadowpass(CommandBuffer* buffer, SpotLight* lights, u32 light_count)
+{
+    u32 all_layers[SHADOW_MAP_COUNT];
+    u32 cache_cubes[SHADOW_MAP_COUNT];
+    u32 cached_layers[SHADOW_MAP_COUNT];
+    u32 cached_count = 0;
+    u32 direct_layers[SHADOW_MAP_COUNT];
+    u32 direct_count = 0;
+    // Casters outside every cone or past the far planes cannot show up in any map
+    Frustum cones[SHADOW_MAP_COUNT];
+    Frustum direct_cones[SHADOW_MAP_COUNT];
+    Mat4 inv_light_space[SHADOW_MAP_COUNT];
+
+    ++opengl.shadow_frame;
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    for (u32 i = 0; i < light_count; ++i) {
+        SpotLight* light = lights + i;
+        all_layers[i] = light->shadow_map;
+        cones[i] = frustum(light->light_space);
+        inv_light_space[i] = glm::inverse(light->light_space);
+
+        // Lights that are still moving draw their static casters directly, caching them would 
+        // cost six passes every frame
+        u32 cube = find_shadow_cache(light);
+        ShadowCache* cache = opengl.shadow_caches + cube;
+        cache_cubes[light->shadow_map] = cube;
+        bool moving = !same_pos(cache->last_pos, light->pos);
+        cache->last_pos = light->pos;
+        bool stale = !cache->valid || !same_pos(cache->pos, light->pos) || 
+                     cache->far_plane != light->far_plane || 
+                     cache->static_generation != opengl.static_generation;
+        if (stale && !moving) {
+            render_shadow_cache(buffer, cache, cube, light);
+            stale = false;
+        }
+
+        if (stale) {
+            direct_layers[direct_count] = light->shadow_map;
+            direct_cones[direct_count] = cones[i];
+            ++direct_count;
+        } else {
+            cached_layers[cached_count] = light->shadow_map;
+            ++cached_count;
+        }
+    }
+
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glBindFramebuffer(GL_FRAMEBUFFER, opengl.shadow_framebuffer);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    if (cached_count) {
+        Program* shader = &opengl.shadow_composite_shader;
+        glDepthFunc(GL_ALWAYS);
+        glUseProgram(shader->id);
+        set_layers(shader, cached_layers, cached_count);
+        glUniform1uiv(shader->cache_cubes, light_count, cache_cubes);
+        set_uniform_mat4(shader->inv_light_space, inv_light_space, light_count);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, opengl.shadow_cache_maps);
+        glBindVertexArray(opengl.post_vao);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, cached_count);
+        glDepthFunc(GL_LESS);
+    }
+
+    set_shadow_layer_count(light_count);
+    glUseProgram(opengl.shadow_cubes_shader.id);
+    set_layers(&opengl.shadow_cubes_shader, all_layers, light_count);
+
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            CommandEntryHeader* header = (CommandEntryHeader*) (chunk->data + offset);
+
+            switch(header->type) {
+                case EntryType_Clear: {
+                    offset += sizeof(CommandEntryClear);
+                } break;
+
+                case EntryType_PushLight: {
+                    offset += sizeof(CommandEntryPushLight);
+                } break;
+
+                case EntryType_DrawQuads: {
+                    CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) (chunk->data + offset);
+                    offset += sizeof(CommandEntryDrawQuads);
+
+                    if ((draw->setup.flags & RENDER_SHADOW_CASTER) && draw->quad_count &&
+                        bounds_in_frustums(cones, light_count, draw->bounds_min, draw->bounds_max)) {
+                        glUseProgram(opengl.shadow_shader.id);
+                        set_layers(&opengl.shadow_shader, all_layers, light_count);
+                        glBindVertexArray(opengl.quad_vao);
+                        u32 base_vertex = opengl.stream_frame * opengl.stream_vert_cap + draw->vert_offset;
+                        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, 6 * draw->quad_count, GL_UNSIGNED_INT, 
+                                                          (void*) 0, light_count, base_vertex);
+                    }
+                } break;
+
+                case EntryType_DrawCubes: {
+                    CommandEntryDrawCubes* draw = (CommandEntryDrawCubes*) (chunk->data + offset);
+                    offset += sizeof(CommandEntryDrawCubes);
+
+                    if (draw->setup.flags & RENDER_SHADOW_CASTER) {
+                        glUseProgram(opengl.shadow_cubes_shader.id);
+                        glBindVertexArray(opengl.shadow_cube_vao);
+                        draw_visible_cubes(cones, light_count, buffer->cube_bounds, draw->cube_offset, 
+                                           draw->cube_count);
+                    }
+                } break;
+
+                case EntryType_DrawStaticBatch: {
+                    CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) (chunk->data + offset);
+                    offset += sizeof(CommandEntryDrawStaticBatch);
+
+                    // Only the layers that did not get it from their cache
+                    StaticBatch* batch = opengl.static_batches + draw->batch.id;
+                    if (direct_count && (draw->setup.flags & RENDER_SHADOW_CASTER) && 
+                        bounds_in_frustums(direct_cones, direct_count, batch->bounds_min, batch->bounds_max)) {
+                        glUseProgram(opengl.shadow_shader.id);
+                        set_layers(&opengl.shadow_shader, direct_layers, direct_count);
+                        glBindVertexArray(batch->vao);
+                        glDrawElementsInstanced(GL_TRIANGLES, batch->index_count, GL_UNSIGNED_INT, (void*) 0, 
+                                                direct_count);
+                    }
+                } break;
+
+                case EntryType_DrawModel: {
+                    offset += sizeof(CommandEntryDrawModel);
+                } break;
+
+                case EntryType_DrawRiggedModel: {
+                    offset += sizeof(CommandEntryDrawRiggedModel);
+                } break;
+            }
         }
     }
 }
@@ -444,6 +1315,11 @@ void opengl_render_commands(CommandBuffer* buffer)
 {
     LogEntryInfo info = start_log(LogTarget_Backend);
 
+    // Spilled vertices have to end up behind the ones in the mapped region
+    if (buffer->first_verts->next) {
+        grow_vertex_stream(buffer->vert_count, buffer->first_verts);
+    }
+
     RenderSettings settings = buffer->settings;
     if (!equal_settings(&settings, &opengl.prev_settings)) {
         apply_settings(&settings);
@@ -457,62 +1333,162 @@ void opengl_render_commands(CommandBuffer* buffer)
     glBindFramebuffer(GL_FRAMEBUFFER, opengl.main_framebuffer.id);
     glBindVertexArray(opengl.quad_vao);
 
-    glBindBuffer(GL_ARRAY_BUFFER, opengl.vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * buffer->vert_count, 
-                 buffer->vert_buffer, GL_STREAM_DRAW);
 
-    u32 light_count = 0;
-    u32 shadow_map_count = 0;
-    SpotLight lights[MAX_SPOTLIGHTS];
+    begin_tmp(&opengl.render_arena);
+
+    u32 pushed_count = 0;
+    u32 pushed_cap = buffer->entry_size / sizeof(CommandEntryPushLight) + 1;
+    SpotLight* pushed = (SpotLight*) push_size(&opengl.render_arena, sizeof(SpotLight) * pushed_cap);
+
+    // Clears and lights go first, draws get collected for sorting
+    u32 draw_count = 0;
+    u32 draw_cap = buffer->entry_size / sizeof(CommandEntryHeader) + 1;
+    SortEntry* draws = (SortEntry*) push_size(&opengl.render_arena, sizeof(SortEntry) * draw_cap);
+    SortEntry* sort_tmp = (SortEntry*) push_size(&opengl.render_arena, sizeof(SortEntry) * draw_cap);
+
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            CommandEntryHeader* header = (CommandEntryHeader*) (chunk->data + offset);
+            u8* entry = chunk->data + offset;
+
+            switch (header->type) {
+                case EntryType_Clear: {
+                    CommandEntryClear* clear = (CommandEntryClear*) (chunk->data + offset);
+                    offset += sizeof(CommandEntryClear);
+                    glClearColor(clear->color.x, clear->color.y, clear->color.z, 1);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                } break;
+
+                case EntryType_DrawQuads: {
+                    offset += sizeof(CommandEntryDrawQuads);
+                } break;
+
+                case EntryType_DrawCubes: {
+                    offset += sizeof(CommandEntryDrawCubes);
+                } break;
+
+                case EntryType_DrawStaticBatch: {
+                    offset += sizeof(CommandEntryDrawStaticBatch);
+                } break;
+
+                case EntryType_DrawModel: {
+                    offset += sizeof(CommandEntryDrawModel);
+                } break;
+
+                case EntryType_DrawRiggedModel: {
+                    offset += sizeof(CommandEntryDrawRiggedModel);
+                } break;
+
+                case EntryType_PushLight: {
+                    CommandEntryPushLight* light = (CommandEntryPushLight*) (chunk->data + offset);
+                    offset += sizeof(CommandEntryPushLight);
+
+                    assert(pushed_count < pushed_cap);
+                    pushed[pushed_count].pos = light->pos;
+                    pushed[pushed_count].dir = light->dir;
+                    pushed[pushed_count].fov = light->fov;
+                    pushed[pushed_count].far_plane = light->far_plane;
+                    pushed[pushed_count].light_space = light->light_space;
+                    pushed[pushed_count].id = pushed_count;
+                    ++pushed_count;
+                } break;
+
+                default: {
+                    end_tmp(&opengl.render_arena);
+                    opengl.stream_fences[opengl.stream_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                    end_log(info);
+                    return;
+                }
+            }
+
+            if (header->type != EntryType_Clear && header->type != EntryType_PushLight) {
+                assert(draw_count < draw_cap);
+                draws[draw_count].key = header->sort_key;
+                draws[draw_count].entry = entry;
+                ++draw_count;
+            }
+        }
+    }
+
+    sort_entries(draws, sort_tmp, draw_count);
 
-    u32 offset = 0;
-    while (offset < buffer->entry_size) {
-        CommandEntryHeader* header = (CommandEntryHeader*) (buffer->entry_buffer + offset);
+    SpotLight* lights = (SpotLight*) push_size(&opengl.render_arena, sizeof(SpotLight) * pushed_count);
+    ClusterRange* ranges = (ClusterRange*) push_size(&opengl.render_arena, sizeof(ClusterRange) * pushed_count);
+    u32 shadow_count;
+    u32 light_count = select_lights(buffer, pushed, pushed_count, lights, ranges, &shadow_count);
+    upload_lights(lights, light_count);
+    build_light_clusters(settings.width, settings.height, ranges, light_count);
+
+    if (shadow_count) {
+        LogEntryInfo shadow_info = start_log(LogTarget_ShadowPass);
+        // The shadowed lights come first, so the pass only looks at those
+        do_shadowpass(buffer, lights, shadow_count);
+        end_log(shadow_info);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, opengl.main_framebuffer.id);
+        glViewport(0, 0, settings.width, settings.height);
+        glEnable(GL_CULL_FACE);
+    }
+    glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, opengl.shadow_maps);
+    glActiveTexture(GL_TEXTURE0);
+
+    LogEntryInfo main_info = start_log(LogTarget_MainPass);
+    RenderState state = render_state();
+    for (u32 draw_index = 0; draw_index < draw_count; ++draw_index) {
+        u8* entry = draws[draw_index].entry;
+        CommandEntryHeader* header = (CommandEntryHeader*) entry;
 
         switch (header->type) {
-            case EntryType_Clear: {
-                CommandEntryClear* clear = (CommandEntryClear*) (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryClear);
-                glClearColor(clear->color.x, clear->color.y, clear->color.z, 1);
-                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            case EntryType_DrawQuads: {
+                CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) entry;
+
+                prepare_render_setup(&state, &draw->setup, &opengl.quad_shader, buffer->proj, 
+                                     buffer->camera_pos);
+                bind_vao(&state, opengl.quad_vao);
+                draw_quads(draw);
             } break;
 
-            case EntryType_DrawQuads: {
-                CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryDrawQuads);
+            case EntryType_DrawCubes: {
+                CommandEntryDrawCubes* draw = (CommandEntryDrawCubes*) entry;
 
-                glBindVertexArray(opengl.quad_vao);
+                prepare_render_setup(&state, &draw->setup, &opengl.cube_shader, buffer->proj, 
+                                     buffer->camera_pos);
+                bind_vao(&state, opengl.cube_vao);
+                draw_cubes(opengl.stream_frame * STREAM_CUBE_CAP + draw->cube_offset, draw->cube_count);
+            } break;
 
-                prepare_render_setup(&draw->setup, &opengl.quad_shader, lights, light_count, 
-                                     buffer->proj, buffer->camera_pos);
+            case EntryType_DrawStaticBatch: {
+                CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) entry;
 
-                draw_quads(draw);
+                prepare_render_setup(&state, &draw->setup, &opengl.quad_shader, buffer->proj, 
+                                     buffer->camera_pos);
+                bind_vao(&state, opengl.static_batches[draw->batch.id].vao);
+                draw_static_batch(draw->batch);
             } break;
 
             case EntryType_DrawModel: {
-                CommandEntryDrawModel* draw = (CommandEntryDrawModel*) (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryDrawModel);
+                CommandEntryDrawModel* draw = (CommandEntryDrawModel*) entry;
 
                 Model* model = opengl.models + draw->model.id;
-                prepare_render_setup(&draw->setup, &opengl.model_shader, lights, light_count,
-                                     buffer->proj, buffer->camera_pos);
+                prepare_render_setup(&state, &draw->setup, &opengl.model_shader, buffer->proj, 
+                                     buffer->camera_pos);
                 set_uniform_mat4(opengl.model_shader.trans, &draw->trans, 1);
                 for (u32 i = 0; i < model->mesh_count; ++i) {
                     Mesh* mesh = opengl.meshes + model->mesh_offset + i;
-                    glBindVertexArray(mesh->vao);
+                    bind_vao(&state, mesh->vao);
                     glDrawElements(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_INT, (void*) 0);
                 }
 
             } break;
 
             case EntryType_DrawRiggedModel: {
-                CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) 
-                    (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryDrawRiggedModel);
+                CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) entry;
 
                 Model* model = opengl.models + draw->model.id;
-                prepare_render_setup(&draw->setup, &opengl.rigged_model_shader, lights, light_count,
-                                     buffer->proj, buffer->camera_pos);
+                prepare_render_setup(&state, &draw->setup, &opengl.rigged_model_shader, buffer->proj, 
+                                     buffer->camera_pos);
 
                 set_uniform_mat4(opengl.rigged_model_shader.trans, &draw->trans, 1);
                 set_uniform_mat4(opengl.rigged_model_shader.bone_trans, draw->bone_trans, 
@@ -520,41 +1496,20 @@ void opengl_render_commands(CommandBuffer* buffer)
 
                 for (u32 i = 0; i < model->mesh_count; ++i) {
                     Mesh* mesh = opengl.meshes + model->mesh_offset + i;
-                    glBindVertexArray(mesh->vao);
+                    bind_vao(&state, mesh->vao);
                     glDrawElements(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_INT, (void*) 0);
                 }
 
             } break;
-
-            case EntryType_PushLight: {
-                CommandEntryPushLight* light = (CommandEntryPushLight*) (buffer->entry_buffer + offset);
-                offset += sizeof(CommandEntryPushLight);
-
-                assert(light_count < MAX_SPOTLIGHTS);
-                lights[light_count].pos = light->pos;
-                lights[light_count].dir = light->dir;
-                lights[light_count].fov = light->fov;
-                lights[light_count].light_space = light->light_space;
-
-                assert(shadow_map_count < SHADOW_MAP_COUNT);
-                lights[light_count].shadow_map = shadow_map_count;
-                ++shadow_map_count;
-
-                do_shadowpass(buffer, lights + light_count);
-                ++light_count;
-
-                glBindFramebuffer(GL_FRAMEBUFFER, opengl.main_framebuffer.id);
-                glViewport(0, 0, settings.width, settings.height);
-                glEnable(GL_CULL_FACE);
-            } break;
-
-            default: {
-                end_log(info);
-                return;
-            }
         }
     }
 
+    end_tmp(&opengl.render_arena);
+    log_count(LogTarget_UniformCallsSaved, state.uniform_calls_saved);
+    end_log(main_info);
+
+    LogEntryInfo post_info = start_log(LogTarget_PostPass);
+
     glBindFramebuffer(GL_READ_FRAMEBUFFER, opengl.main_framebuffer.id);
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, opengl.post_framebuffer.id);
     glBlitFramebuffer(0, 0, settings.width, settings.height, 0, 0, settings.width, settings.height, 
@@ -571,6 +1526,9 @@ void opengl_render_commands(CommandBuffer* buffer)
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, opengl.post_framebuffer.color);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    end_log(post_info);
+
+    opengl.stream_fences[opengl.stream_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
     end_log(info);
 }
@@ -667,3 +1625,51 @@ void opengl_load_model(ModelLoadOp* load_op)
     opengl.model_count++;
 }
 
+
+void opengl_load_static_batch(StaticBatchLoadOp* load_op)
+{
+    StaticBatchHandle* handle = load_op->handle;
+    if (!handle->id) {
+        assert(opengl.static_batch_count < STATIC_BATCH_CAP);
+        handle->id = opengl.static_batch_count;
+        ++opengl.static_batch_count;
+
+        StaticBatch* batch = opengl.static_batches + handle->id;
+        glGenVertexArrays(1, &batch->vao);
+        glGenBuffers(1, &batch->vertex_buffer);
+        init_quad_vao(batch->vao, batch->vertex_buffer);
+    }
+
+    assert(load_op->vertex_count <= opengl.stream_vert_cap);
+    StaticBatch* batch = opengl.static_batches + handle->id;
+    batch->index_count = load_op->vertex_count / 4 * 6;
+    glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * load_op->vertex_count, load_op->vertices, GL_STATIC_DRAW);
+
+    ++opengl.static_generation;
+
+    batch->bounds_min = v3(0);
+    batch->bounds_max = v3(0);
+    for (u32 i = 0; i < load_op->vertex_count; ++i) {
+        V3 pos = load_op->vertices[i].pos;
+        if (i == 0) {
+            batch->bounds_min = pos;
+            batch->bounds_max = pos;
+        }
+        batch->bounds_min = v3(min(batch->bounds_min.x, pos.x), min(batch->bounds_min.y, pos.y), 
+                               min(batch->bounds_min.z, pos.z));
+        batch->bounds_max = v3(max(batch->bounds_max.x, pos.x), max(batch->bounds_max.y, pos.y), 
+                               max(batch->bounds_max.z, pos.z));
+    }
+}
+
+RenderBackend opengl_backend()
+{
+    RenderBackend backend;
+    backend.begin_frame = opengl_begin_frame;
+    backend.render_commands = opengl_render_commands;
+    backend.load_texture = opengl_load_texture;
+    backend.load_model = opengl_load_model;
+    backend.load_static_batch = opengl_load_static_batch;
+    return backend;
+}
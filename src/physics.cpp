@@ -18,6 +18,129 @@ void Collider::set_radius(int new_int_radius, float z){
 }
 
 
+i32 floor_div(i32 a, i32 b)
+{
+    i32 res = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) {
+        --res;
+    }
+    return res;
+}
+
+// Tile x covers the integer range [x * INT_TILE_SIZE - INT_TILE_SIZE / 2, x * INT_TILE_SIZE + INT_TILE_SIZE / 2).
+// Colliders are open intervals, so an entity touches the tiles of [pos - radius, pos + radius - 1].
+// Everything outside of the stage gets clamped to the border tiles.
+void grid_cell_range(V2int pos, V2int radius, Game* game, V2int* from, V2int* to)
+{
+    i32 half = INT_TILE_SIZE / 2;
+    from->x = floor_div(pos.x - radius.x + half, INT_TILE_SIZE);
+    from->y = floor_div(pos.y - radius.y + half, INT_TILE_SIZE);
+    to->x = floor_div(pos.x + radius.x - 1 + half, INT_TILE_SIZE);
+    to->y = floor_div(pos.y + radius.y - 1 + half, INT_TILE_SIZE);
+
+    from->x = int_clamp(from->x, 0, game->width - 1);
+    from->y = int_clamp(from->y, 0, game->height - 1);
+    to->x = int_clamp(to->x, 0, game->width - 1);
+    to->y = int_clamp(to->y, 0, game->height - 1);
+}
+
+void grid_insert(Entity* entity, Game* game)
+{
+    u16 id = entity - game->entities;
+    V2int from;
+    V2int to;
+    grid_cell_range(entity->int_pos, entity->collider.int_radius, game, &from, &to);
+
+    for (i32 y = from.y; y <= to.y; ++y) {
+        for (i32 x = from.x; x <= to.x; ++x) {
+            GridCell* cell = game->grid + y * game->width + x;
+            assert(cell->entity_count < GRID_CELL_CAP);
+            cell->entities[cell->entity_count] = id;
+            set_box(&cell->boxes, cell->entity_count, entity->pos, entity->collider.float_radius);
+            ++cell->entity_count;
+        }
+    }
+}
+
+void grid_remove(Entity* entity, Game* game)
+{
+    u16 id = entity - game->entities;
+    V2int from;
+    V2int to;
+    grid_cell_range(entity->int_pos, entity->collider.int_radius, game, &from, &to);
+
+    for (i32 y = from.y; y <= to.y; ++y) {
+        for (i32 x = from.x; x <= to.x; ++x) {
+            GridCell* cell = game->grid + y * game->width + x;
+            for (u32 i = 0; i < cell->entity_count; ++i) {
+                if (cell->entities[i] == id) {
+                    --cell->entity_count;
+                    u32 last = cell->entity_count;
+                    cell->entities[i] = cell->entities[last];
+
+                    BoxBatch* boxes = &cell->boxes;
+                    boxes->pos_x[i] = boxes->pos_x[last];
+                    boxes->pos_y[i] = boxes->pos_y[last];
+                    boxes->pos_z[i] = boxes->pos_z[last];
+                    boxes->radius_x[i] = boxes->radius_x[last];
+                    boxes->radius_y[i] = boxes->radius_y[last];
+                    boxes->radius_z[i] = boxes->radius_z[last];
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// NOTE: Every change of int_pos that outlives a collision query has to go through here
+void grid_move(Entity* entity, V2int new_pos, Game* game)
+{
+    grid_remove(entity, game);
+    entity->int_pos = new_pos;
+    entity->pos = v2int_to_v3float(entity->int_pos, entity->pos.z);
+    grid_insert(entity, game);
+}
+
+// Inserts id into the sorted result, unless it is already in there
+void insert_sorted(u16* result, u32* count, u16 id)
+{
+    u32 j = *count;
+    while (j > 0 && result[j - 1] > id) {
+        --j;
+    }
+    if (j > 0 && result[j - 1] == id) {
+        return;
+    }
+
+    assert(*count < GRID_QUERY_CAP);
+    for (u32 k = *count; k > j; --k) {
+        result[k] = result[k - 1];
+    }
+    result[j] = id;
+    ++(*count);
+}
+
+// Collects all entities registered in the tiles overlapped by the given box.
+// The result is sorted by entity id, so callers visit entities in the same order as a full scan would.
+u32 grid_query(V2int pos, V2int radius, u16* result, Game* game)
+{
+    V2int from;
+    V2int to;
+    grid_cell_range(pos, radius, game, &from, &to);
+
+    u32 count = 0;
+    for (i32 y = from.y; y <= to.y; ++y) {
+        for (i32 x = from.x; x <= to.x; ++x) {
+            GridCell* cell = game->grid + y * game->width + x;
+            for (u32 i = 0; i < cell->entity_count; ++i) {
+                insert_sorted(result, &count, cell->entities[i]);
+            }
+        }
+    }
+
+    return count;
+}
+
 int clamp_abs(int a, int b){
     if (b == 0){
         return 0;
@@ -55,18 +178,21 @@ void move_and_push_boxes(Entity* a, V2int dir, Game* game)
 
     a->int_pos = far_away;
 
+    u16 candidates[GRID_QUERY_CAP];
+    u32 candidate_count = grid_query(new_pos, a->collider.int_radius, candidates, game);
+
     Entity tmp = *a;
-    for (u32 i = 0; i < game->entity_count; ++i) {
+    for (u32 i = 0; i < candidate_count; ++i) {
         tmp.int_pos = new_pos;
-        Entity* b = game->entities + i;
+        Entity* b = game->entities + candidates[i];
         if (intersects(&tmp, b)) {
             tmp.int_pos = old_pos;
             do_collision_response(&tmp, b, dir, game);
         }
     }
 
-    a->int_pos = new_pos;
-    a->pos = v2int_to_v3float(a->int_pos, a->pos.z);
+    a->int_pos = old_pos;
+    grid_move(a, new_pos, game);
 }
 
 V2int distance_towards(Entity* a, Entity* b, V2int dir) 
@@ -112,9 +238,12 @@ V2int get_collided_movement(Entity* a, V2int dir, Game* game)
 
     V2int res = dir;
 
+    u16 candidates[GRID_QUERY_CAP];
+    u32 candidate_count = grid_query(new_pos, a->collider.int_radius, candidates, game);
+
     Entity tmp = *a;
-    for (u32 i = 0; i < game->entity_count; ++i) {
-        Entity* b = game->entities + i;
+    for (u32 i = 0; i < candidate_count; ++i) {
+        Entity* b = game->entities + candidates[i];
         tmp.int_pos = new_pos;
         if (intersects(&tmp, b)) {
             tmp.int_pos = old_pos;
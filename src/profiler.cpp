@@ -1,5 +1,6 @@
 #include "include/profiler.h"
 #include <stdio.h>
+#include <string.h>
 
 
 // NOTE: wall_time() returns current wall time in seconds
@@ -34,7 +35,7 @@ double wall_time()
 #endif
 
 double frame_start;
-LogEntry entries[LogTarget_Count];
+thread_local LogEntry entries[LogTarget_Count];
 
 void start_frame()
 {
@@ -51,6 +52,7 @@ void end_frame()
     // printf("Raycast took %f ms, was called: %u\n", entries[LogTarget_GameRaycast].total_duration * 1000, 
     //        entries[LogTarget_GameRaycast].count);
     // printf("Interpolate pose took %f ms\n", entries[LogTarget_InterpolatePose].total_duration * 1000);
+    // printf("Uniform calls saved: %u\n", entries[LogTarget_UniformCallsSaved].count);
 }
 
 LogEntryInfo start_log(LogTarget target)
@@ -67,3 +69,22 @@ void end_log(LogEntryInfo info)
     entries[info.target].count++;
     entries[info.target].total_duration += duration;
 }
+
+void log_count(LogTarget target, u32 count)
+{
+    entries[target].count += count;
+}
+
+void collect_log(FrameLog* log)
+{
+    memcpy(log->entries, entries, sizeof(LogEntry) * LogTarget_Count);
+    memset(entries, 0, sizeof(LogEntry) * LogTarget_Count);
+}
+
+void merge_log(FrameLog* log)
+{
+    for (u32 i = 0; i < LogTarget_Count; ++i) {
+        entries[i].count += log->entries[i].count;
+        entries[i].total_duration += log->entries[i].total_duration;
+    }
+}
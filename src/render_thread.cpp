@@ -0,0 +1,273 @@
+#include "include/render_thread.h"
+
+#include <string.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "include/opengl_renderer.h"
+#include "include/profiler.h"
+
+#define RENDER_JOB_CAP 8
+
+enum RenderJobType
+{
+    RenderJob_Frame,
+    RenderJob_LoadTexture,
+    RenderJob_LoadModel,
+    RenderJob_LoadStaticBatch,
+    RenderJob_Quit,
+};
+
+struct RenderJob
+{
+    u32 type;
+    u32 slot;
+    void* load_op;
+};
+
+struct RenderSlot
+{
+    // Where the main thread records to, copied into the backend's streams on the render thread
+    Vertex* verts;
+    u32 vert_cap;
+    CubeInstance* cubes;
+
+    CommandBuffer buffer;
+    // Replaces the first vertex chunk once the vertices are in the backend's stream
+    VertexChunk stream_verts;
+    bool queued;
+
+    // What the render thread logged for this frame and the loads before it, merged into the main
+    // thread's log once the slot comes back in begin_frame()
+    FrameLog log;
+};
+
+struct RenderThread
+{
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    GLFWwindow* window;
+    RenderBackend backend;
+    Arena arena;
+
+    RenderJob jobs[RENDER_JOB_CAP];
+    u32 job_start;
+    u32 job_count;
+    u32 loads_done;
+
+    RenderSlot slots[RENDER_SLOT_COUNT];
+    u32 slot;
+};
+
+RenderThread render_thread;
+
+void push_job(u32 type, u32 slot, void* load_op)
+{
+    std::unique_lock<std::mutex> lock(render_thread.mutex);
+    render_thread.done.wait(lock, [] { return render_thread.job_count < RENDER_JOB_CAP; });
+
+    RenderJob* job = render_thread.jobs + (render_thread.job_start + render_thread.job_count) % RENDER_JOB_CAP;
+    job->type = type;
+    job->slot = slot;
+    job->load_op = load_op;
+    ++render_thread.job_count;
+    render_thread.wake.notify_one();
+}
+
+void run_load(u32 type, void* load_op)
+{
+    u32 loads_done;
+    {
+        std::lock_guard<std::mutex> lock(render_thread.mutex);
+        loads_done = render_thread.loads_done;
+    }
+    push_job(type, 0, load_op);
+
+    std::unique_lock<std::mutex> lock(render_thread.mutex);
+    render_thread.done.wait(lock, [&] { return render_thread.loads_done != loads_done; });
+}
+
+void render_frame(RenderSlot* slot)
+{
+    CommandBuffer* buffer = &slot->buffer;
+    StreamRegion region = render_thread.backend.begin_frame(buffer->vert_count);
+
+    // begin_frame() grew the region to fit all of them, so the spilled chunks go away here
+    Vertex* dst = region.verts;
+    for (VertexChunk* chunk = buffer->first_verts; chunk; chunk = chunk->next) {
+        memcpy(dst, chunk->verts, sizeof(Vertex) * chunk->count);
+        dst += chunk->count;
+    }
+    slot->stream_verts.next = NULL;
+    slot->stream_verts.verts = region.verts;
+    slot->stream_verts.count = buffer->vert_count;
+    slot->stream_verts.cap = region.vert_cap;
+    buffer->first_verts = &slot->stream_verts;
+    buffer->verts = &slot->stream_verts;
+
+    assert(buffer->cube_count <= region.cube_cap);
+    memcpy(region.cubes, buffer->cube_buffer, sizeof(CubeInstance) * buffer->cube_count);
+    buffer->cube_buffer = region.cubes;
+
+    render_thread.backend.render_commands(buffer);
+    glfwSwapBuffers(render_thread.window);
+    collect_log(&slot->log);
+}
+
+void render_thread_main()
+{
+    glfwMakeContextCurrent(render_thread.window);
+
+    while (true) {
+        RenderJob job;
+        {
+            std::unique_lock<std::mutex> lock(render_thread.mutex);
+            render_thread.wake.wait(lock, [] { return render_thread.job_count > 0; });
+            job = render_thread.jobs[render_thread.job_start];
+        }
+
+        switch (job.type) {
+            case RenderJob_Frame: {
+                render_frame(render_thread.slots + job.slot);
+            } break;
+
+            case RenderJob_LoadTexture: {
+                render_thread.backend.load_texture((TextureLoadOp*) job.load_op);
+            } break;
+
+            case RenderJob_LoadModel: {
+                render_thread.backend.load_model((ModelLoadOp*) job.load_op);
+            } break;
+
+            case RenderJob_LoadStaticBatch: {
+                render_thread.backend.load_static_batch((StaticBatchLoadOp*) job.load_op);
+            } break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(render_thread.mutex);
+            render_thread.job_start = (render_thread.job_start + 1) % RENDER_JOB_CAP;
+            --render_thread.job_count;
+            if (job.type == RenderJob_Frame) {
+                render_thread.slots[job.slot].queued = false;
+            } else if (job.type != RenderJob_Quit) {
+                ++render_thread.loads_done;
+            }
+        }
+        render_thread.done.notify_all();
+
+        if (job.type == RenderJob_Quit) {
+            break;
+        }
+    }
+
+    glfwMakeContextCurrent(NULL);
+}
+
+StreamRegion threaded_begin_frame(u32 vert_hint)
+{
+    render_thread.slot = (render_thread.slot + 1) % RENDER_SLOT_COUNT;
+    RenderSlot* slot = render_thread.slots + render_thread.slot;
+    {
+        std::unique_lock<std::mutex> lock(render_thread.mutex);
+        render_thread.done.wait(lock, [&] { return !slot->queued; });
+    }
+    // Lands in the frame that is recorded now, the one it belongs to is two frames back
+    merge_log(&slot->log);
+    slot->log = {};
+
+    // Nothing reads the old region anymore, so it simply stays in the arena
+    if (vert_hint > slot->vert_cap) {
+        while (slot->vert_cap < vert_hint) {
+            slot->vert_cap *= 2;
+        }
+        slot->verts = (Vertex*) push_size(&render_thread.arena, sizeof(Vertex) * slot->vert_cap);
+    }
+
+    StreamRegion region;
+    region.verts = slot->verts;
+    region.vert_cap = slot->vert_cap;
+    region.cubes = slot->cubes;
+    region.cube_cap = STREAM_CUBE_CAP;
+    return region;
+}
+
+void threaded_render_commands(CommandBuffer* buffer)
+{
+    RenderSlot* slot = render_thread.slots + render_thread.slot;
+    slot->buffer = *buffer;
+    slot->queued = true;
+    push_job(RenderJob_Frame, render_thread.slot, NULL);
+}
+
+void threaded_load_texture(TextureLoadOp* load_op)
+{
+    run_load(RenderJob_LoadTexture, load_op);
+}
+
+void threaded_load_model(ModelLoadOp* load_op)
+{
+    run_load(RenderJob_LoadModel, load_op);
+}
+
+void threaded_load_static_batch(StaticBatchLoadOp* load_op)
+{
+    run_load(RenderJob_LoadStaticBatch, load_op);
+}
+
+RenderBackend start_render_thread(GLFWwindow* window, RenderBackend backend)
+{
+    render_thread.window = window;
+    render_thread.backend = backend;
+    render_thread.job_start = 0;
+    render_thread.job_count = 0;
+    render_thread.loads_done = 0;
+    render_thread.slot = 0;
+    init_arena(&render_thread.arena, &pool);
+
+    for (u32 i = 0; i < RENDER_SLOT_COUNT; ++i) {
+        RenderSlot* slot = render_thread.slots + i;
+        slot->vert_cap = STREAM_VERT_CAP;
+        slot->verts = (Vertex*) push_size(&render_thread.arena, sizeof(Vertex) * slot->vert_cap);
+        slot->cubes = (CubeInstance*) push_size(&render_thread.arena, sizeof(CubeInstance) * STREAM_CUBE_CAP);
+        slot->queued = false;
+        slot->log = {};
+    }
+
+    // A context can only be current on one thread
+    glfwMakeContextCurrent(NULL);
+    render_thread.thread = std::thread(render_thread_main);
+
+    RenderBackend result;
+    result.begin_frame = threaded_begin_frame;
+    result.render_commands = threaded_render_commands;
+    result.load_texture = threaded_load_texture;
+    result.load_model = threaded_load_model;
+    result.load_static_batch = threaded_load_static_batch;
+    return result;
+}
+
+void stop_render_thread()
+{
+    push_job(RenderJob_Quit, 0, NULL);
+    render_thread.thread.join();
+    glfwMakeContextCurrent(render_thread.window);
+
+    for (u32 i = 0; i < RENDER_SLOT_COUNT; ++i) {
+        merge_log(&render_thread.slots[i].log);
+        render_thread.slots[i].log = {};
+    }
+}
+
+u32 render_slot()
+{
+    return render_thread.slot;
+}
@@ -8,6 +8,7 @@
 #include "include/game_math.h"
 #include "include/util.h"
 #include "include/profiler.h"
+#include "include/workers.h"
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <assimp/Importer.hpp>
@@ -17,20 +18,48 @@
 #define MAX_MODEL_VERT 10000
 #define MAX_MODEL_INDEX 20000
 
+RenderBackend render_backend;
 
-CommandBuffer command_buffer(u32 entry_cap, u8* entry_buffer, u32 vert_cap, Vertex* vert_buffer, 
+CommandChunk* command_chunk(Arena* arena, u32 cap)
+{
+    CommandChunk* chunk = (CommandChunk*) push_size(arena, sizeof(CommandChunk));
+    chunk->next = NULL;
+    chunk->data = (u8*) push_size(arena, cap);
+    chunk->size = 0;
+    chunk->cap = cap;
+    return chunk;
+}
+
+VertexChunk* vertex_chunk(Arena* arena, Vertex* verts, u32 cap)
+{
+    VertexChunk* chunk = (VertexChunk*) push_size(arena, sizeof(VertexChunk));
+    chunk->next = NULL;
+    chunk->verts = verts;
+    chunk->count = 0;
+    chunk->cap = cap;
+    return chunk;
+}
+
+CommandBuffer command_buffer(Arena* arena, u32 entry_cap, u32 vert_cap, Vertex* vert_buffer, 
+                             u32 cube_cap, CubeInstance* cube_buffer, BoxBatch* cube_bounds,
                              u32 width, u32 height, TextureHandle white,
                              Mat4 proj, V3 camera_pos, V3 camera_up, V3 camera_right)
 {
     CommandBuffer commands;
-    commands.entry_buffer = entry_buffer;
-    commands.entry_cap = entry_cap;
+    commands.arena = arena;
+    commands.first_chunk = command_chunk(arena, max(entry_cap, (u32) COMMAND_CHUNK_SIZE));
+    commands.chunk = commands.first_chunk;
     commands.entry_size = 0;
 
-    commands.vert_buffer = vert_buffer;
-    commands.vert_cap = vert_cap;
+    commands.first_verts = vertex_chunk(arena, vert_buffer, vert_cap);
+    commands.verts = commands.first_verts;
     commands.vert_count = 0;
 
+    commands.cube_buffer = cube_buffer;
+    commands.cube_bounds = cube_bounds;
+    commands.cube_cap = cube_cap;
+    commands.cube_count = 0;
+
     commands.settings.width = width;
     commands.settings.height = height;
     commands.white = white;
@@ -44,43 +73,107 @@ CommandBuffer command_buffer(u32 entry_cap, u8* entry_buffer, u32 vert_cap, Vert
     return commands;
 }
 
+void update_peak(CommandBufferPeak* peak, CommandBuffer* commands)
+{
+    if (commands->first_chunk->next || commands->first_verts->next) {
+        printf("Command buffer grew to %u bytes and %u vertices\n", commands->entry_size, commands->vert_count);
+    }
+
+    peak->entry_size = max(peak->entry_size, commands->entry_size);
+    peak->vert_count = max(peak->vert_count, commands->vert_count);
+}
+
 RenderGroup render_group(CommandBuffer* commands, u32 flags)
 {
     RenderGroup group = {};
     group.commands = commands;
     group.current_draw = NULL;
+    group.current_cubes = NULL;
     group.setup.flags = flags;
     return group;
 }
 
 u8* push_entry(CommandBuffer* commands, u32 size)
 {
-    if (commands->entry_size + size > commands->entry_cap) {
-        printf("Command buffer size exceeded\n");
-        return NULL;
+    CommandChunk* chunk = commands->chunk;
+    if (chunk->size + size > chunk->cap) {
+        chunk->next = command_chunk(commands->arena, max(size, (u32) COMMAND_CHUNK_SIZE));
+        chunk = chunk->next;
+        commands->chunk = chunk;
     }
 
-    u8* entry = commands->entry_buffer + commands->entry_size;
+    u8* entry = chunk->data + chunk->size;
+    chunk->size += size;
     commands->entry_size += size;
     commands->active_group = NULL;
     return entry;
 }
 
+// A draw keeps appending to the same entry when this moves on to a new chunk
+Vertex* push_verts(CommandBuffer* commands, u32 count)
+{
+    VertexChunk* chunk = commands->verts;
+    if (chunk->count + count > chunk->cap) {
+        u32 cap = max(count, (u32) VERTEX_CHUNK_SIZE);
+        Vertex* verts = (Vertex*) push_size(commands->arena, sizeof(Vertex) * cap);
+        chunk->next = vertex_chunk(commands->arena, verts, cap);
+        chunk = chunk->next;
+        commands->verts = chunk;
+    }
+
+    Vertex* result = chunk->verts + chunk->count;
+    chunk->count += count;
+    commands->vert_count += count;
+    return result;
+}
+
+u64 sort_key(RenderSetup setup, u32 shader, u32 material, float depth)
+{
+    // The sort is stable, so overlays keep the order they were pushed in
+    if (!(setup.flags & RENDER_DEPTH_TEST)) {
+        return (u64) RenderPass_Overlay << 62;
+    }
+
+    u64 max_depth = (1 << SORT_DEPTH_BITS) - 1;
+    u64 quantized = clamp(depth / SORT_DEPTH_RANGE, 0, 1) * max_depth;
+    u64 state = ((u64) (shader & 0xF) << 22) | ((u64) (setup.flags & 0x3F) << 16) | (material & 0xFFFF);
+
+    // Back to front comes first, state changes only get saved between draws at the same depth
+    if (setup.flags & RENDER_TRANSPARENT) {
+        return ((u64) RenderPass_Transparent << 62) | ((max_depth - quantized) << 38) | (state << 12);
+    }
+
+    return ((u64) RenderPass_Opaque << 62) | (state << 36) | (quantized << 12);
+}
+
+u64 sort_key_state(u64 key)
+{
+    u64 pass = key >> 62;
+    if (pass == RenderPass_Transparent) {
+        return (pass << 26) | ((key >> 12) & 0x3FFFFFF);
+    }
+    return key >> 36;
+}
+
+float camera_distance(CommandBuffer* commands, V3 pos)
+{
+    V3 d = v3(pos.x - commands->camera_pos.x, pos.y - commands->camera_pos.y, pos.z - commands->camera_pos.z);
+    return sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+}
+
 void push_clear(CommandBuffer* commands, V3 color)
 {
     CommandEntryClear* clear = (CommandEntryClear*) push_entry(commands, sizeof(CommandEntryClear));
-    if (!clear) {
-        return;
-    }
 
     clear->header.type = EntryType_Clear;
     clear->color = color;
 }
 
-CommandEntryDrawQuads* get_current_draw(RenderGroup* group, u32 quad_count)
+CommandEntryDrawQuads* get_current_draw(RenderGroup* group)
 {
     CommandBuffer* commands = group->commands;
-    if (!group->current_draw || group->commands->active_group != group) {
+    if (!group->current_draw || commands->active_group != group || commands->active_type != EntryType_DrawQuads ||
+        (group->setup.flags & RENDER_TRANSPARENT)) {
         group->current_draw = (CommandEntryDrawQuads*) push_entry(commands, sizeof(CommandEntryDrawQuads));
 
         group->current_draw->header.type = EntryType_DrawQuads;
@@ -88,11 +181,10 @@ CommandEntryDrawQuads* get_current_draw(RenderGroup* group, u32 quad_count)
         group->current_draw->quad_count = 0;
         group->current_draw->setup = group->setup;
 
-        group->commands->active_group = group;
+        commands->active_group = group;
+        commands->active_type = EntryType_DrawQuads;
     }
 
-    assert(commands->vert_count + quad_count * 4 <= commands->vert_cap);
-
     return group->current_draw;
 }
 
@@ -107,91 +199,116 @@ void push_rect(RenderGroup* group,
     CommandEntryDrawQuads* draw = group->current_draw;
     assert(draw);
 
+    // Entries get sorted by their first quad
+    if (!draw->quad_count) {
+        draw->header.sort_key = sort_key(draw->setup, RenderShader_Quad, 0, camera_distance(commands, p1));
+        draw->bounds_min = p1;
+        draw->bounds_max = p1;
+    }
     ++draw->quad_count;
 
-    u32 vcurr = commands->vert_count;
-    commands->vert_buffer[vcurr + 0].pos = p1;
-    commands->vert_buffer[vcurr + 0].uv = uv1;
-    commands->vert_buffer[vcurr + 0].norm = norm;
-    commands->vert_buffer[vcurr + 0].color = color;
-    commands->vert_buffer[vcurr + 0].texture = texture.id;
-    commands->vert_buffer[vcurr + 1].pos = p2;
-    commands->vert_buffer[vcurr + 1].uv = uv2;
-    commands->vert_buffer[vcurr + 1].norm = norm;
-    commands->vert_buffer[vcurr + 1].color = color;
-    commands->vert_buffer[vcurr + 1].texture = texture.id;
-    commands->vert_buffer[vcurr + 2].pos = p3;
-    commands->vert_buffer[vcurr + 2].uv = uv3;
-    commands->vert_buffer[vcurr + 2].norm = norm;
-    commands->vert_buffer[vcurr + 2].color = color;
-    commands->vert_buffer[vcurr + 2].texture = texture.id;
-    commands->vert_buffer[vcurr + 3].pos = p4;
-    commands->vert_buffer[vcurr + 3].uv = uv4;
-    commands->vert_buffer[vcurr + 3].norm = norm;
-    commands->vert_buffer[vcurr + 3].color = color;
-    commands->vert_buffer[vcurr + 3].texture = texture.id;
-
-    commands->vert_count += 4;
+    V3 corners[3] = { p2, p3, p4 };
+    for (u32 i = 0; i < 3; ++i) {
+        draw->bounds_min = v3(min(draw->bounds_min.x, corners[i].x), min(draw->bounds_min.y, corners[i].y), 
+                              min(draw->bounds_min.z, corners[i].z));
+        draw->bounds_max = v3(max(draw->bounds_max.x, corners[i].x), max(draw->bounds_max.y, corners[i].y), 
+                              max(draw->bounds_max.z, corners[i].z));
+    }
+
+    Vertex* verts = push_verts(commands, 4);
+    verts[0].pos = p1;
+    verts[0].uv = uv1;
+    verts[0].norm = norm;
+    verts[0].color = color;
+    verts[0].texture = texture.id;
+    verts[1].pos = p2;
+    verts[1].uv = uv2;
+    verts[1].norm = norm;
+    verts[1].color = color;
+    verts[1].texture = texture.id;
+    verts[2].pos = p3;
+    verts[2].uv = uv3;
+    verts[2].norm = norm;
+    verts[2].color = color;
+    verts[2].texture = texture.id;
+    verts[3].pos = p4;
+    verts[3].uv = uv4;
+    verts[3].norm = norm;
+    verts[3].color = color;
+    verts[3].texture = texture.id;
 }
 
-void push_cube(RenderGroup* group, V3 pos, V3 radius, TextureHandle texture, V3 color)
+CommandEntryDrawCubes* get_current_cubes(RenderGroup* group)
 {
-    CommandEntryDrawQuads* entry = get_current_draw(group, 6);
-    if (!entry) {
-        return;
+    CommandBuffer* commands = group->commands;
+    if (!group->current_cubes || commands->active_group != group || commands->active_type != EntryType_DrawCubes ||
+        (group->setup.flags & RENDER_TRANSPARENT)) {
+        group->current_cubes = (CommandEntryDrawCubes*) push_entry(commands, sizeof(CommandEntryDrawCubes));
+
+        group->current_cubes->header.type = EntryType_DrawCubes;
+        group->current_cubes->cube_offset = commands->cube_count;
+        group->current_cubes->cube_count = 0;
+        group->current_cubes->setup = group->setup;
+
+        commands->active_group = group;
+        commands->active_type = EntryType_DrawCubes;
     }
 
-    V3 p1 = v3(pos.x - radius.x, pos.y - radius.y, pos.z + radius.z);
-    V3 p2 = v3(pos.x - radius.x, pos.y + radius.y, pos.z + radius.z);
-    V3 p3 = v3(pos.x + radius.x, pos.y + radius.y, pos.z + radius.z);
-    V3 p4 = v3(pos.x + radius.x, pos.y - radius.y, pos.z + radius.z);
-    V3 p5 = v3(pos.x - radius.x, pos.y - radius.y, pos.z - radius.z);
-    V3 p6 = v3(pos.x - radius.x, pos.y + radius.y, pos.z - radius.z);
-    V3 p7 = v3(pos.x + radius.x, pos.y + radius.y, pos.z - radius.z);
-    V3 p8 = v3(pos.x + radius.x, pos.y - radius.y, pos.z - radius.z);
+    assert(commands->cube_count < commands->cube_cap);
 
-    push_rect(group, 
-              p1, v2(0, 0),
-              p2, v2(0, 1),
-              p4, v2(1, 0),
-              p3, v2(1, 1),
-              v3(0, 0, 1), texture, color);
+    return group->current_cubes;
+}
 
-    push_rect(group, 
-              p8, v2(0, 0),
-              p7, v2(0, 1),
-              p5, v2(1, 0),
-              p6, v2(1, 1),
-              v3(0, 0, -1), texture, color);
+void set_cube(CommandBuffer* commands, u32 index, V3 pos, V3 radius, TextureHandle texture, V3 color)
+{
+    CubeInstance* cube = commands->cube_buffer + index;
+    cube->pos = pos;
+    cube->radius = radius;
+    cube->color = color;
+    cube->texture = texture.id;
+    set_box(commands->cube_bounds + index / BOX_BATCH_WIDTH, index % BOX_BATCH_WIDTH, pos, radius);
+}
 
-    push_rect(group, 
-              p8, v2(0, 0),
-              p4, v2(0, 1),
-              p7, v2(1, 0),
-              p3, v2(1, 1),
-              v3(1, 0, 0), texture, color);
+void push_cube(RenderGroup* group, V3 pos, V3 radius, TextureHandle texture, V3 color)
+{
+    CommandEntryDrawCubes* entry = get_current_cubes(group);
 
-    push_rect(group, 
-              p6, v2(0, 0),
-              p2, v2(0, 1),
-              p5, v2(1, 0),
-              p1, v2(1, 1),
-              v3(-1, 0, 0), texture, color);
+    if (!entry->cube_count) {
+        entry->header.sort_key = sort_key(entry->setup, RenderShader_Cube, 0, camera_distance(group->commands, pos));
+    }
 
-    push_rect(group, 
-              p7, v2(0, 0),
-              p3, v2(0, 1),
-              p6, v2(1, 0),
-              p2, v2(1, 1),
-              v3(0, 1, 0), texture, color);
+    set_cube(group->commands, group->commands->cube_count, pos, radius, texture, color);
 
-    push_rect(group, 
-              p5, v2(0, 0),
-              p1, v2(0, 1),
-              p8, v2(1, 0),
-              p4, v2(1, 1),
-              v3(0, -1, 0), texture, color);
+    ++group->commands->cube_count;
+    ++entry->cube_count;
+}
 
+u32 reserve_cubes(RenderGroup* group, u32 count, V3 sort_pos)
+{
+    CommandEntryDrawCubes* entry = get_current_cubes(group);
+    CommandBuffer* commands = group->commands;
+    assert(commands->cube_count + count <= commands->cube_cap);
+
+    if (!entry->cube_count) {
+        entry->header.sort_key = sort_key(entry->setup, RenderShader_Cube, 0, camera_distance(commands, sort_pos));
+    }
+
+    u32 first = commands->cube_count;
+    commands->cube_count += count;
+    entry->cube_count += count;
+    return first;
+}
+
+void push_static_batch(RenderGroup* group, StaticBatchHandle handle)
+{
+    CommandBuffer* commands = group->commands;
+    CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) 
+        push_entry(commands, sizeof(CommandEntryDrawStaticBatch));
+
+    draw->header.type = EntryType_DrawStaticBatch;
+    draw->header.sort_key = sort_key(group->setup, RenderShader_Quad, 0, 0);
+    draw->batch = handle;
+    draw->setup = group->setup;
 }
 
 void push_model(RenderGroup* group, ModelHandle handle, V3 pos, V3 scale)
@@ -200,6 +317,7 @@ void push_model(RenderGroup* group, ModelHandle handle, V3 pos, V3 scale)
     CommandEntryDrawModel* draw = (CommandEntryDrawModel*) push_entry(commands, sizeof(CommandEntryDrawModel));
 
     draw->header.type = EntryType_DrawModel;
+    draw->header.sort_key = sort_key(group->setup, RenderShader_Model, handle.id, camera_distance(commands, pos));
     draw->model = handle;
     draw->setup = group->setup;
     draw->trans = mat4(pos, scale);
@@ -212,6 +330,8 @@ void push_rigged_model(RenderGroup* group, RiggedModelHandle* handle, Mat4* pose
         push_entry(commands, sizeof(CommandEntryDrawRiggedModel));
 
     draw->header.type = EntryType_DrawRiggedModel;
+    draw->header.sort_key = sort_key(group->setup, RenderShader_RiggedModel, handle->model.id, 
+                                     camera_distance(commands, pos));
     draw->model = handle->model;
     draw->setup = group->setup;
     draw->trans = mat4(pos, scale);
@@ -223,10 +343,7 @@ void push_rigged_model(RenderGroup* group, RiggedModelHandle* handle, Mat4* pose
 void push_debug_pose(RenderGroup* group, Skeleton* sk, Mat4* pose, V3 pos, V3 scale)
 {
 #ifdef DEBUG
-    CommandEntryDrawQuads* entry = get_current_draw(group, sk->bone_count + 1);
-    if (!entry) {
-        return;
-    }
+    get_current_draw(group);
 
     float size = 0.025;
 
@@ -274,7 +391,7 @@ void push_debug_pose(RenderGroup* group, Skeleton* sk, Mat4* pose, V3 pos, V3 sc
 
 void push_line(RenderGroup* group, V3 start, V3 end, V3 color)
 {
-    CommandEntryDrawQuads* entry = get_current_draw(group, 1);
+    get_current_draw(group);
 
     V3 up = cross(group->commands->camera_up, group->commands->camera_right);
     float width = 0.025;
@@ -302,6 +419,7 @@ void push_spotlight(CommandBuffer* commands, V3 pos, V3 dir, float fov, float fa
     light->pos = pos;
     light->dir = dir;
     light->fov = fov;
+    light->far_plane = far_plane;
 
     float near_plane = 0.25;
     //float far_plane = 20;
@@ -483,7 +601,8 @@ u32 count_nodes(aiNode* node)
     return count;
 }
 
-void process_skeleton_node(aiNode* node, Animation* anim, Arena* assets, u32 index, u32* node_count)
+void process_skeleton_node(aiNode* node, Animation* anim, Skeleton* skeleton, Arena* assets, u32 index, 
+                           u32* node_count)
 {
     AnimationNode entry;
     entry.name = from_c_str(node->mName.C_Str(), assets);
@@ -499,15 +618,23 @@ void process_skeleton_node(aiNode* node, Animation* anim, Arena* assets, u32 ind
         }
     }
 
+    entry.skeleton_bone = -1;
+    for (u32 i = 0; i < skeleton->bone_count; ++i) {
+        if (str_equals(entry.name, skeleton->bone[i].name)) {
+            entry.skeleton_bone = i;
+            break;
+        }
+    }
+
     anim->node[index] = entry;
     (*node_count) += node->mNumChildren;
 
     for (u32 i = 0; i < node->mNumChildren; ++i) {
-        process_skeleton_node(node->mChildren[i], anim, assets, entry.first_child + i, node_count);
+        process_skeleton_node(node->mChildren[i], anim, skeleton, assets, entry.first_child + i, node_count);
     }
 }
 
-Animation load_animation(const char* path, Arena* assets)
+Animation load_animation(const char* path, Skeleton* skeleton, Arena* assets)
 {
     Assimp::Importer importer;
     const aiScene* scene = importer.ReadFile(path, 0); 
@@ -582,7 +709,7 @@ Animation load_animation(const char* path, Arena* assets)
     anim.node_count = count_nodes(scene->mRootNode);
     anim.node = (AnimationNode*) push_size(assets, sizeof(AnimationNode) * anim.node_count);
     u32 count = 1;
-    process_skeleton_node(scene->mRootNode, &anim, assets, 0, &count);
+    process_skeleton_node(scene->mRootNode, &anim, skeleton, assets, 0, &count);
 
     return anim;
 }
@@ -598,7 +725,8 @@ Mat4* default_pose(Skeleton* skeleton, Arena* arena)
     return res;
 }
 
-void do_node_trans(Animation* anim, Skeleton* sk, u32 id, Mat4 parent, Mat4* final, float time)
+// Transform of the node relative to its parent at time
+Mat4 sample_node(Animation* anim, u32 id, float time)
 {
     AnimationNode* node = anim->node + id;
     Mat4 trans = node->trans;
@@ -742,18 +870,45 @@ void do_node_trans(Animation* anim, Skeleton* sk, u32 id, Mat4 parent, Mat4* fin
         trans = trans_pos * trans_rot * trans_scale;
     }
 
-    Mat4 global_trans = parent * trans;
+    return trans;
+}
 
-    for (u32 i = 0; i < sk->bone_count; ++i) {
-        BoneInfo* info = sk->bone + i;
-        if (str_equals(node->name, info->name)) {
-            final[i] = /* sk->inverse_trans * */ global_trans * info->offset;
-            break;
-        }
+#define POSE_JOB_SIZE 16
+
+struct PoseJob
+{
+    Animation* anim;
+    Skeleton* sk;
+    float time;
+
+    // Per node
+    Mat4* local;
+};
+
+// Key lookup doesn't depend on the parents, each job samples POSE_JOB_SIZE nodes
+void sample_pose_nodes(void* data, u32 index)
+{
+    PoseJob* job = (PoseJob*) data;
+    u32 start = index * POSE_JOB_SIZE;
+    u32 end = min(start + POSE_JOB_SIZE, job->anim->node_count);
+
+    for (u32 id = start; id < end; ++id) {
+        job->local[id] = sample_node(job->anim, id, job->time);
+    }
+}
+
+void do_node_trans(PoseJob* job, u32 id, Mat4 parent, Mat4* final)
+{
+    AnimationNode* node = job->anim->node + id;
+    Mat4 global_trans = parent * job->local[id];
+
+    i32 bone = node->skeleton_bone;
+    if (bone >= 0) {
+        final[bone] = /* sk->inverse_trans * */ global_trans * job->sk->bone[bone].offset;
     }
 
     for (u32 i = 0; i < node->child_count; ++i) {
-        do_node_trans(anim, sk, node->first_child + i, global_trans, final, time);
+        do_node_trans(job, node->first_child + i, global_trans, final);
     }
 }
 
@@ -761,8 +916,15 @@ Mat4* interpolate_pose(Animation* animation, Skeleton* skeleton, Arena* arena, f
 {
     LogEntryInfo info = start_log(LogTarget_InterpolatePose);
 
+    PoseJob job;
+    job.anim = animation;
+    job.sk = skeleton;
+    job.time = t;
+    job.local = (Mat4*) push_size(arena, sizeof(Mat4) * animation->node_count);
+    run_parallel((animation->node_count + POSE_JOB_SIZE - 1) / POSE_JOB_SIZE, sample_pose_nodes, &job);
+
     Mat4* res = (Mat4*) push_size(arena, sizeof(Mat4) * skeleton->bone_count);
-    do_node_trans(animation, skeleton, 0, glm::mat4(1), res, t);
+    do_node_trans(&job, 0, glm::mat4(1), res);
 
     end_log(info);
 
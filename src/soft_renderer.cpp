@@ -0,0 +1,1103 @@
+#include "include/soft_renderer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "include/opengl_renderer.h"
+#include "include/game_math.h"
+#include "include/profiler.h"
+#include "include/workers.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SOFT_RASTER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFT_RASTER_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define SOFT_SHADOW_BIAS 0.002f
+
+SoftContext soft;
+
+// Textures are srgb, lighting happens in linear space like with GL_SRGB_ALPHA
+float srgb_to_linear[256];
+
+// Same faces, uvs and winding as the cube mesh of the opengl backend
+float soft_cube_verts[] = {
+    // pos         uv      norm
+    -1, -1,  1,    0, 0,   0,  0,  1,
+    -1,  1,  1,    0, 1,   0,  0,  1,
+     1, -1,  1,    1, 0,   0,  0,  1,
+     1,  1,  1,    1, 1,   0,  0,  1,
+
+     1, -1, -1,    0, 0,   0,  0, -1,
+     1,  1, -1,    0, 1,   0,  0, -1,
+    -1, -1, -1,    1, 0,   0,  0, -1,
+    -1,  1, -1,    1, 1,   0,  0, -1,
+
+     1, -1, -1,    0, 0,   1,  0,  0,
+     1, -1,  1,    0, 1,   1,  0,  0,
+     1,  1, -1,    1, 0,   1,  0,  0,
+     1,  1,  1,    1, 1,   1,  0,  0,
+
+    -1,  1, -1,    0, 0,  -1,  0,  0,
+    -1,  1,  1,    0, 1,  -1,  0,  0,
+    -1, -1, -1,    1, 0,  -1,  0,  0,
+    -1, -1,  1,    1, 1,  -1,  0,  0,
+
+     1,  1, -1,    0, 0,   0,  1,  0,
+     1,  1,  1,    0, 1,   0,  1,  0,
+    -1,  1, -1,    1, 0,   0,  1,  0,
+    -1,  1,  1,    1, 1,   0,  1,  0,
+
+    -1, -1, -1,    0, 0,   0, -1,  0,
+    -1, -1,  1,    0, 1,   0, -1,  0,
+     1, -1, -1,    1, 0,   0, -1,  0,
+     1, -1,  1,    1, 1,   0, -1,  0,
+};
+
+// Two triangles per quad of 4 strip ordered vertices
+u32 soft_quad_face[6] = { 0, 1, 2, 2, 1, 3 };
+
+void soft_init()
+{
+    soft = {};
+    init_arena(&soft.arena, &pool);
+    init_arena(&soft.frame_arena, &pool);
+
+    soft.vert_cap = STREAM_VERT_CAP;
+    soft.verts = (Vertex*) push_size(&soft.arena, sizeof(Vertex) * soft.vert_cap);
+    soft.cubes = (CubeInstance*) push_size(&soft.arena, sizeof(CubeInstance) * STREAM_CUBE_CAP);
+    soft.static_batch_count = 1;
+
+    for (u32 i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        srgb_to_linear[i] = c <= 0.04045f? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+StreamRegion soft_begin_frame(u32 vert_hint)
+{
+    // Nothing reads the old region anymore, so it simply stays in the arena
+    if (vert_hint > soft.vert_cap) {
+        while (soft.vert_cap < vert_hint) {
+            soft.vert_cap *= 2;
+        }
+        soft.verts = (Vertex*) push_size(&soft.arena, sizeof(Vertex) * soft.vert_cap);
+    }
+
+    StreamRegion region;
+    region.verts = soft.verts;
+    region.vert_cap = soft.vert_cap;
+    region.cubes = soft.cubes;
+    region.cube_cap = STREAM_CUBE_CAP;
+    return region;
+}
+
+void resize_framebuffer(u32 width, u32 height)
+{
+    soft.width = width;
+    soft.height = height;
+    soft.color = (V3*) push_size(&soft.arena, sizeof(V3) * width * height);
+    soft.depth = (float*) push_size(&soft.arena, sizeof(float) * width * height);
+    soft.pixels = (u32*) push_size(&soft.arena, sizeof(u32) * width * height);
+    for (u32 i = 0; i < width * height; ++i) {
+        soft.color[i] = v3(0);
+        soft.depth[i] = 1;
+        soft.pixels[i] = 0xFF000000;
+    }
+}
+
+SoftVertex soft_vertex(Mat4* proj, V3 pos, V2 uv, V3 norm, V3 color)
+{
+    SoftVertex v;
+    v.clip = *proj * glm::vec4(pos.x, pos.y, pos.z, 1);
+    v.world_pos = pos;
+    v.uv = uv;
+    v.norm = norm;
+    v.color = color;
+    return v;
+}
+
+SoftVertex lerp_vertex(SoftVertex* a, SoftVertex* b, float t)
+{
+    SoftVertex v;
+    v.clip = a->clip + (b->clip - a->clip) * t;
+    v.world_pos = lerp(a->world_pos, b->world_pos, t);
+    v.uv = v2(a->uv.x + (b->uv.x - a->uv.x) * t, a->uv.y + (b->uv.y - a->uv.y) * t);
+    v.norm = lerp(a->norm, b->norm, t);
+    v.color = lerp(a->color, b->color, t);
+    return v;
+}
+
+// Cuts the triangle at the near plane, returns how many vertices of the polygon are left (0, 3 or 4)
+u32 clip_near(SoftVertex* in, SoftVertex* out)
+{
+    float dist[3];
+    u32 inside = 0;
+    for (u32 i = 0; i < 3; ++i) {
+        dist[i] = in[i].clip.z + in[i].clip.w;
+        inside += dist[i] >= 0;
+    }
+
+    if (inside == 0) {
+        return 0;
+    }
+    if (inside == 3) {
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+        return 3;
+    }
+
+    u32 count = 0;
+    for (u32 i = 0; i < 3; ++i) {
+        u32 j = (i + 1) % 3;
+        if (dist[i] >= 0) {
+            out[count++] = in[i];
+        }
+        if ((dist[i] >= 0) != (dist[j] >= 0)) {
+            out[count++] = lerp_vertex(in + i, in + j, dist[i] / (dist[i] - dist[j]));
+        }
+    }
+    return count;
+}
+
+// Returns false for triangles without any pixel center inside the target or culled as back faces
+bool setup_triangle(SoftTriangle* tri, SoftVertex* v0, SoftVertex* v1, SoftVertex* v2,
+                    u32 width, u32 height, bool culling)
+{
+    SoftVertex* v[3] = { v0, v1, v2 };
+    for (u32 i = 0; i < 3; ++i) {
+        float inv_w = 1 / v[i]->clip.w;
+        tri->x[i] = (v[i]->clip.x * inv_w * 0.5f + 0.5f) * width;
+        tri->y[i] = (v[i]->clip.y * inv_w * 0.5f + 0.5f) * height;
+        tri->z[i] = v[i]->clip.z * inv_w * 0.5f + 0.5f;
+        tri->inv_w[i] = inv_w;
+    }
+
+    // Front faces wind clockwise, same as glFrontFace(GL_CW)
+    float area = (tri->x[1] - tri->x[0]) * (tri->y[2] - tri->y[0]) -
+                 (tri->x[2] - tri->x[0]) * (tri->y[1] - tri->y[0]);
+    if (area == 0 || (culling && area > 0)) {
+        return false;
+    }
+
+    // Pixels whose center lies within the bounds
+    float min_x = min(min(tri->x[0], tri->x[1]), tri->x[2]);
+    float min_y = min(min(tri->y[0], tri->y[1]), tri->y[2]);
+    float max_x = max(max(tri->x[0], tri->x[1]), tri->x[2]);
+    float max_y = max(max(tri->y[0], tri->y[1]), tri->y[2]);
+    tri->min_x = (i32) max(ceil(min_x - 0.5f), 0.0f);
+    tri->min_y = (i32) max(ceil(min_y - 0.5f), 0.0f);
+    tri->max_x = (i32) min(floor(max_x - 0.5f), (float) width - 1);
+    tri->max_y = (i32) min(floor(max_y - 0.5f), (float) height - 1);
+    if (tri->min_x > tri->max_x || tri->min_y > tri->max_y) {
+        return false;
+    }
+
+    float sign = area > 0? 1 : -1;
+    tri->own_edge = 0;
+    for (u32 i = 0; i < 3; ++i) {
+        u32 j = (i + 1) % 3;
+        u32 k = (i + 2) % 3;
+        tri->a[i] = (tri->y[j] - tri->y[k]) * sign;
+        tri->b[i] = (tri->x[k] - tri->x[j]) * sign;
+        tri->c[i] = -(tri->a[i] * tri->x[j] + tri->b[i] * tri->y[j]);
+        // The neighbour sees the same edge with a and b negated, so exactly one of them owns it
+        if (tri->a[i] > 0 || (tri->a[i] == 0 && tri->b[i] > 0)) {
+            tri->own_edge |= 1 << i;
+        }
+    }
+    tri->inv_area = 1 / fabs(area);
+
+    tri->v[0] = *v0;
+    tri->v[1] = *v1;
+    tri->v[2] = *v2;
+    return true;
+}
+
+// Bitmask of which of the SOFT_LANES pixel centers starting at x, y are inside the triangle
+#if defined(SOFT_RASTER_AVX2)
+
+u32 cover_pixels(SoftTriangle* tri, float x, float y)
+{
+    __m256 xs = _mm256_add_ps(_mm256_set1_ps(x), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    for (u32 i = 0; i < 3; ++i) {
+        __m256 e = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri->a[i]), xs),
+                                 _mm256_set1_ps(tri->b[i] * y + tri->c[i]));
+        __m256 ok = (tri->own_edge & (1 << i))? _mm256_cmp_ps(e, zero, _CMP_GE_OQ) :
+                                                 _mm256_cmp_ps(e, zero, _CMP_GT_OQ);
+        inside = _mm256_and_ps(inside, ok);
+    }
+
+    return _mm256_movemask_ps(inside);
+}
+
+#elif defined(SOFT_RASTER_SSE2)
+
+u32 cover_pixels(SoftTriangle* tri, float x, float y)
+{
+    __m128 xs = _mm_add_ps(_mm_set1_ps(x), _mm_setr_ps(0, 1, 2, 3));
+    __m128 zero = _mm_setzero_ps();
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+    for (u32 i = 0; i < 3; ++i) {
+        __m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri->a[i]), xs), _mm_set1_ps(tri->b[i] * y + tri->c[i]));
+        __m128 ok = (tri->own_edge & (1 << i))? _mm_cmpge_ps(e, zero) : _mm_cmpgt_ps(e, zero);
+        inside = _mm_and_ps(inside, ok);
+    }
+
+    return _mm_movemask_ps(inside);
+}
+
+#else
+
+u32 cover_pixels(SoftTriangle* tri, float x, float y)
+{
+    u32 result = 0;
+    for (u32 lane = 0; lane < SOFT_LANES; ++lane) {
+        bool inside = true;
+        for (u32 i = 0; i < 3; ++i) {
+            float e = tri->a[i] * (x + lane) + (tri->b[i] * y + tri->c[i]);
+            inside = inside && ((tri->own_edge & (1 << i))? e >= 0 : e > 0);
+        }
+        result |= inside << lane;
+    }
+    return result;
+}
+
+#endif
+
+// Index of the lowest set bit, mask must not be 0
+u32 lowest_bit(u32 mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Covered pixels of the triangle within the rect, calls visit(px, py) for each of them
+template<typename F>
+void raster_triangle(SoftTriangle* tri, i32 min_x, i32 min_y, i32 max_x, i32 max_y, F visit)
+{
+    min_x = int_max(min_x, tri->min_x);
+    min_y = int_max(min_y, tri->min_y);
+    max_x = max_x < tri->max_x? max_x : tri->max_x;
+    max_y = max_y < tri->max_y? max_y : tri->max_y;
+
+    for (i32 py = min_y; py <= max_y; ++py) {
+        for (i32 px = min_x; px <= max_x; px += SOFT_LANES) {
+            u32 mask = cover_pixels(tri, px + 0.5f, py + 0.5f);
+            i32 left = max_x - px + 1;
+            if (left < SOFT_LANES) {
+                mask &= (1 << left) - 1;
+            }
+
+            while (mask) {
+                u32 lane = lowest_bit(mask);
+                mask &= mask - 1;
+                visit(px + lane, py);
+            }
+        }
+    }
+}
+
+V4 sample_texture(u64 handle, V2 uv)
+{
+    if (!handle || handle > soft.texture_count) {
+        return v4(1);
+    }
+
+    SoftTexture* texture = soft.textures + (handle - 1);
+    i32 x = (i32) floor(uv.x * texture->width) % (i32) texture->width;
+    i32 y = (i32) floor(uv.y * texture->height) % (i32) texture->height;
+    x += x < 0? texture->width : 0;
+    y += y < 0? texture->height : 0;
+
+    u32 texel = texture->pixels[y * texture->width + x];
+    V4 result;
+    result.x = srgb_to_linear[texel & 0xFF];
+    result.y = srgb_to_linear[(texel >> 8) & 0xFF];
+    result.z = srgb_to_linear[(texel >> 16) & 0xFF];
+    result.w = (texel >> 24) / 255.0f;
+    return result;
+}
+
+// Nearest texel with repeat and GL_LESS compare, like the shadow map array
+float sample_shadow(SoftLight* light, V3 world_pos)
+{
+    if (!light->shadow_map) {
+        return 1;
+    }
+
+    glm::vec4 p = light->light_space * glm::vec4(world_pos.x, world_pos.y, world_pos.z, 1);
+    float u = p.x / p.w * 0.5f + 0.5f;
+    float v = p.y / p.w * 0.5f + 0.5f;
+    float depth = p.z / p.w * 0.5f + 0.5f;
+
+    i32 x = (i32) floor(u * SOFT_SHADOW_SIZE) % SOFT_SHADOW_SIZE;
+    i32 y = (i32) floor(v * SOFT_SHADOW_SIZE) % SOFT_SHADOW_SIZE;
+    x += x < 0? SOFT_SHADOW_SIZE : 0;
+    y += y < 0? SOFT_SHADOW_SIZE : 0;
+
+    return depth - SOFT_SHADOW_BIAS < light->shadow_map[y * SOFT_SHADOW_SIZE + x]? 1 : 0;
+}
+
+V3 sun_dir()
+{
+    return norm(v3(1, 2, 3));
+}
+
+// draw.frag
+V3 shade_lit(SoftTriangle* tri, SoftVertex* frag, SoftLight* lights, u32 light_count, float* alpha)
+{
+    V4 base = sample_texture(tri->texture, frag->uv);
+    V3 color = v3(base.x * frag->color.x, base.y * frag->color.y, base.z * frag->color.z);
+    *alpha = base.w;
+
+    V3 n = norm(frag->norm);
+    float diffuse = clamp(dot(n, sun_dir()), 0, 1) < 0.1f? 0 : 1;
+    V3 light = v3(0.1f + 0.6f * diffuse);
+
+    for (u32 i = 0; i < light_count; ++i) {
+        V3 pos = lights[i].pos;
+        V3 dir = lights[i].dir;
+        float fov = lights[i].fov;
+
+        V3 side = v3(-dir.y, dir.x, dir.z);
+        V3 left = norm(side * fov + dir * (1 - fov));
+
+        if (dot(dir, norm(frag->world_pos - pos)) > dot(dir, left)) {
+            float intensity = clamp(dot(norm(pos - frag->world_pos), n), 0, 1) *
+                              sample_shadow(lights + i, frag->world_pos);
+            light = light + v3(10.0f, 1.4f, 1.4f) * intensity;
+        }
+    }
+
+    return v3(color.x * light.x, color.y * light.y, color.z * light.z);
+}
+
+// model.frag
+V3 shade_model(SoftVertex* frag, V3 camera_pos)
+{
+    V3 l = sun_dir();
+    V3 n = norm(frag->norm);
+    V3 v = norm(camera_pos - frag->world_pos);
+
+    float diffuse = clamp(dot(n, l), 0, 1) < 0.1f? 0 : 1;
+    V3 reflected = l - n * (2 * dot(n, l));
+    float specular = clamp(dot(reflected * -1, v), 0, 1) < 0.98f? 0 : 1;
+
+    return frag->color * (0.1f + diffuse + specular);
+}
+
+struct SoftTileJob
+{
+    SoftTriangle* tris;
+    u32* tile_offsets;
+    u32* tile_counts;
+    u32* tile_tris;
+    u32 tiles_x;
+
+    bool clear;
+    V3 clear_color;
+    V3 camera_pos;
+    SoftLight* lights;
+    u32 light_count;
+};
+
+void shade_pixel(SoftTileJob* job, SoftTriangle* tri, i32 px, i32 py)
+{
+    float x = px + 0.5f;
+    float y = py + 0.5f;
+    float l[3];
+    for (u32 i = 0; i < 3; ++i) {
+        l[i] = (tri->a[i] * x + tri->b[i] * y + tri->c[i]) * tri->inv_area;
+    }
+
+    u32 index = py * soft.width + px;
+    float z = l[0] * tri->z[0] + l[1] * tri->z[1] + l[2] * tri->z[2];
+    // Without depth test everything passes like GL_ALWAYS, depth still gets written
+    if ((tri->flags & RENDER_DEPTH_TEST) && !(z < soft.depth[index])) {
+        return;
+    }
+
+    // Perspective correct weights
+    float p[3];
+    float sum = 0;
+    for (u32 i = 0; i < 3; ++i) {
+        p[i] = l[i] * tri->inv_w[i];
+        sum += p[i];
+    }
+    for (u32 i = 0; i < 3; ++i) {
+        p[i] /= sum;
+    }
+
+    SoftVertex frag;
+    frag.world_pos = tri->v[0].world_pos * p[0] + tri->v[1].world_pos * p[1] + tri->v[2].world_pos * p[2];
+    frag.uv = v2(tri->v[0].uv.x * p[0] + tri->v[1].uv.x * p[1] + tri->v[2].uv.x * p[2],
+                 tri->v[0].uv.y * p[0] + tri->v[1].uv.y * p[1] + tri->v[2].uv.y * p[2]);
+    frag.norm = tri->v[0].norm * p[0] + tri->v[1].norm * p[1] + tri->v[2].norm * p[2];
+    frag.color = tri->v[0].color * p[0] + tri->v[1].color * p[1] + tri->v[2].color * p[2];
+
+    V3 color;
+    float alpha = 1;
+    if (tri->shader == RenderShader_Model || tri->shader == RenderShader_RiggedModel) {
+        color = shade_model(&frag, job->camera_pos);
+    } else {
+        color = shade_lit(tri, &frag, job->lights, job->light_count, &alpha);
+    }
+
+    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) into an 8 bit target
+    V3 dst = soft.color[index];
+    soft.color[index] = v3(clamp(color.x * alpha + dst.x * (1 - alpha), 0, 1),
+                           clamp(color.y * alpha + dst.y * (1 - alpha), 0, 1),
+                           clamp(color.z * alpha + dst.z * (1 - alpha), 0, 1));
+    soft.depth[index] = z;
+}
+
+u32 pack_pixel(V3 color)
+{
+    // post.frag
+    float gamma = 1 / 2.2f;
+    u32 r = (u32) (pow(color.x, gamma) * 255 + 0.5f);
+    u32 g = (u32) (pow(color.y, gamma) * 255 + 0.5f);
+    u32 b = (u32) (pow(color.z, gamma) * 255 + 0.5f);
+    return r | (g << 8) | (b << 16) | 0xFF000000;
+}
+
+void raster_tile(void* data, u32 index)
+{
+    SoftTileJob* job = (SoftTileJob*) data;
+
+    i32 min_x = (index % job->tiles_x) * SOFT_TILE_SIZE;
+    i32 min_y = (index / job->tiles_x) * SOFT_TILE_SIZE;
+    i32 max_x = min_x + SOFT_TILE_SIZE - 1;
+    i32 max_y = min_y + SOFT_TILE_SIZE - 1;
+    max_x = max_x < (i32) soft.width - 1? max_x : soft.width - 1;
+    max_y = max_y < (i32) soft.height - 1? max_y : soft.height - 1;
+
+    if (job->clear) {
+        for (i32 y = min_y; y <= max_y; ++y) {
+            for (i32 x = min_x; x <= max_x; ++x) {
+                soft.color[y * soft.width + x] = job->clear_color;
+                soft.depth[y * soft.width + x] = 1;
+            }
+        }
+    }
+
+    u32* tris = job->tile_tris + job->tile_offsets[index];
+    for (u32 i = 0; i < job->tile_counts[index]; ++i) {
+        SoftTriangle* tri = job->tris + tris[i];
+        raster_triangle(tri, min_x, min_y, max_x, max_y, [&](i32 px, i32 py) {
+            shade_pixel(job, tri, px, py);
+        });
+    }
+
+    for (i32 y = min_y; y <= max_y; ++y) {
+        for (i32 x = min_x; x <= max_x; ++x) {
+            soft.pixels[y * soft.width + x] = pack_pixel(soft.color[y * soft.width + x]);
+        }
+    }
+}
+
+struct SoftShadowJob
+{
+    // World positions, 3 per triangle
+    V3* casters;
+    u32 caster_count;
+    SoftLight* lights;
+};
+
+void render_shadow_map(void* data, u32 index)
+{
+    SoftShadowJob* job = (SoftShadowJob*) data;
+    SoftLight* light = job->lights + index;
+    float* map = light->shadow_map;
+
+    for (u32 i = 0; i < SOFT_SHADOW_SIZE * SOFT_SHADOW_SIZE; ++i) {
+        map[i] = 1;
+    }
+
+    i32 last = SOFT_SHADOW_SIZE - 1;
+    for (u32 i = 0; i < job->caster_count; ++i) {
+        SoftVertex in[3];
+        for (u32 j = 0; j < 3; ++j) {
+            V3 pos = job->casters[3 * i + j];
+            in[j] = {};
+            in[j].clip = light->light_space * glm::vec4(pos.x, pos.y, pos.z, 1);
+        }
+
+        SoftVertex poly[4];
+        u32 count = clip_near(in, poly);
+        for (u32 j = 2; j < count; ++j) {
+            SoftTriangle tri;
+            if (!setup_triangle(&tri, poly, poly + j - 1, poly + j, SOFT_SHADOW_SIZE, SOFT_SHADOW_SIZE, false)) {
+                continue;
+            }
+
+            raster_triangle(&tri, 0, 0, last, last, [&](i32 px, i32 py) {
+                float x = px + 0.5f;
+                float y = py + 0.5f;
+                float z = 0;
+                for (u32 k = 0; k < 3; ++k) {
+                    z += (tri.a[k] * x + tri.b[k] * y + tri.c[k]) * tri.inv_area * tri.z[k];
+                }
+                float* depth = map + py * SOFT_SHADOW_SIZE + px;
+                if (z < *depth) {
+                    *depth = z;
+                }
+            });
+        }
+    }
+}
+
+struct SoftDraw
+{
+    u64 key;
+    u32 index;
+    u8* entry;
+};
+
+i32 compare_draws(const void* a, const void* b)
+{
+    SoftDraw* x = (SoftDraw*) a;
+    SoftDraw* y = (SoftDraw*) b;
+    if (x->key != y->key) {
+        return x->key < y->key? -1 : 1;
+    }
+    // Keeps push order between equal keys, like the stable sort of the opengl backend
+    return x->index < y->index? -1 : 1;
+}
+
+struct SoftTriangleList
+{
+    SoftTriangle* tris;
+    u32 count;
+    u32 cap;
+
+    V3* casters;
+    u32 caster_count;
+    u32 caster_cap;
+};
+
+void emit_triangle(SoftTriangleList* list, SoftVertex* v0, SoftVertex* v1, SoftVertex* v2,
+                   u64 texture, u32 flags, u32 shader)
+{
+    if (flags & RENDER_SHADOW_CASTER) {
+        assert(list->caster_count < list->caster_cap);
+        V3* caster = list->casters + 3 * list->caster_count;
+        caster[0] = v0->world_pos;
+        caster[1] = v1->world_pos;
+        caster[2] = v2->world_pos;
+        ++list->caster_count;
+    }
+
+    SoftVertex in[3] = { *v0, *v1, *v2 };
+    SoftVertex poly[4];
+    u32 count = clip_near(in, poly);
+    for (u32 i = 2; i < count; ++i) {
+        assert(list->count < list->cap);
+        SoftTriangle* tri = list->tris + list->count;
+        if (setup_triangle(tri, poly, poly + i - 1, poly + i, soft.width, soft.height, flags & RENDER_CULLING)) {
+            tri->texture = texture;
+            tri->flags = flags;
+            tri->shader = shader;
+            ++list->count;
+        }
+    }
+}
+
+void emit_quads(SoftTriangleList* list, Mat4* proj, Vertex* verts, u32 quad_count, u32 flags)
+{
+    for (u32 i = 0; i < quad_count; ++i) {
+        Vertex* quad = verts + 4 * i;
+        SoftVertex v[4];
+        for (u32 j = 0; j < 4; ++j) {
+            v[j] = soft_vertex(proj, quad[j].pos, quad[j].uv, quad[j].norm, quad[j].color);
+        }
+
+        // Flat attributes come from the last vertex
+        emit_triangle(list, v + 0, v + 1, v + 2, quad[2].texture, flags, RenderShader_Quad);
+        emit_triangle(list, v + 2, v + 1, v + 3, quad[3].texture, flags, RenderShader_Quad);
+    }
+}
+
+void emit_cubes(SoftTriangleList* list, Mat4* proj, CubeInstance* cubes, u32 cube_count, u32 flags)
+{
+    for (u32 i = 0; i < cube_count; ++i) {
+        CubeInstance* cube = cubes + i;
+        SoftVertex v[24];
+        for (u32 j = 0; j < 24; ++j) {
+            float* mesh = soft_cube_verts + 8 * j;
+            V3 pos = v3(cube->pos.x + mesh[0] * cube->radius.x, cube->pos.y + mesh[1] * cube->radius.y,
+                        cube->pos.z + mesh[2] * cube->radius.z);
+            v[j] = soft_vertex(proj, pos, v2(mesh[3], mesh[4]), v3(mesh[5], mesh[6], mesh[7]), cube->color);
+        }
+
+        for (u32 face = 0; face < 6; ++face) {
+            for (u32 j = 0; j < 6; j += 3) {
+                u32* f = soft_quad_face + j;
+                emit_triangle(list, v + 4 * face + f[0], v + 4 * face + f[1], v + 4 * face + f[2],
+                              cube->texture, flags, RenderShader_Cube);
+            }
+        }
+    }
+}
+
+void emit_model(SoftTriangleList* list, Mat4* proj, CommandEntryHeader* header, ModelHandle handle,
+                Mat4 trans, u32 bone_count, Mat4* bone_trans, u32 flags)
+{
+    SoftModel* model = soft.models + handle.id;
+    for (u32 i = 0; i < model->mesh_count; ++i) {
+        SoftMesh* mesh = soft.meshes + model->mesh_offset + i;
+        SoftVertex* v = (SoftVertex*) push_size(&soft.frame_arena, sizeof(SoftVertex) * mesh->vertex_count);
+
+        for (u32 j = 0; j < mesh->vertex_count; ++j) {
+            MeshVertex* vert = mesh->vertices + j;
+            glm::vec4 pos = glm::vec4(vert->pos.x, vert->pos.y, vert->pos.z, 1);
+            glm::vec4 n = glm::vec4(vert->norm.x, vert->norm.y, vert->norm.z, 0);
+
+            // model.vert with SKELETON
+            if (header->type == EntryType_DrawRiggedModel) {
+                Mat4 bone = Mat4(0);
+                for (u32 k = 0; k < MAX_BONE_INFLUENCE; ++k) {
+                    i32 id = vert->bone_ids[k];
+                    if (id >= 0 && (u32) id < bone_count) {
+                        bone += bone_trans[id] * vert->bone_weights[k];
+                    }
+                }
+                pos = bone * pos;
+                n = bone * n;
+            }
+
+            pos = trans * pos;
+            n = glm::normalize(trans * n);
+            V3 world = v3(pos.x / pos.w, pos.y / pos.w, pos.z / pos.w);
+            v[j] = soft_vertex(proj, world, vert->uv, v3(n.x, n.y, n.z), vert->color);
+        }
+
+        u32 shader = header->type == EntryType_DrawRiggedModel? RenderShader_RiggedModel : RenderShader_Model;
+        for (u32 j = 0; j + 2 < mesh->index_count; j += 3) {
+            u32* index = mesh->indices + j;
+            emit_triangle(list, v + index[0], v + index[1], v + index[2], 0, flags, shader);
+        }
+    }
+}
+
+// All lights, the SHADOW_MAP_COUNT nearest to the camera first, each of those gets a shadow map
+u32 select_soft_lights(CommandBuffer* buffer, SoftLight* pushed, u32 pushed_count, SoftLight* lights, 
+                       u32* shadow_count)
+{
+    bool* keep = (bool*) push_size(&soft.frame_arena, sizeof(bool) * pushed_count);
+    float* distance = (float*) push_size(&soft.frame_arena, sizeof(float) * pushed_count);
+    for (u32 i = 0; i < pushed_count; ++i) {
+        V3 d = pushed[i].pos - buffer->camera_pos;
+        distance[i] = dot(d, d);
+        keep[i] = true;
+    }
+
+    u32 keep_count = pushed_count;
+    while (keep_count > SHADOW_MAP_COUNT) {
+        u32 farthest = 0;
+        for (u32 i = 0; i < pushed_count; ++i) {
+            if (keep[i] && (!keep[farthest] || distance[i] > distance[farthest])) {
+                farthest = i;
+            }
+        }
+        keep[farthest] = false;
+        --keep_count;
+    }
+
+    u32 light_count = 0;
+    for (u32 pass = 0; pass < 2; ++pass) {
+        for (u32 i = 0; i < pushed_count; ++i) {
+            if (keep[i] == !pass) {
+                lights[light_count] = pushed[i];
+                lights[light_count].shadow_map = NULL;
+                if (!pass) {
+                    lights[light_count].shadow_map = (float*)
+                        push_size(&soft.frame_arena, sizeof(float) * SOFT_SHADOW_SIZE * SOFT_SHADOW_SIZE);
+                }
+                ++light_count;
+            }
+        }
+    }
+
+    *shadow_count = keep_count;
+    return light_count;
+}
+
+void soft_render_commands(CommandBuffer* buffer)
+{
+    LogEntryInfo info = start_log(LogTarget_Backend);
+
+    dispose(&soft.frame_arena);
+    if (buffer->settings.width != soft.width || buffer->settings.height != soft.height) {
+        resize_framebuffer(buffer->settings.width, buffer->settings.height);
+    }
+
+    // Spilled vertices get copied behind the first chunk so vert_offset can index them directly
+    Vertex* stream = buffer->first_verts->verts;
+    if (buffer->first_verts->next) {
+        stream = (Vertex*) push_size(&soft.frame_arena, sizeof(Vertex) * buffer->vert_count);
+        Vertex* dst = stream;
+        for (VertexChunk* chunk = buffer->first_verts; chunk; chunk = chunk->next) {
+            for (u32 i = 0; i < chunk->count; ++i) {
+                *dst++ = chunk->verts[i];
+            }
+        }
+    }
+
+    bool clear = false;
+    V3 clear_color = v3(0);
+    u32 pushed_count = 0;
+    u32 pushed_cap = buffer->entry_size / sizeof(CommandEntryPushLight) + 1;
+    SoftLight* pushed = (SoftLight*) push_size(&soft.frame_arena, sizeof(SoftLight) * pushed_cap);
+
+    // Clears and lights go first, draws get collected for sorting. Triangles get counted on the way.
+    u32 draw_count = 0;
+    u32 draw_cap = buffer->entry_size / sizeof(CommandEntryHeader) + 1;
+    SoftDraw* draws = (SoftDraw*) push_size(&soft.frame_arena, sizeof(SoftDraw) * draw_cap);
+    u32 tri_cap = 0;
+
+    for (CommandChunk* chunk = buffer->first_chunk; chunk; chunk = chunk->next) {
+        u32 offset = 0;
+        while (offset < chunk->size) {
+            u8* entry = chunk->data + offset;
+            CommandEntryHeader* header = (CommandEntryHeader*) entry;
+
+            switch (header->type) {
+                case EntryType_Clear: {
+                    CommandEntryClear* entry_clear = (CommandEntryClear*) entry;
+                    offset += sizeof(CommandEntryClear);
+                    clear = true;
+                    clear_color = entry_clear->color;
+                } break;
+
+                case EntryType_DrawQuads: {
+                    offset += sizeof(CommandEntryDrawQuads);
+                    tri_cap += 2 * ((CommandEntryDrawQuads*) entry)->quad_count;
+                } break;
+
+                case EntryType_DrawCubes: {
+                    offset += sizeof(CommandEntryDrawCubes);
+                    tri_cap += 12 * ((CommandEntryDrawCubes*) entry)->cube_count;
+                } break;
+
+                case EntryType_DrawStaticBatch: {
+                    offset += sizeof(CommandEntryDrawStaticBatch);
+                    tri_cap += soft.static_batches[((CommandEntryDrawStaticBatch*) entry)->batch.id].vertex_count / 2;
+                } break;
+
+                case EntryType_DrawModel:
+                case EntryType_DrawRiggedModel: {
+                    ModelHandle handle;
+                    if (header->type == EntryType_DrawModel) {
+                        offset += sizeof(CommandEntryDrawModel);
+                        handle = ((CommandEntryDrawModel*) entry)->model;
+                    } else {
+                        offset += sizeof(CommandEntryDrawRiggedModel);
+                        handle = ((CommandEntryDrawRiggedModel*) entry)->model;
+                    }
+
+                    SoftModel* model = soft.models + handle.id;
+                    for (u32 i = 0; i < model->mesh_count; ++i) {
+                        tri_cap += soft.meshes[model->mesh_offset + i].index_count / 3;
+                    }
+                } break;
+
+                case EntryType_PushLight: {
+                    CommandEntryPushLight* light = (CommandEntryPushLight*) entry;
+                    offset += sizeof(CommandEntryPushLight);
+
+                    assert(pushed_count < pushed_cap);
+                    pushed[pushed_count].pos = light->pos;
+                    pushed[pushed_count].dir = light->dir;
+                    pushed[pushed_count].fov = light->fov;
+                    pushed[pushed_count].light_space = light->light_space;
+                    ++pushed_count;
+                } break;
+
+                default: {
+                    end_log(info);
+                    return;
+                }
+            }
+
+            if (header->type != EntryType_Clear && header->type != EntryType_PushLight) {
+                draws[draw_count].key = header->sort_key;
+                draws[draw_count].index = draw_count;
+                draws[draw_count].entry = entry;
+                ++draw_count;
+            }
+        }
+    }
+
+    qsort(draws, draw_count, sizeof(SoftDraw), compare_draws);
+
+    SoftLight* lights = (SoftLight*) push_size(&soft.frame_arena, sizeof(SoftLight) * pushed_count);
+    u32 shadow_count;
+    u32 light_count = select_soft_lights(buffer, pushed, pushed_count, lights, &shadow_count);
+
+    // Near plane clipping splits a triangle into two at most
+    SoftTriangleList list = {};
+    list.cap = 2 * tri_cap;
+    list.tris = (SoftTriangle*) push_size(&soft.frame_arena, sizeof(SoftTriangle) * list.cap);
+    list.caster_cap = tri_cap;
+    list.casters = (V3*) push_size(&soft.frame_arena, sizeof(V3) * 3 * list.caster_cap);
+
+    // Triangle setup counts towards the main pass, the casters come out of it as well
+    LogEntryInfo main_info = start_log(LogTarget_MainPass);
+    Mat4 proj = buffer->proj;
+    for (u32 i = 0; i < draw_count; ++i) {
+        CommandEntryHeader* header = (CommandEntryHeader*) draws[i].entry;
+
+        switch (header->type) {
+            case EntryType_DrawQuads: {
+                CommandEntryDrawQuads* draw = (CommandEntryDrawQuads*) header;
+                emit_quads(&list, &proj, stream + draw->vert_offset, draw->quad_count, draw->setup.flags);
+            } break;
+
+            case EntryType_DrawCubes: {
+                CommandEntryDrawCubes* draw = (CommandEntryDrawCubes*) header;
+                emit_cubes(&list, &proj, buffer->cube_buffer + draw->cube_offset, draw->cube_count,
+                           draw->setup.flags);
+            } break;
+
+            case EntryType_DrawStaticBatch: {
+                CommandEntryDrawStaticBatch* draw = (CommandEntryDrawStaticBatch*) header;
+                SoftStaticBatch* batch = soft.static_batches + draw->batch.id;
+                emit_quads(&list, &proj, batch->vertices, batch->vertex_count / 4, draw->setup.flags);
+            } break;
+
+            case EntryType_DrawModel: {
+                CommandEntryDrawModel* draw = (CommandEntryDrawModel*) header;
+                // The opengl backend leaves models out of the shadow pass
+                emit_model(&list, &proj, header, draw->model, draw->trans, 0, NULL,
+                           draw->setup.flags & ~RENDER_SHADOW_CASTER);
+            } break;
+
+            case EntryType_DrawRiggedModel: {
+                CommandEntryDrawRiggedModel* draw = (CommandEntryDrawRiggedModel*) header;
+                emit_model(&list, &proj, header, draw->model, draw->trans, draw->bone_count, draw->bone_trans,
+                           draw->setup.flags & ~RENDER_SHADOW_CASTER);
+            } break;
+        }
+    }
+
+    end_log(main_info);
+
+    SoftShadowJob shadow_job;
+    shadow_job.casters = list.casters;
+    shadow_job.caster_count = list.caster_count;
+    shadow_job.lights = lights;
+    LogEntryInfo shadow_info = start_log(LogTarget_ShadowPass);
+    run_parallel(shadow_count, render_shadow_map, &shadow_job);
+    end_log(shadow_info);
+
+    main_info = start_log(LogTarget_MainPass);
+
+    // Count, prefix sum, fill, so every tile gets its triangles in draw order
+    SoftTileJob job;
+    job.tiles_x = (soft.width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    u32 tiles_y = (soft.height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    u32 tile_count = job.tiles_x * tiles_y;
+    job.tile_counts = (u32*) push_size(&soft.frame_arena, sizeof(u32) * tile_count);
+    job.tile_offsets = (u32*) push_size(&soft.frame_arena, sizeof(u32) * tile_count);
+    for (u32 i = 0; i < tile_count; ++i) {
+        job.tile_counts[i] = 0;
+    }
+
+    for (u32 i = 0; i < list.count; ++i) {
+        SoftTriangle* tri = list.tris + i;
+        for (i32 y = tri->min_y / SOFT_TILE_SIZE; y <= tri->max_y / SOFT_TILE_SIZE; ++y) {
+            for (i32 x = tri->min_x / SOFT_TILE_SIZE; x <= tri->max_x / SOFT_TILE_SIZE; ++x) {
+                ++job.tile_counts[x + y * job.tiles_x];
+            }
+        }
+    }
+
+    u32 binned = 0;
+    for (u32 i = 0; i < tile_count; ++i) {
+        job.tile_offsets[i] = binned;
+        binned += job.tile_counts[i];
+        job.tile_counts[i] = 0;
+    }
+
+    job.tile_tris = (u32*) push_size(&soft.frame_arena, sizeof(u32) * (binned + 1));
+    for (u32 i = 0; i < list.count; ++i) {
+        SoftTriangle* tri = list.tris + i;
+        for (i32 y = tri->min_y / SOFT_TILE_SIZE; y <= tri->max_y / SOFT_TILE_SIZE; ++y) {
+            for (i32 x = tri->min_x / SOFT_TILE_SIZE; x <= tri->max_x / SOFT_TILE_SIZE; ++x) {
+                u32 tile = x + y * job.tiles_x;
+                job.tile_tris[job.tile_offsets[tile] + job.tile_counts[tile]] = i;
+                ++job.tile_counts[tile];
+            }
+        }
+    }
+
+    job.tris = list.tris;
+    job.clear = clear;
+    job.clear_color = clear_color;
+    job.camera_pos = buffer->camera_pos;
+    job.lights = lights;
+    job.light_count = light_count;
+    // The post pass runs per tile as well, it ends up in here
+    run_parallel(tile_count, raster_tile, &job);
+    end_log(main_info);
+
+    end_log(info);
+}
+
+void soft_load_texture(TextureLoadOp* load_op)
+{
+    assert(soft.texture_count < SOFT_TEXTURE_CAP);
+    SoftTexture* texture = soft.textures + soft.texture_count;
+    texture->width = load_op->width;
+    texture->height = load_op->height;
+    texture->pixels = (u32*) push_size(&soft.arena, sizeof(u32) * texture->width * texture->height);
+
+    u32 channels = load_op->num_channels;
+    for (u32 i = 0; i < texture->width * texture->height; ++i) {
+        u8* texel = load_op->data + channels * i;
+        u32 r = texel[0];
+        u32 g = channels > 1? texel[1] : r;
+        u32 b = channels > 2? texel[2] : r;
+        u32 a = channels > 3? texel[3] : 255;
+        texture->pixels[i] = r | (g << 8) | (b << 16) | (a << 24);
+    }
+
+    ++soft.texture_count;
+    load_op->handle->id = soft.texture_count;
+}
+
+void soft_load_model(ModelLoadOp* load_op)
+{
+    assert(soft.model_count < SOFT_MODEL_CAP);
+    SoftModel* model = soft.models + soft.model_count;
+    model->mesh_offset = soft.mesh_count;
+    model->mesh_count = load_op->mesh_count;
+
+    for (u32 i = 0; i < load_op->mesh_count; ++i) {
+        assert(soft.mesh_count < SOFT_MESH_CAP);
+        MeshInfo* info = load_op->meshes + i;
+        SoftMesh* mesh = soft.meshes + soft.mesh_count;
+
+        mesh->vertex_count = info->vertex_count;
+        mesh->vertices = (MeshVertex*) push_size(&soft.arena, sizeof(MeshVertex) * info->vertex_count);
+        for (u32 j = 0; j < info->vertex_count; ++j) {
+            mesh->vertices[j] = info->vertex_buffer[j];
+        }
+
+        mesh->index_count = info->index_count;
+        mesh->indices = (u32*) push_size(&soft.arena, sizeof(u32) * info->index_count);
+        for (u32 j = 0; j < info->index_count; ++j) {
+            mesh->indices[j] = info->index_buffer[j];
+        }
+
+        ++soft.mesh_count;
+    }
+
+    load_op->handle->id = soft.model_count;
+    ++soft.model_count;
+}
+
+void soft_load_static_batch(StaticBatchLoadOp* load_op)
+{
+    StaticBatchHandle* handle = load_op->handle;
+    if (!handle->id) {
+        assert(soft.static_batch_count < SOFT_STATIC_BATCH_CAP);
+        handle->id = soft.static_batch_count;
+        ++soft.static_batch_count;
+    }
+
+    // Replaced batches stay in the arena, levels do not change often enough to matter
+    SoftStaticBatch* batch = soft.static_batches + handle->id;
+    batch->vertex_count = load_op->vertex_count;
+    batch->vertices = (Vertex*) push_size(&soft.arena, sizeof(Vertex) * load_op->vertex_count);
+    for (u32 i = 0; i < load_op->vertex_count; ++i) {
+        batch->vertices[i] = load_op->vertices[i];
+    }
+}
+
+RenderBackend soft_backend()
+{
+    RenderBackend backend;
+    backend.begin_frame = soft_begin_frame;
+    backend.render_commands = soft_render_commands;
+    backend.load_texture = soft_load_texture;
+    backend.load_model = soft_load_model;
+    backend.load_static_batch = soft_load_static_batch;
+    return backend;
+}
+
+u32* soft_framebuffer(u32* width, u32* height)
+{
+    *width = soft.width;
+    *height = soft.height;
+    return soft.pixels;
+}
+
+bool soft_write_ppm(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", soft.width, soft.height);
+    for (i32 y = soft.height - 1; y >= 0; --y) {
+        for (u32 x = 0; x < soft.width; ++x) {
+            u32 pixel = soft.pixels[y * soft.width + x];
+            u8 rgb[3] = { (u8) pixel, (u8) (pixel >> 8), (u8) (pixel >> 16) };
+            fwrite(rgb, 1, 3, file);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+void soft_report_scaling(CommandBuffer* buffer, u32 repeat)
+{
+    u32 max_threads = thread_count();
+    double single = 0;
+    printf("Soft rasterizer, %u pixels per edge test\n", SOFT_LANES);
+
+    for (u32 threads = 1; ; threads *= 2) {
+        threads = threads < max_threads? threads : max_threads;
+        set_thread_limit(threads);
+
+        double start = wall_time();
+        for (u32 i = 0; i < repeat; ++i) {
+            soft_render_commands(buffer);
+        }
+        double duration = (wall_time() - start) / repeat;
+        if (threads == 1) {
+            single = duration;
+        }
+
+        printf("Soft rasterizer, %u threads: %.2f ms per frame, %.2fx\n", threads, duration * 1000,
+               single / duration);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    set_thread_limit(max_threads);
+}
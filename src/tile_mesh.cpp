@@ -0,0 +1,161 @@
+#include "include/tile_mesh.h"
+
+#include <assert.h>
+
+struct FaceDir
+{
+    // Axis the face points along and the direction
+    u32 normal;
+    i32 sign;
+
+    // Axes the uvs run along, u goes backwards along its axis if u_sign < 0
+    u32 u;
+    i32 u_sign;
+    u32 v;
+};
+
+// Same uv layout as push_cube. Faces pointing down are missing on purpose.
+FaceDir face_dirs[] = {
+    { 2,  1, 0,  1, 1 },
+    { 0,  1, 1,  1, 2 },
+    { 0, -1, 1, -1, 2 },
+    { 1,  1, 0, -1, 2 },
+    { 1, -1, 0,  1, 2 },
+};
+
+u32 tile_mesh_vertex_cap(TileMap* map)
+{
+    return map->width * map->height * map->depth * 5 * 4;
+}
+
+MeshTile* get_tile(TileMap* map, i32* p)
+{
+    u32 size[3] = { map->width, map->height, map->depth };
+    for (u32 i = 0; i < 3; ++i) {
+        if (p[i] < 0 || p[i] >= (i32) size[i]) {
+            return NULL;
+        }
+    }
+    return map->tiles + (p[2] * map->height + p[1]) * map->width + p[0];
+}
+
+bool same_surface(MeshTile* a, MeshTile* b)
+{
+    return a->texture.id == b->texture.id && 
+           a->color.x == b->color.x && a->color.y == b->color.y && a->color.z == b->color.z;
+}
+
+V3 v3_from(float* p)
+{
+    return v3(p[0], p[1], p[2]);
+}
+
+u32 mesh_tile_map(TileMap* map, Vertex* vertices, u32 vertex_cap, Arena* arena)
+{
+    u32 size[3] = { map->width, map->height, map->depth };
+    float min[3] = { (float) map->min_x, (float) map->min_y, (float) map->min_z };
+    u32 vertex_count = 0;
+
+    u32 mask_cap = 0;
+    for (u32 i = 0; i < 3; ++i) {
+        for (u32 j = 0; j < 3; ++j) {
+            if (i != j && size[i] * size[j] > mask_cap) {
+                mask_cap = size[i] * size[j];
+            }
+        }
+    }
+    MeshTile** mask = (MeshTile**) push_size(arena, sizeof(MeshTile*) * mask_cap);
+
+    for (u32 f = 0; f < sizeof(face_dirs) / sizeof(FaceDir); ++f) {
+        FaceDir* dir = face_dirs + f;
+        u32 u_size = size[dir->u];
+        u32 v_size = size[dir->v];
+
+        for (u32 d = 0; d < size[dir->normal]; ++d) {
+            // Faces of this slice that are not covered by a neighbour
+            for (u32 b = 0; b < v_size; ++b) {
+                for (u32 a = 0; a < u_size; ++a) {
+                    i32 p[3];
+                    p[dir->normal] = d;
+                    p[dir->u] = a;
+                    p[dir->v] = b;
+                    MeshTile* tile = get_tile(map, p);
+
+                    p[dir->normal] += dir->sign;
+                    MeshTile* neighbour = get_tile(map, p);
+
+                    bool visible = tile->solid && !(neighbour && neighbour->solid);
+                    mask[b * u_size + a] = visible ? tile : NULL;
+                }
+            }
+
+            // Grow every face along u first, then along v as long as whole rows match
+            for (u32 b = 0; b < v_size; ++b) {
+                for (u32 a = 0; a < u_size;) {
+                    MeshTile* tile = mask[b * u_size + a];
+                    if (!tile) {
+                        ++a;
+                        continue;
+                    }
+
+                    u32 w = 1;
+                    while (a + w < u_size && mask[b * u_size + a + w] && 
+                           same_surface(mask[b * u_size + a + w], tile)) {
+                        ++w;
+                    }
+
+                    u32 h = 1;
+                    for (; b + h < v_size; ++h) {
+                        bool row = true;
+                        for (u32 k = 0; k < w && row; ++k) {
+                            MeshTile* next = mask[(b + h) * u_size + a + k];
+                            row = next && same_surface(next, tile);
+                        }
+                        if (!row) {
+                            break;
+                        }
+                    }
+
+                    for (u32 j = 0; j < h; ++j) {
+                        for (u32 k = 0; k < w; ++k) {
+                            mask[(b + j) * u_size + a + k] = NULL;
+                        }
+                    }
+
+                    float u_lo = min[dir->u] + a - 0.5;
+                    float u_hi = min[dir->u] + a + w - 0.5;
+                    float v_lo = min[dir->v] + b - 0.5;
+                    float v_hi = min[dir->v] + b + h - 0.5;
+                    float u0 = dir->u_sign > 0 ? u_lo : u_hi;
+                    float u1 = dir->u_sign > 0 ? u_hi : u_lo;
+
+                    float corners[4][3];
+                    float us[4] = { u0, u0, u1, u1 };
+                    float vs[4] = { v_lo, v_hi, v_lo, v_hi };
+                    V2 uvs[4] = { v2(0, 0), v2(0, h), v2(w, 0), v2(w, h) };
+                    float normal[3] = {};
+                    normal[dir->normal] = dir->sign;
+
+                    assert(vertex_count + 4 <= vertex_cap);
+                    for (u32 i = 0; i < 4; ++i) {
+                        corners[i][dir->normal] = min[dir->normal] + d + 0.5 * dir->sign;
+                        corners[i][dir->u] = us[i];
+                        corners[i][dir->v] = vs[i];
+
+                        Vertex* vertex = vertices + vertex_count + i;
+                        vertex->pos = v3_from(corners[i]);
+                        vertex->uv = uvs[i];
+                        vertex->norm = v3_from(normal);
+                        vertex->color = tile->color;
+                        vertex->texture = tile->texture.id;
+                    }
+                    vertex_count += 4;
+
+                    a += w;
+                }
+            }
+        }
+    }
+
+    return vertex_count;
+}
@@ -3,6 +3,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BOX_TEST_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOX_TEST_SSE2
+#endif
 
 // the flen-th byte is 0
 char* read_file(const char* file, i32* flen, Arena* arena)
@@ -84,8 +93,8 @@ i32 read_int(const char** ptr)
 
 bool hit_bounding_box(V3 pos, V3 dir, V3 box_pos, V3 box_r, V3* hit, float* t)
 {
-    V3 min_b = v3(box_pos.x - box_r.x, box_pos.y - box_r.y, box_pos.z - box_pos.z);
-    V3 max_b = v3(box_pos.x + box_r.x, box_pos.y + box_r.y, box_pos.z + box_pos.z);
+    V3 min_b = v3(box_pos.x - box_r.x, box_pos.y - box_r.y, box_pos.z - box_r.z);
+    V3 max_b = v3(box_pos.x + box_r.x, box_pos.y + box_r.y, box_pos.z + box_r.z);
 
 	bool inside = true;
 	u8 quadrant[3];
@@ -108,6 +117,7 @@ bool hit_bounding_box(V3 pos, V3 dir, V3 box_pos, V3 box_r, V3* hit, float* t)
 
 	if (inside)	{
 		*hit = pos;
+		*t = 0;
 		return true;
 	}
 
@@ -145,3 +155,340 @@ bool hit_bounding_box(V3 pos, V3 dir, V3 box_pos, V3 box_r, V3* hit, float* t)
 
 	return true;
 }	
+
+void set_box(BoxBatch* batch, u32 lane, V3 box_pos, V3 box_r)
+{
+    batch->pos_x[lane] = box_pos.x;
+    batch->pos_y[lane] = box_pos.y;
+    batch->pos_z[lane] = box_pos.z;
+    batch->radius_x[lane] = box_r.x;
+    batch->radius_y[lane] = box_r.y;
+    batch->radius_z[lane] = box_r.z;
+}
+
+u32 hit_bounding_boxes_scalar(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits)
+{
+    u32 result = 0;
+    for (u32 i = 0; i < count; ++i) {
+        V3 box_pos = v3(boxes->pos_x[i], boxes->pos_y[i], boxes->pos_z[i]);
+        V3 box_r = v3(boxes->radius_x[i], boxes->radius_y[i], boxes->radius_z[i]);
+
+        V3 hit;
+        float t;
+        if (hit_bounding_box(pos, dir, box_pos, box_r, &hit, &t)) {
+            result |= 1 << i;
+            hits->t[i] = t;
+            hits->hit_x[i] = hit.x;
+            hits->hit_y[i] = hit.y;
+            hits->hit_z[i] = hit.z;
+        }
+    }
+    return result;
+}
+
+Frustum frustum(Mat4 clip)
+{
+    Frustum result;
+    for (u32 i = 0; i < 3; ++i) {
+        for (u32 side = 0; side < 2; ++side) {
+            // w + row, w - row of the matrix
+            float sign = side? -1 : 1;
+            u32 plane = 2 * i + side;
+            result.a[plane] = clip[0][3] + sign * clip[0][i];
+            result.b[plane] = clip[1][3] + sign * clip[1][i];
+            result.c[plane] = clip[2][3] + sign * clip[2][i];
+            result.d[plane] = clip[3][3] + sign * clip[3][i];
+        }
+    }
+    return result;
+}
+
+bool box_in_frustum(Frustum* frustum, V3 box_pos, V3 box_r)
+{
+    for (u32 i = 0; i < 6; ++i) {
+        // Distance of the box corner furthest along the plane normal
+        float dist = frustum->a[i] * box_pos.x + frustum->b[i] * box_pos.y + frustum->c[i] * box_pos.z + 
+                     frustum->d[i];
+        float extent = fabsf(frustum->a[i]) * box_r.x + fabsf(frustum->b[i]) * box_r.y + 
+                       fabsf(frustum->c[i]) * box_r.z;
+        if (dist + extent < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+u32 boxes_in_frustum_scalar(Frustum* frustum, BoxBatch* boxes, u32 count)
+{
+    u32 result = 0;
+    for (u32 i = 0; i < count; ++i) {
+        V3 box_pos = v3(boxes->pos_x[i], boxes->pos_y[i], boxes->pos_z[i]);
+        V3 box_r = v3(boxes->radius_x[i], boxes->radius_y[i], boxes->radius_z[i]);
+        if (box_in_frustum(frustum, box_pos, box_r)) {
+            result |= 1 << i;
+        }
+    }
+    return result;
+}
+
+// NOTE: The vector versions do the exact same float operations as hit_bounding_box() 
+// per lane, so they produce bit identical results. Do not let the compiler contract 
+// pos + t * dir into an fma in only one of them.
+
+#ifdef BOX_TEST_AVX2
+
+u32 hit_bounding_boxes_simd(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits)
+{
+    float* box_pos[3] = { boxes->pos_x, boxes->pos_y, boxes->pos_z };
+    float* box_r[3] = { boxes->radius_x, boxes->radius_y, boxes->radius_z };
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    __m256 p[3];
+    __m256 d[3];
+    __m256 min_b[3];
+    __m256 max_b[3];
+    __m256 plane[3];
+    __m256 max_t[3];
+
+    for (u32 i = 0; i < 3; ++i) {
+        p[i] = _mm256_set1_ps(pos.v[i]);
+        d[i] = _mm256_set1_ps(dir.v[i]);
+
+        __m256 c = _mm256_loadu_ps(box_pos[i]);
+        __m256 r = _mm256_loadu_ps(box_r[i]);
+        min_b[i] = _mm256_sub_ps(c, r);
+        max_b[i] = _mm256_add_ps(c, r);
+
+        __m256 left = _mm256_cmp_ps(p[i], min_b[i], _CMP_LT_OQ);
+        __m256 right = _mm256_cmp_ps(p[i], max_b[i], _CMP_GT_OQ);
+        __m256 outside = _mm256_or_ps(left, right);
+        inside = _mm256_andnot_ps(outside, inside);
+
+        plane[i] = _mm256_blendv_ps(max_b[i], min_b[i], left);
+        __m256 valid = _mm256_and_ps(outside, _mm256_cmp_ps(d[i], zero, _CMP_NEQ_OQ));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(plane[i], p[i]), d[i]);
+        max_t[i] = _mm256_blendv_ps(_mm256_set1_ps(-1), t, valid);
+    }
+
+    // Largest t picks the plane, ties go to the lower axis
+    __m256 t = max_t[0];
+    __m256 pick_1 = _mm256_cmp_ps(t, max_t[1], _CMP_LT_OQ);
+    t = _mm256_blendv_ps(t, max_t[1], pick_1);
+    __m256 pick_2 = _mm256_cmp_ps(t, max_t[2], _CMP_LT_OQ);
+    t = _mm256_blendv_ps(t, max_t[2], pick_2);
+
+    __m256 which[3];
+    which[2] = pick_2;
+    which[1] = _mm256_andnot_ps(pick_2, pick_1);
+    which[0] = _mm256_andnot_ps(_mm256_or_ps(pick_1, pick_2), _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+
+    __m256 hit = _mm256_cmp_ps(t, zero, _CMP_GE_OQ);
+    __m256 coord[3];
+    for (u32 i = 0; i < 3; ++i) {
+        coord[i] = _mm256_add_ps(p[i], _mm256_mul_ps(t, d[i]));
+        coord[i] = _mm256_blendv_ps(coord[i], plane[i], which[i]);
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(coord[i], min_b[i], _CMP_GE_OQ), 
+                                  _mm256_cmp_ps(coord[i], max_b[i], _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_or_ps(which[i], in));
+        coord[i] = _mm256_blendv_ps(coord[i], p[i], inside);
+    }
+
+    hit = _mm256_or_ps(hit, inside);
+    t = _mm256_blendv_ps(t, zero, inside);
+
+    _mm256_storeu_ps(hits->t, t);
+    _mm256_storeu_ps(hits->hit_x, coord[0]);
+    _mm256_storeu_ps(hits->hit_y, coord[1]);
+    _mm256_storeu_ps(hits->hit_z, coord[2]);
+
+    return _mm256_movemask_ps(hit) & ((1 << count) - 1);
+}
+
+u32 boxes_in_frustum_simd(Frustum* frustum, BoxBatch* boxes, u32 count)
+{
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    __m256 c_x = _mm256_loadu_ps(boxes->pos_x);
+    __m256 c_y = _mm256_loadu_ps(boxes->pos_y);
+    __m256 c_z = _mm256_loadu_ps(boxes->pos_z);
+    __m256 r_x = _mm256_loadu_ps(boxes->radius_x);
+    __m256 r_y = _mm256_loadu_ps(boxes->radius_y);
+    __m256 r_z = _mm256_loadu_ps(boxes->radius_z);
+
+    for (u32 i = 0; i < 6; ++i) {
+        __m256 a = _mm256_set1_ps(frustum->a[i]);
+        __m256 b = _mm256_set1_ps(frustum->b[i]);
+        __m256 c = _mm256_set1_ps(frustum->c[i]);
+
+        __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, c_x), _mm256_mul_ps(b, c_y)), 
+                                                  _mm256_mul_ps(c, c_z)), 
+                                    _mm256_set1_ps(frustum->d[i]));
+        __m256 extent = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_andnot_ps(sign, a), r_x), 
+                                                    _mm256_mul_ps(_mm256_andnot_ps(sign, b), r_y)), 
+                                      _mm256_mul_ps(_mm256_andnot_ps(sign, c), r_z));
+        __m256 out = _mm256_cmp_ps(_mm256_add_ps(dist, extent), zero, _CMP_LT_OQ);
+        inside = _mm256_andnot_ps(out, inside);
+    }
+
+    return _mm256_movemask_ps(inside) & ((1 << count) - 1);
+}
+
+#elif defined(BOX_TEST_SSE2)
+
+inline __m128 select_ps(__m128 a, __m128 b, __m128 mask)
+{
+    return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+u32 hit_bounding_boxes_4(V3 pos, V3 dir, BoxBatch* boxes, u32 offset, BoxBatchHits* hits)
+{
+    float* box_pos[3] = { boxes->pos_x, boxes->pos_y, boxes->pos_z };
+    float* box_r[3] = { boxes->radius_x, boxes->radius_y, boxes->radius_z };
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 inside = all;
+
+    __m128 p[3];
+    __m128 d[3];
+    __m128 min_b[3];
+    __m128 max_b[3];
+    __m128 plane[3];
+    __m128 max_t[3];
+
+    for (u32 i = 0; i < 3; ++i) {
+        p[i] = _mm_set1_ps(pos.v[i]);
+        d[i] = _mm_set1_ps(dir.v[i]);
+
+        __m128 c = _mm_loadu_ps(box_pos[i] + offset);
+        __m128 r = _mm_loadu_ps(box_r[i] + offset);
+        min_b[i] = _mm_sub_ps(c, r);
+        max_b[i] = _mm_add_ps(c, r);
+
+        __m128 left = _mm_cmplt_ps(p[i], min_b[i]);
+        __m128 right = _mm_cmpgt_ps(p[i], max_b[i]);
+        __m128 outside = _mm_or_ps(left, right);
+        inside = _mm_andnot_ps(outside, inside);
+
+        plane[i] = select_ps(max_b[i], min_b[i], left);
+        __m128 valid = _mm_and_ps(outside, _mm_cmpneq_ps(d[i], zero));
+        __m128 t = _mm_div_ps(_mm_sub_ps(plane[i], p[i]), d[i]);
+        max_t[i] = select_ps(_mm_set1_ps(-1), t, valid);
+    }
+
+    // Largest t picks the plane, ties go to the lower axis
+    __m128 t = max_t[0];
+    __m128 pick_1 = _mm_cmplt_ps(t, max_t[1]);
+    t = select_ps(t, max_t[1], pick_1);
+    __m128 pick_2 = _mm_cmplt_ps(t, max_t[2]);
+    t = select_ps(t, max_t[2], pick_2);
+
+    __m128 which[3];
+    which[2] = pick_2;
+    which[1] = _mm_andnot_ps(pick_2, pick_1);
+    which[0] = _mm_andnot_ps(_mm_or_ps(pick_1, pick_2), all);
+
+    __m128 hit = _mm_cmpge_ps(t, zero);
+    __m128 coord[3];
+    for (u32 i = 0; i < 3; ++i) {
+        coord[i] = _mm_add_ps(p[i], _mm_mul_ps(t, d[i]));
+        coord[i] = select_ps(coord[i], plane[i], which[i]);
+        __m128 in = _mm_and_ps(_mm_cmpge_ps(coord[i], min_b[i]), _mm_cmple_ps(coord[i], max_b[i]));
+        hit = _mm_and_ps(hit, _mm_or_ps(which[i], in));
+        coord[i] = select_ps(coord[i], p[i], inside);
+    }
+
+    hit = _mm_or_ps(hit, inside);
+    t = select_ps(t, zero, inside);
+
+    _mm_storeu_ps(hits->t + offset, t);
+    _mm_storeu_ps(hits->hit_x + offset, coord[0]);
+    _mm_storeu_ps(hits->hit_y + offset, coord[1]);
+    _mm_storeu_ps(hits->hit_z + offset, coord[2]);
+
+    return _mm_movemask_ps(hit) << offset;
+}
+
+u32 hit_bounding_boxes_simd(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits)
+{
+    u32 result = hit_bounding_boxes_4(pos, dir, boxes, 0, hits);
+    if (count > 4) {
+        result |= hit_bounding_boxes_4(pos, dir, boxes, 4, hits);
+    }
+    return result & ((1 << count) - 1);
+}
+
+u32 boxes_in_frustum_4(Frustum* frustum, BoxBatch* boxes, u32 offset)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+    __m128 c_x = _mm_loadu_ps(boxes->pos_x + offset);
+    __m128 c_y = _mm_loadu_ps(boxes->pos_y + offset);
+    __m128 c_z = _mm_loadu_ps(boxes->pos_z + offset);
+    __m128 r_x = _mm_loadu_ps(boxes->radius_x + offset);
+    __m128 r_y = _mm_loadu_ps(boxes->radius_y + offset);
+    __m128 r_z = _mm_loadu_ps(boxes->radius_z + offset);
+
+    for (u32 i = 0; i < 6; ++i) {
+        __m128 a = _mm_set1_ps(frustum->a[i]);
+        __m128 b = _mm_set1_ps(frustum->b[i]);
+        __m128 c = _mm_set1_ps(frustum->c[i]);
+
+        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, c_x), _mm_mul_ps(b, c_y)), 
+                                            _mm_mul_ps(c, c_z)), 
+                                 _mm_set1_ps(frustum->d[i]));
+        __m128 extent = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, a), r_x), 
+                                              _mm_mul_ps(_mm_andnot_ps(sign, b), r_y)), 
+                                   _mm_mul_ps(_mm_andnot_ps(sign, c), r_z));
+        __m128 out = _mm_cmplt_ps(_mm_add_ps(dist, extent), zero);
+        inside = _mm_andnot_ps(out, inside);
+    }
+
+    return _mm_movemask_ps(inside) << offset;
+}
+
+u32 boxes_in_frustum_simd(Frustum* frustum, BoxBatch* boxes, u32 count)
+{
+    u32 result = boxes_in_frustum_4(frustum, boxes, 0);
+    if (count > 4) {
+        result |= boxes_in_frustum_4(frustum, boxes, 4);
+    }
+    return result & ((1 << count) - 1);
+}
+
+#else
+
+u32 hit_bounding_boxes_simd(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits)
+{
+    return hit_bounding_boxes_scalar(pos, dir, boxes, count, hits);
+}
+
+u32 boxes_in_frustum_simd(Frustum* frustum, BoxBatch* boxes, u32 count)
+{
+    return boxes_in_frustum_scalar(frustum, boxes, count);
+}
+
+#endif
+
+u32 hit_bounding_boxes(V3 pos, V3 dir, BoxBatch* boxes, u32 count, BoxBatchHits* hits)
+{
+    // A single box is cheaper to test without setting up the vector registers
+    if (count < 2) {
+        return hit_bounding_boxes_scalar(pos, dir, boxes, count, hits);
+    }
+    return hit_bounding_boxes_simd(pos, dir, boxes, count, hits);
+}
+
+u32 boxes_in_frustum(Frustum* frustum, BoxBatch* boxes, u32 count)
+{
+    if (count < 2) {
+        return boxes_in_frustum_scalar(frustum, boxes, count);
+    }
+    return boxes_in_frustum_simd(frustum, boxes, count);
+}
@@ -0,0 +1,272 @@
+#include "include/visibility.h"
+
+#include "include/game_math.h"
+#include "include/workers.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// Rays get cast this far (in radians) to both sides of every end point, to look past corners
+#define VISIBILITY_EPSILON 0.0001
+
+inline V2 sub(V2 a, V2 b)
+{
+    return v2(a.x - b.x, a.y - b.y);
+}
+
+// Counter clockwise angle from dir to v
+float angle_to(V2 dir, V2 v)
+{
+    return atan2(cross(dir, v), dot(dir, v));
+}
+
+i32 compare_angles(const void* a, const void* b)
+{
+    float x = *(float*) a;
+    float y = *(float*) b;
+    return (x > y) - (x < y);
+}
+
+u32 visibility_point_cap(u32 edge_count)
+{
+    return 6 * edge_count + 2;
+}
+
+void compute_visibility(VisibilityEdge* edges, u16* subset, u32 edge_count, V2 origin, V2 dir, 
+                        float half_angle, VisibilityClip* clip, VisibilityPolygon* polygon)
+{
+    polygon->origin = origin;
+    polygon->clip = clip;
+    polygon->point_count = 0;
+
+    // Only edges facing the origin and reaching into the cone can be seen
+    Arena* scratch = scratch_arena();
+    u16* visible = (u16*) push_size(scratch, sizeof(u16) * edge_count);
+    V2* visible_start = (V2*) push_size(scratch, sizeof(V2) * edge_count);
+    V2* visible_span = (V2*) push_size(scratch, sizeof(V2) * edge_count);
+    u32 visible_count = 0;
+
+    float* angles = (float*) push_size(scratch, sizeof(float) * visibility_point_cap(edge_count));
+    u32 angle_count = 0;
+    angles[angle_count++] = -half_angle;
+    angles[angle_count++] = half_angle;
+
+    // Borders of the cone. Only a cone narrower than a half plane lies on one side of them.
+    float c = cos(half_angle);
+    float s = sin(half_angle);
+    V2 left = v2(dir.x * c - dir.y * s, dir.x * s + dir.y * c);
+    V2 right = v2(dir.x * c + dir.y * s, -dir.x * s + dir.y * c);
+    bool narrow = half_angle < PI / 2;
+
+    for (u32 i = 0; i < edge_count; ++i) {
+        u16 id = subset ? subset[i] : i;
+        VisibilityEdge* edge = edges + id;
+        V2 to_a = sub(edge->a, origin);
+        V2 to_b = sub(edge->b, origin);
+        if (cross(sub(edge->b, edge->a), to_a) <= 0) {
+            continue;
+        }
+
+        if (narrow && ((cross(left, to_a) > 0 && cross(left, to_b) > 0) ||
+                       (cross(right, to_a) < 0 && cross(right, to_b) < 0))) {
+            continue;
+        }
+
+        visible[visible_count] = id;
+        visible_start[visible_count] = to_a;
+        visible_span[visible_count] = sub(edge->b, edge->a);
+        ++visible_count;
+
+        V2 ends[2] = { to_a, to_b };
+        for (u32 j = 0; j < 2; ++j) {
+            float angle = angle_to(dir, ends[j]);
+            if (angle < -half_angle || angle > half_angle) {
+                continue;
+            }
+            angles[angle_count++] = max(angle - VISIBILITY_EPSILON, -half_angle);
+            angles[angle_count++] = angle;
+            angles[angle_count++] = min(angle + VISIBILITY_EPSILON, half_angle);
+        }
+    }
+
+    qsort(angles, angle_count, sizeof(float), compare_angles);
+
+    for (u32 i = 0; i < angle_count; ++i) {
+        if (i > 0 && angles[i] == angles[i - 1]) {
+            continue;
+        }
+
+        float c = cos(angles[i]);
+        float s = sin(angles[i]);
+        V2 d = v2(dir.x * c - dir.y * s, dir.x * s + dir.y * c);
+
+        float t_min = 0;
+        if (clip) {
+            float along = dot(d, clip->normal);
+            if (along <= 0) {
+                continue;
+            }
+            t_min = dot(sub(clip->point, origin), clip->normal) / along;
+        }
+
+        VisibilityPoint* point = polygon->points + polygon->point_count;
+        ++polygon->point_count;
+        point->angle = angles[i];
+        point->edge = -1;
+
+        float t = VISIBILITY_FAR;
+        for (u32 j = 0; j < visible_count; ++j) {
+            V2 e = visible_span[j];
+            float denom = cross(d, e);
+            if (denom == 0) {
+                continue;
+            }
+
+            V2 to_edge = visible_start[j];
+            float edge_t = cross(to_edge, e) / denom;
+            float u = cross(to_edge, d) / denom;
+            if (u >= 0 && u <= 1 && edge_t > t_min && edge_t < t) {
+                t = edge_t;
+                point->edge = visible[j];
+            }
+        }
+
+        point->pos = v2(origin.x + d.x * t, origin.y + d.y * t);
+    }
+}
+
+u32 get_bucket(V2 v)
+{
+    float angle = atan2(v.y, v.x);
+    i32 bucket = (angle + PI) / (2 * PI) * VISIBILITY_BUCKET_COUNT;
+    return int_clamp(bucket, 0, VISIBILITY_BUCKET_COUNT - 1);
+}
+
+float segment_distance(V2 a, V2 b)
+{
+    V2 e = sub(b, a);
+    float t = clamp(-dot(a, e) / dot(e, e), 0, 1);
+    V2 closest = v2(a.x + e.x * t, a.y + e.y * t);
+    return sqrt(dot(closest, closest));
+}
+
+void build_visibility_cache(VisibilityCache* cache, VisibilityEdge* edges, u32 edge_count, V2 origin)
+{
+    cache->origin = origin;
+    cache->edge_count = 0;
+    for (u32 i = 0; i < VISIBILITY_BUCKET_COUNT; ++i) {
+        cache->far[i] = VISIBILITY_FAR;
+    }
+
+    // Front faces sweep clockwise from a to b. Every bucket strictly between the ends is covered
+    // and nothing in it is further away than the further end point.
+    for (u32 i = 0; i < edge_count; ++i) {
+        V2 to_a = sub(edges[i].a, origin);
+        V2 to_b = sub(edges[i].b, origin);
+        if (cross(sub(edges[i].b, edges[i].a), to_a) <= 0) {
+            continue;
+        }
+
+        float far = sqrt(max(dot(to_a, to_a), dot(to_b, to_b)));
+        u32 start = get_bucket(to_b);
+        u32 end = get_bucket(to_a);
+        for (u32 k = (start + 1) % VISIBILITY_BUCKET_COUNT; start != end && k != end; 
+             k = (k + 1) % VISIBILITY_BUCKET_COUNT) {
+            cache->far[k] = min(cache->far[k], far);
+        }
+    }
+
+    // Keep edges that come closer than the occlusion distance in any bucket they reach into
+    for (u32 i = 0; i < edge_count; ++i) {
+        V2 to_a = sub(edges[i].a, origin);
+        V2 to_b = sub(edges[i].b, origin);
+        if (cross(sub(edges[i].b, edges[i].a), to_a) <= 0) {
+            continue;
+        }
+
+        float near = segment_distance(to_a, to_b);
+        u32 end = get_bucket(to_a);
+        for (u32 k = get_bucket(to_b);; k = (k + 1) % VISIBILITY_BUCKET_COUNT) {
+            if (near <= cache->far[k]) {
+                cache->edges[cache->edge_count++] = i;
+                break;
+            }
+            if (k == end) {
+                break;
+            }
+        }
+    }
+}
+
+u32 get_wedge(VisibilityPolygon* polygon, u32 i, V2* outline)
+{
+    VisibilityPoint* p0 = polygon->points + i;
+    VisibilityPoint* p1 = polygon->points + i + 1;
+    V2 origin = polygon->origin;
+
+    if (!polygon->clip) {
+        outline[0] = origin;
+        outline[1] = p0->pos;
+        outline[2] = p1->pos;
+        return 3;
+    }
+
+    // Rays only start at the clip line
+    VisibilityClip* clip = polygon->clip;
+    VisibilityPoint* ends[2] = { p0, p1 };
+    V2 start[2];
+    for (u32 j = 0; j < 2; ++j) {
+        V2 d = sub(ends[j]->pos, origin);
+        float t = dot(sub(clip->point, origin), clip->normal) / dot(d, clip->normal);
+        start[j] = v2(origin.x + d.x * t, origin.y + d.y * t);
+    }
+
+    outline[0] = start[0];
+    outline[1] = p0->pos;
+    outline[2] = p1->pos;
+    outline[3] = start[1];
+    return 4;
+}
+
+bool convex_overlaps_box(V2* points, u32 count, V2 min_b, V2 max_b)
+{
+    V2 poly_min = points[0];
+    V2 poly_max = points[0];
+    for (u32 i = 1; i < count; ++i) {
+        poly_min = v2(min(poly_min.x, points[i].x), min(poly_min.y, points[i].y));
+        poly_max = v2(max(poly_max.x, points[i].x), max(poly_max.y, points[i].y));
+    }
+    if (poly_max.x < min_b.x || poly_min.x > max_b.x || poly_max.y < min_b.y || poly_min.y > max_b.y) {
+        return false;
+    }
+
+    V2 corners[4] = { min_b, v2(max_b.x, min_b.y), max_b, v2(min_b.x, max_b.y) };
+    for (u32 i = 0; i < count; ++i) {
+        V2 a = points[i];
+        V2 b = points[(i + 1) % count];
+        V2 axis = v2(a.y - b.y, b.x - a.x);
+
+        float poly_lo = INFINITY;
+        float poly_hi = -INFINITY;
+        for (u32 j = 0; j < count; ++j) {
+            float p = dot(axis, points[j]);
+            poly_lo = min(poly_lo, p);
+            poly_hi = max(poly_hi, p);
+        }
+
+        float box_lo = INFINITY;
+        float box_hi = -INFINITY;
+        for (u32 j = 0; j < 4; ++j) {
+            float p = dot(axis, corners[j]);
+            box_lo = min(box_lo, p);
+            box_hi = max(box_hi, p);
+        }
+
+        if (poly_hi < box_lo || box_hi < poly_lo) {
+            return false;
+        }
+    }
+
+    return true;
+}
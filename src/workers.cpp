@@ -0,0 +1,241 @@
+#include "include/workers.h"
+
+#include <thread>
+#include <condition_variable>
+
+struct Job
+{
+    ParallelFunc func;
+    void* data;
+    u32 index;
+    JobCounter* counter;
+};
+
+// Owner pushes and pops at the bottom, thieves take from the top
+struct JobDeque
+{
+    std::mutex mutex;
+    Job jobs[JOB_DEQUE_CAP];
+    u32 top;
+    u32 bottom;
+};
+
+// Deque 0 belongs to the thread that called init_workers(), worker i owns deque i + 1
+JobDeque deques[WORKER_CAP + 1];
+u32 worker_count;
+// Workers past this one sleep and leave the jobs to the others
+std::atomic<u32> active_workers;
+
+std::mutex sleep_mutex;
+std::condition_variable wake;
+// Queued in any deque, workers sleep while there are none
+std::atomic<u32> queued_jobs;
+
+thread_local i32 thread_index = -1;
+thread_local Arena scratch;
+thread_local bool scratch_ready;
+
+bool push_job(Job job)
+{
+    JobDeque* deque = deques + thread_index;
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    if (deque->bottom - deque->top == JOB_DEQUE_CAP) {
+        return false;
+    }
+
+    deque->jobs[deque->bottom % JOB_DEQUE_CAP] = job;
+    ++deque->bottom;
+    queued_jobs.fetch_add(1);
+    return true;
+}
+
+bool pop_job(JobDeque* deque, Job* job)
+{
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    if (deque->bottom == deque->top) {
+        return false;
+    }
+
+    --deque->bottom;
+    *job = deque->jobs[deque->bottom % JOB_DEQUE_CAP];
+    queued_jobs.fetch_sub(1);
+    return true;
+}
+
+bool steal_job(JobDeque* deque, Job* job)
+{
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    if (deque->bottom == deque->top) {
+        return false;
+    }
+
+    *job = deque->jobs[deque->top % JOB_DEQUE_CAP];
+    ++deque->top;
+    queued_jobs.fetch_sub(1);
+    return true;
+}
+
+bool find_job(Job* job)
+{
+    if (pop_job(deques + thread_index, job)) {
+        return true;
+    }
+
+    u32 threads = worker_count + 1;
+    for (u32 i = 1; i < threads; ++i) {
+        if (steal_job(deques + (thread_index + i) % threads, job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void wake_workers()
+{
+    {
+        // Workers check queued_jobs under this lock, so none of them can miss the notify
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    wake.notify_all();
+}
+
+void execute_job(Job* job)
+{
+    Arena* arena = scratch_arena();
+    i32 page = arena->page;
+    u32 size = arena->size;
+    u32 current = arena->pool->pages[page].current;
+
+    // The job logs on its own, so its timings end up with its counter whatever thread runs it
+    FrameLog outer;
+    collect_log(&outer);
+
+    LogEntryInfo info = start_log(LogTarget_Job);
+    job->func(job->data, job->index);
+    end_log(info);
+
+    FrameLog log;
+    collect_log(&log);
+    merge_log(&outer);
+
+    // Same as end_tmp(), but jobs may nest when a job waits on others
+    arena->tmp_page = page;
+    arena->tmp_size = size;
+    arena->tmp_current = current;
+    end_tmp(arena);
+
+    JobCounter* counter = job->counter;
+    {
+        std::lock_guard<std::mutex> lock(counter->log_mutex);
+        for (u32 i = 0; i < LogTarget_Count; ++i) {
+            counter->log.entries[i].count += log.entries[i].count;
+            counter->log.entries[i].total_duration += log.entries[i].total_duration;
+        }
+    }
+
+    counter->pending.fetch_sub(1);
+}
+
+void worker_main(u32 worker)
+{
+    thread_index = worker + 1;
+
+    while (true) {
+        Job job;
+        if (worker < active_workers && find_job(&job)) {
+            execute_job(&job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [&] { return queued_jobs.load() > 0 && worker < active_workers; });
+    }
+}
+
+void init_workers()
+{
+    u32 threads = std::thread::hardware_concurrency();
+    worker_count = threads > 1 ? threads - 1 : 0;
+    if (worker_count > WORKER_CAP) {
+        worker_count = WORKER_CAP;
+    }
+
+    active_workers = worker_count;
+    thread_index = 0;
+
+    for (u32 i = 0; i < worker_count; ++i) {
+        std::thread(worker_main, i).detach();
+    }
+}
+
+void set_thread_limit(u32 threads)
+{
+    u32 workers = threads > 1 ? threads - 1 : 0;
+    if (workers > worker_count) {
+        workers = worker_count;
+    }
+    active_workers = workers;
+    wake_workers();
+}
+
+u32 thread_count()
+{
+    return active_workers + 1;
+}
+
+void run_job(ParallelFunc func, void* data, u32 index, JobCounter* counter)
+{
+    Job job = { func, data, index, counter };
+    counter->pending.fetch_add(1);
+
+    if (thread_index < 0 || !active_workers || !push_job(job)) {
+        execute_job(&job);
+        return;
+    }
+    wake_workers();
+}
+
+void wait_for(JobCounter* counter)
+{
+    while (counter->pending.load() > 0) {
+        Job job;
+        if (thread_index >= 0 && find_job(&job)) {
+            execute_job(&job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    // Nothing adds to the log once pending is zero
+    merge_log(&counter->log);
+    counter->log = {};
+}
+
+void run_parallel(u32 count, ParallelFunc func, void* data)
+{
+    JobCounter counter = {};
+    counter.pending = count;
+
+    for (u32 i = 0; i < count; ++i) {
+        Job job = { func, data, i, &counter };
+        if (thread_index < 0 || !active_workers || count < 2 || !push_job(job)) {
+            execute_job(&job);
+        }
+    }
+    if (count > 1 && active_workers) {
+        wake_workers();
+    }
+
+    wait_for(&counter);
+}
+
+Arena* scratch_arena()
+{
+    if (!scratch_ready) {
+        init_arena(&scratch, &pool);
+        // Starts out with a page, so jobs always have one to return to
+        push_size(&scratch, 0);
+        scratch_ready = true;
+    }
+    return &scratch;
+}